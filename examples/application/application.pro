@@ -5,7 +5,7 @@ SOURCES += qmlog-example.cpp
 INCLUDEPATH += ../../src/ ../../
 
 QMAKE_LIBDIR_FLAGS += -L../../src
-LIBS += -lqmlog
+LIBS += -lqmlog -lpthread
 
 target.path = $$(DESTDIR)/usr/bin
 
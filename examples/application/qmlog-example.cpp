@@ -19,7 +19,22 @@
 #   You should have received a copy of the GNU  Lesser General Public    $
 #   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
 \_______________________________________________________________________*/
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <cstdlib>
+
 #include <string>
+#include <vector>
 using namespace std ;
 
 #include <qmlog>
@@ -30,6 +45,26 @@ void test_empty_log_macro() ;
 void test_change_log_level() ;
 void test_add_and_remove_logfile() ;
 void test_remove_default_loggers() ;
+void test_async_logging() ;
+void test_threads_logging() ;
+void test_deferred_formatting() ;
+void test_binary_file() ;
+void test_timezone_change() ;
+void test_flush_policy() ;
+void test_mmap_file() ;
+void test_rotation() ;
+void test_reopen() ;
+void test_cache_if_cant_open() ;
+void test_call_sites() ;
+void test_site_switches() ;
+void test_control_file() ;
+void test_process_name() ;
+void test_fork() ;
+void test_structured() ;
+void test_journal() ;
+void test_syslog_socket() ;
+void test_shm_ring() ;
+void test_flight_recorder() ;
 void run_all() ;
 
 int main(int argc, char *argv[])
@@ -57,9 +92,29 @@ int main(int argc, char *argv[])
     run_if_match(test_very_long_string) ;
     run_if_match(test_growing_length) ;
     run_if_match(test_remove_default_loggers) ;
+    run_if_match(test_async_logging) ;
+    run_if_match(test_threads_logging) ;
+    run_if_match(test_deferred_formatting) ;
+    run_if_match(test_binary_file) ;
+    run_if_match(test_timezone_change) ;
+    run_if_match(test_flush_policy) ;
+    run_if_match(test_mmap_file) ;
+    run_if_match(test_rotation) ;
+    run_if_match(test_reopen) ;
+    run_if_match(test_cache_if_cant_open) ;
+    run_if_match(test_call_sites) ;
+    run_if_match(test_site_switches) ;
+    run_if_match(test_control_file) ;
+    run_if_match(test_process_name) ;
+    run_if_match(test_fork) ;
+    run_if_match(test_structured) ;
+    run_if_match(test_journal) ;
+    run_if_match(test_syslog_socket) ;
+    run_if_match(test_shm_ring) ;
+    run_if_match(test_flight_recorder) ;
     else
       /* unknow function, log it as a non-critical error */
-      log_error(false, "invalid function name: '%s'", argv[i]) ;
+      log_error("invalid function name: '%s'", argv[i]) ;
 #undef  run_if_match
     }
 
@@ -82,6 +137,26 @@ void run_all(void)
   test_empty_log_macro() ;
   test_change_log_level() ;
   test_add_and_remove_logfile() ;
+  test_async_logging() ;
+  test_threads_logging() ;
+  test_deferred_formatting() ;
+  test_binary_file() ;
+  test_timezone_change() ;
+  test_flush_policy() ;
+  test_mmap_file() ;
+  test_rotation() ;
+  test_reopen() ;
+  test_cache_if_cant_open() ;
+  test_call_sites() ;
+  test_site_switches() ;
+  test_control_file() ;
+  test_process_name() ;
+  test_fork() ;
+  test_structured() ;
+  test_journal() ;
+  test_syslog_socket() ;
+  test_shm_ring() ;
+  test_flight_recorder() ;
 
   log_notice("full test done") ;
 }
@@ -109,7 +184,7 @@ void test_very_long_string()
 
   /* First check, if the format string has really N "%s" specifications */
   /* Print a message (and abort) if not */
-  log_assert(strlen(FMT)==2*N, "wrong length of the format string: %d (%d expected)", strlen(FMT), 2*N) ;
+  log_assert(strlen(FMT)==2*N, "wrong length of the format string: %d (%d expected)", (int)strlen(FMT), 2*N) ;
 
 #define ABCDEFGHIJKLMNOPQRSTUVWXYZ a,b,c,d,e,f,g,h,i,j,k,l,m,n,o,p,q,r,s,t,u,v,w,x,y,z
   typedef char *pointer_to_char_t ;
@@ -125,7 +200,7 @@ void test_very_long_string()
     x = new char [LEN+1] ; \
     x[LEN] = '\0' ; \
     for(unsigned x##x=0; x##x<LEN; ++x##x) x[x##x] = #x[0] ; \
-    log_assert(strlen(x)==LEN, "wrong length of the string variable %s: %d (%d expected)", #x, strlen(x), LEN) ; \
+    log_assert(strlen(x)==LEN, "wrong length of the string variable %s: %d (%d expected)", #x, (int)strlen(x), LEN) ; \
   } while(0)
 
   /* now execute this macro N=26 times */
@@ -317,3 +392,1243 @@ void test_remove_default_loggers()
   delete qmlog::syslog() ;
   log_notice("this message shouldn't be visible") ;
 }
+
+int count_lines(const char *path)
+{
+  FILE *fp = fopen(path, "r") ;
+  log_assert(fp!=NULL, "can't read '%s': %m", path) ;
+  int lines = 0 ;
+  for (int c; (c=fgetc(fp))!=EOF; )
+    lines += c=='\n' ;
+  fclose(fp) ;
+  return lines ;
+}
+
+void test_async_logging()
+{
+  /* A dispatcher can leave the writing to a background thread */
+
+  /* Use an own dispatcher, so the default logs are not flooded */
+  const char *path = "/tmp/test_async_logging.log" ;
+  unlink(path) ;
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  qmlog::log_file *file = new qmlog::log_file(path, qmlog::Full, d) ;
+  file->set_fields(qmlog::Message) ;
+
+  /* A tiny queue: the callers have to wait for the writer all the time */
+  log_notice("logging through a blocking queue, nothing may be lost") ;
+  const int N = 1000 ;
+  d->set_async(4, qmlog::Block_If_Full) ;
+  for (int i=0; i<N; ++i)
+    d->message(qmlog::Debug, "blocking queue, message #%d", i) ;
+  d->flush() ;
+  log_assert(count_lines(path)==N, "%d lines expected in %s", N, path) ;
+  log_assert(d->dropped()==0) ;
+
+  /* Messages may be lost now, but each of them is either written or counted */
+  log_notice("logging through a dropping queue") ;
+  d->set_async(4, qmlog::Drop_Oldest) ;
+  for (int i=0; i<N; ++i)
+    d->message(qmlog::Debug, "dropping queue, message #%d", i) ;
+  d->flush() ;
+  int written = count_lines(path) - N ;
+  log_notice("%d messages written, %lu dropped", written, d->dropped()) ;
+  log_assert(written + d->dropped() == (unsigned)N) ;
+
+  /* The destructor writes the queue before the log file is deleted */
+  d->message(qmlog::Debug, "the last message") ;
+  delete d ;
+  log_assert(count_lines(path)==N+written+1) ;
+  log_notice("success") ;
+}
+
+void *log_from_thread(void *d)
+{
+  for (int i=0; i<10000; ++i)
+    ((qmlog::dispatcher_t *)d)->message(qmlog::Debug, "thread %lu, message #%d", (unsigned long)pthread_self(), i) ;
+  return NULL ;
+}
+
+void test_threads_logging()
+{
+  /* Several threads are logging at once, while logs come and go */
+  const char *path = "/tmp/test_threads_logging.log" ;
+  unlink(path) ;
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  qmlog::log_file *file = new qmlog::log_file(path, qmlog::Full, d) ;
+  file->enable_fields(qmlog::Monotonic_Nano | qmlog::Time_Micro) ;
+
+  log_notice("starting 4 logging threads") ;
+  const int T = 4 ;
+  pthread_t threads[T] ;
+  for (int i=0; i<T; ++i)
+    pthread_create(&threads[i], NULL, log_from_thread, d) ;
+
+  /* Attaching and deleting another log at the same time */
+  for (int i=0; i<100; ++i)
+    delete new qmlog::log_file("/dev/null", qmlog::Full, d) ;
+
+  for (int i=0; i<T; ++i)
+    pthread_join(threads[i], NULL) ;
+
+  delete d ;
+  log_assert(count_lines(path)==T*10000) ;
+  log_notice("success") ;
+}
+
+void log_all_conversions(qmlog::dispatcher_t *d)
+{
+  char not_terminated[3] = { 'a', 'b', 'c' } ;
+  d->message(qmlog::Debug, "no arguments") ;
+  d->message(qmlog::Debug) ;
+  d->message(qmlog::Debug, "int=%d, negative=%i, unsigned=%u, hex=%#x, octal=%o, char='%c', percent=%%", 239, -239, 239u, 239, 239, 'x') ;
+  d->message(qmlog::Debug, "short=%hd, char=%hhd, long=%ld, long long=%lld, size=%zu, max=%jd", (short)-1, (char)65, -1L, 1LL<<40, sizeof(long), (intmax_t)-1) ;
+  d->message(qmlog::Debug, "double=%5.2f, exp=%e, general=%g, hex=%a, long double=%Lf", 3.1415926, 1e-10, 0.5, 1.0, (long double)2.5) ;
+  d->message(qmlog::Debug, "string='%s', padded='%-10s', cut='%.3s', unterminated='%.3s'", "hello", "left", "truncated", not_terminated) ;
+  d->message(qmlog::Debug, "star width='%*d', star precision='%.*f', negative='%*s', no precision='%.*s'", 6, 42, 3, 2.0/3, -6, "x", -1, "all") ;
+  d->message(qmlog::Debug, "pointer=%p, null pointer=%p", (void *)0x1234, (void *)NULL) ;
+  errno = ENOENT ;
+  d->message(qmlog::Debug, "errno: %m") ;
+  d->message(qmlog::Debug, "positional: %2$s %1$s", "world", "hello") ;
+}
+
+void test_deferred_formatting()
+{
+  /* With deferred formatting the caller only copies the arguments,
+   * the text has to be the same as formatted at once */
+  const char *immediate = "/tmp/test_deferred_formatting.immediate.log" ;
+  const char *deferred = "/tmp/test_deferred_formatting.deferred.log" ;
+  unlink(immediate) ;
+  unlink(deferred) ;
+
+  log_notice("formatting at once") ;
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  (new qmlog::log_file(immediate, qmlog::Full, d))->set_fields(qmlog::Message | qmlog::Level) ;
+  log_all_conversions(d) ;
+  delete d ;
+
+  log_notice("formatting by the writer thread") ;
+  d = new qmlog::dispatcher_t ;
+  (new qmlog::log_file(deferred, qmlog::Full, d))->set_fields(qmlog::Message | qmlog::Level) ;
+  d->set_async(16, qmlog::Block_If_Full, true) ;
+  log_all_conversions(d) ;
+  delete d ;
+
+  string command = (string)"cmp " + immediate + " " + deferred ;
+  log_assert(system(command.c_str())==0, "files differ: %s %s", immediate, deferred) ;
+  log_notice("success") ;
+}
+
+string file_contents(const char *path) ;
+
+void test_binary_file()
+{
+  /* The decoded binary log has to be the same as the text log
+   * written with the same fields, in all the dispatcher modes */
+  const char *text = "/tmp/test_binary_file.log" ;
+  const char *binary = "/tmp/test_binary_file.bin" ;
+  const char *decoded = "/tmp/test_binary_file.decoded.log" ;
+  unlink(text) ;
+  unlink(binary) ;
+
+  int fields = qmlog::All_Fields ;
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  (new qmlog::log_file(text, qmlog::Full, d))->set_fields(fields) ;
+  (new qmlog::log_binary_file(binary, qmlog::Full, d))->set_fields(fields) ;
+  for (int mode=0; mode<3; ++mode)
+  {
+    log_notice("binary log, mode %d", mode) ;
+    if (mode>0)
+      d->set_async(16, qmlog::Block_If_Full, mode==2) ;
+    log_all_conversions(d) ;
+    d->message(qmlog::Info, __LINE__, __FILE__, __PRETTY_FUNCTION__, "with location, mode %d", mode) ;
+    d->message(qmlog::Warning, __LINE__, __FILE__, __PRETTY_FUNCTION__) ;
+    static qmlog::site_t site = { qmlog::Notice, __LINE__, __FILE__, __PRETTY_FUNCTION__, 0, NULL, false } ;
+    d->message(&site, "at a call site, mode %d", mode) ;
+  }
+  delete d ;
+
+  FILE *in = fopen(binary, "r"), *out = fopen(decoded, "w") ;
+  log_assert(in and out) ;
+  log_assert(qmlog::log_binary_file::decode(in, out), "can't decode %s", binary) ;
+  fclose(in) ;
+  fclose(out) ;
+
+  struct stat text_stat, binary_stat ;
+  stat(text, &text_stat) ;
+  stat(binary, &binary_stat) ;
+  log_notice("text: %ld bytes, binary: %ld bytes", (long)text_stat.st_size, (long)binary_stat.st_size) ;
+
+  string command = (string)"cmp " + text + " " + decoded ;
+  log_assert(system(command.c_str())==0, "files differ: %s %s", text, decoded) ;
+
+  /* A record written in part (the file size limit here) is taken back,
+   * the next message starts a new session */
+  unlink(binary) ;
+  pid_t child = fork() ;
+  if (child==0)
+  {
+    signal(SIGXFSZ, SIG_IGN) ;
+    d = new qmlog::dispatcher_t ;
+    new qmlog::log_binary_file(binary, qmlog::Full, d) ;
+    d->message(qmlog::Info, "before %s", "the limit") ;
+    struct stat st ;
+    stat(binary, &st) ;
+    struct rlimit limit = { (rlim_t)st.st_size + 100, RLIM_INFINITY } ;
+    setrlimit(RLIMIT_FSIZE, &limit) ;
+    d->message(qmlog::Info, "cut %s", string(1000, 'c').c_str()) ;
+    limit.rlim_cur = RLIM_INFINITY ;
+    setrlimit(RLIMIT_FSIZE, &limit) ;
+    d->message(qmlog::Info, "after %s", "the limit") ;
+    delete d ;
+    _exit(0) ;
+  }
+  waitpid(child, NULL, 0) ;
+  string bytes = file_contents(binary) ;
+  in = fopen(binary, "r"), out = fopen(decoded, "w") ;
+  log_assert(qmlog::log_binary_file::decode(in, out), "can't decode after a failed write") ;
+  fclose(in) ;
+  fclose(out) ;
+  string lines = file_contents(decoded) ;
+  log_assert(lines.find("before the limit")!=string::npos and lines.find("after the limit")!=string::npos, "%s", lines.c_str()) ;
+  log_assert(lines.find("cut ccc")==string::npos, "%s", lines.c_str()) ;
+
+  /* The length of a string argument going past the end of the record:
+   * that argument is not formatted */
+  size_t at = bytes.find("the limit") ;
+  log_assert(at!=string::npos and at>=4) ;
+  bytes[at-2] = bytes[at-3] = (char)0x7f ;
+  FILE *fp = fopen(binary, "w") ;
+  fwrite(bytes.data(), 1, bytes.size(), fp) ;
+  fclose(fp) ;
+  in = fopen(binary, "r"), out = fopen(decoded, "w") ;
+  qmlog::log_binary_file::decode(in, out) ;
+  fclose(in) ;
+  fclose(out) ;
+  lines = file_contents(decoded) ;
+  log_assert(lines.find("before the limit")==string::npos and lines.find("after the limit")!=string::npos, "%s", lines.c_str()) ;
+  log_notice("success") ;
+}
+
+time_t current_second()
+{
+  struct timeval tv ; // time() may lag behind the clock used by the library
+  gettimeofday(&tv, NULL) ;
+  return tv.tv_sec ;
+}
+
+void wait_next_second()
+{
+  for (time_t now = current_second(); current_second()==now; )
+    usleep(10*1000) ;
+}
+
+void test_timezone_change()
+{
+  /* The local time is computed once a second: a new timezone
+   * is used at the latest by the messages of the next second */
+  const char *path = "/tmp/test_timezone_change.log" ;
+  unlink(path) ;
+  const char *old_tz = getenv("TZ") ;
+  string saved_tz = old_tz ? old_tz : "" ;
+
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  (new qmlog::log_file(path, qmlog::Full, d))->set_fields(qmlog::Timezone_Abbreviation | qmlog::Timezone_Offset | qmlog::Message) ;
+  setenv("TZ", "IST-5:30", 1) ;
+  wait_next_second() ;
+  d->message(qmlog::Debug, "first") ;
+  setenv("TZ", "XYZ+3", 1) ;
+  wait_next_second() ;
+  d->message(qmlog::Debug, "second") ;
+  delete d ;
+
+  if (old_tz)
+    setenv("TZ", saved_tz.c_str(), 1) ;
+  else
+    unsetenv("TZ") ;
+
+  char line[2][256] ;
+  FILE *fp = fopen(path, "r") ;
+  log_assert(fp) ;
+  for (int i=0; i<2; ++i)
+    log_assert(fgets(line[i], sizeof(line[i]), fp), "line %d missing", i) ;
+  fclose(fp) ;
+  log_assert(strcmp(line[0], "[(IST,GMT+5:30)] first\n")==0, "%s", line[0]) ;
+  log_assert(strcmp(line[1], "[(XYZ,GMT-3)] second\n")==0, "%s", line[1]) ;
+  log_notice("success") ;
+}
+
+void test_flush_policy()
+{
+  /* A log file may keep the messages back and write them together */
+  const char *path = "/tmp/test_flush_policy.log" ;
+  unlink(path) ;
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  qmlog::log_file *file = new qmlog::log_file(path, qmlog::Full, d) ;
+  file->set_fields(qmlog::Message) ;
+  file->set_flush_policy(64*1024, 0, qmlog::Error) ;
+
+  for (int i=0; i<10; ++i)
+    d->message(qmlog::Debug, "kept back, message #%d", i) ;
+  log_assert(count_lines(path)==0) ;
+
+  /* An error writes everything before it and itself */
+  d->message(qmlog::Error, "written at once") ;
+  log_assert(count_lines(path)==11) ;
+
+  /* So does the dispatcher's flush(), which is called by log_abort() too */
+  d->message(qmlog::Info, "written by flush()") ;
+  log_assert(count_lines(path)==11) ;
+  d->flush() ;
+  log_assert(count_lines(path)==12) ;
+
+  /* The size limit */
+  file->set_flush_policy(100) ;
+  for (int i=0; i<5; ++i)
+    d->message(qmlog::Debug, "20 bytes message #%d", i) ;
+  log_assert(count_lines(path)==17, "%d", count_lines(path)) ;
+
+  /* The age of the oldest message: written when it's due, even if no
+   * other message comes */
+  file->set_flush_policy(64*1024, 50) ;
+  d->message(qmlog::Debug, "old message") ;
+  log_assert(count_lines(path)==17) ;
+  for (int i=0; i<100 and count_lines(path)==17; ++i)
+    usleep(10*1000) ;
+  log_assert(count_lines(path)==18) ;
+
+  /* And the destructor, before the deadline */
+  d->message(qmlog::Debug, "the last message") ;
+  log_assert(count_lines(path)==18) ;
+  delete d ;
+  log_assert(count_lines(path)==19) ;
+  log_notice("success") ;
+}
+
+string file_contents(const char *path)
+{
+  string text ;
+  FILE *fp = fopen(path, "r") ;
+  log_assert(fp!=NULL, "can't read '%s': %m", path) ;
+  for (int c; (c=fgetc(fp))!=EOF; )
+    text += (char)c ;
+  fclose(fp) ;
+  return text ;
+}
+
+void test_mmap_file()
+{
+  /* Messages stored to a mapped file: the same text as a log_file */
+  const char *path = "/tmp/test_mmap_file.log" ;
+  string old_path = string(path) + ".1" ;
+  unlink(path) ;
+  unlink(old_path.c_str()) ;
+
+  /* A process dying without the destructor leaves the segment full size,
+   * the header tells how much of it is used */
+  if (pid_t child = fork())
+    waitpid(child, NULL, 0) ;
+  else
+  {
+    qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+    (new qmlog::log_mmap_file(path, qmlog::Full, d, 4096))->set_fields(qmlog::Message) ;
+    d->message(qmlog::Debug, "before the crash") ;
+    _exit(0) ;
+  }
+  struct stat st ;
+  log_assert(stat(path, &st)==0 and st.st_size==4096) ;
+  string text = file_contents(path) ;
+  log_assert(text.compare(0, 30, "# qmlog 0000002f bytes in use\n")==0, "%s", text.c_str()) ;
+
+  /* It is continued, and cut at the end; full segments are moved to .1 */
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  (new qmlog::log_mmap_file(path, qmlog::Full, d, 4096))->set_fields(qmlog::Message) ;
+  d->message(qmlog::Debug, "after the crash") ;
+  string line(99, 'x') ;
+  for (int i=0; i<50; ++i)
+    d->message(qmlog::Debug, "%s", line.c_str()) ;
+  delete d ;
+
+  string first = file_contents(old_path.c_str()) ;
+  string second = file_contents(path) ;
+  unsigned lines = (4096 - 30 - 17 - 16) / 100 ;
+  log_assert(first.size() == 30 + 17 + 16 + lines*100, "%u", (unsigned)first.size()) ;
+  log_assert(first.compare(30, 33, "before the crash\nafter the crash\n")==0) ;
+  log_assert(second.size() == 30 + (50-lines)*100, "%u", (unsigned)second.size()) ;
+  char expected[32] ;
+  sprintf(expected, "# qmlog %08x bytes in use\n", (unsigned)second.size()) ;
+  log_assert(second.compare(0, 30, expected)==0) ;
+
+  /* A message too long for an empty segment is cut, the old one is kept */
+  unlink(path) ;
+  d = new qmlog::dispatcher_t ;
+  (new qmlog::log_mmap_file(path, qmlog::Full, d, 4096))->set_fields(qmlog::Message) ;
+  string huge(5000, 'y') ;
+  d->message(qmlog::Debug, "%s", huge.c_str()) ;
+  delete d ;
+  log_assert(file_contents(old_path.c_str())==first) ;
+  log_assert(file_contents(path).size()==4096) ;
+  log_notice("success") ;
+}
+
+bool file_exists(const string &path)
+{
+  struct stat st ;
+  return stat(path.c_str(), &st)==0 ;
+}
+
+void test_rotation()
+{
+  /* The file is renamed to .1 when it's full, older ones are shifted */
+  const char *path = "/tmp/test_rotation.log" ;
+  string p = path ;
+  const char *suffixes[] = { "", ".1", ".2", ".3", ".4", ".1.gz", ".2.gz", ".3.gz" } ;
+  for (unsigned i=0; i<sizeof(suffixes)/sizeof(*suffixes); ++i)
+    unlink((p + suffixes[i]).c_str()) ;
+
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  qmlog::log_file *file = new qmlog::log_file(path, qmlog::Full, d) ;
+  file->set_fields(qmlog::Message) ;
+  file->set_rotation(100, 0, 3) ;
+  for (int i=0; i<27; ++i)
+    d->message(qmlog::Debug, "message number %03d", i) ; // 19 bytes each
+  /* 6 messages to a file, 4 rotations: the first file is gone */
+  log_assert(count_lines(path)==3) ;
+  for (int i=1; i<=3; ++i)
+    log_assert(count_lines((p + suffixes[i]).c_str())==6) ;
+  log_assert(not file_exists(p + ".4")) ;
+  log_assert(file_contents((p + ".3").c_str()).compare(0, 19, "message number 006\n")==0) ;
+
+  /* By age, counted from now for the current file */
+  file->set_rotation(0, 1, 3) ;
+  d->message(qmlog::Debug, "started") ;
+  sleep(1) ;
+  d->message(qmlog::Debug, "a second later") ;
+  log_assert(count_lines(path)==0) ;
+  log_assert(count_lines((p + ".1").c_str())==5) ;
+
+  /* Compressed by a thread, the destructor waits for it */
+  file->set_rotation(100, 0, 3, true) ;
+  for (int i=0; i<12; ++i)
+    d->message(qmlog::Debug, "message number %03d", i) ;
+  delete d ;
+  log_assert(count_lines(path)==0) ;
+  for (int i=1; i<=2; ++i)
+  {
+    string old = p + suffixes[i] ;
+    log_assert(not file_exists(old), "%s", old.c_str()) ;
+    string gz = file_contents((old + ".gz").c_str()) ;
+    log_assert(gz.size()>2 and gz[0]=='\x1f' and gz[1]=='\x8b') ;
+  }
+  log_assert(count_lines((p + ".3").c_str())==5) ; // rotated by age before
+  log_notice("success") ;
+}
+
+void test_reopen()
+{
+  /* The file moved away by somebody else is followed until it is reopened */
+  const char *path = "/tmp/test_reopen.log" ;
+  string old = string(path) + ".old" ;
+  unlink(path) ;
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  qmlog::log_file *file = new qmlog::log_file(path, qmlog::Full, d) ;
+  file->set_fields(qmlog::Message | qmlog::Reopen_If_Moved) ;
+
+  /* Explicitly */
+  wait_next_second() ;
+  d->message(qmlog::Debug, "one") ;
+  rename(path, old.c_str()) ;
+  d->message(qmlog::Debug, "two") ; // still in the same second
+  file->reopen() ;
+  d->message(qmlog::Debug, "three") ;
+  log_assert(count_lines(old.c_str())==2 and count_lines(path)==1) ;
+
+  /* Noticed in the next second */
+  rename(path, old.c_str()) ;
+  sleep(1) ;
+  d->message(qmlog::Debug, "four") ;
+  log_assert(count_lines(old.c_str())==1 and count_lines(path)==1) ;
+
+  /* By a signal */
+  qmlog::log_file::reopen_on_signal(SIGHUP) ;
+  rename(path, old.c_str()) ;
+  raise(SIGHUP) ;
+  d->message(qmlog::Debug, "five") ;
+  signal(SIGHUP, SIG_DFL) ;
+  log_assert(count_lines(old.c_str())==1 and count_lines(path)==1) ;
+  delete d ;
+  log_notice("success") ;
+}
+
+void test_cache_if_cant_open()
+{
+  /* While the directory is missing, the newest messages are cached */
+  const char *directory = "/tmp/test_cache_if_cant_open" ;
+  string path = string(directory) + "/file.log" ;
+  unlink(path.c_str()) ;
+  rmdir(directory) ;
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  qmlog::log_file *file = new qmlog::log_file(path.c_str(), qmlog::Full, d) ;
+  file->set_fields(qmlog::Message | qmlog::Cache_If_Cant_Open) ;
+  file->set_cache_size(120) ;
+  for (int i=0; i<10; ++i)
+    d->message(qmlog::Debug, "message number %03d", i) ; // 24 bytes each in the cache
+
+  /* It's tried again after 0.1 second, the dropped ones are counted */
+  mkdir(directory, 0777) ;
+  d->message(qmlog::Debug, "too early") ;
+  log_assert(not file_exists(path)) ;
+  usleep(150*1000) ;
+  d->message(qmlog::Debug, "the file is there") ;
+  string text = file_contents(path.c_str()) ;
+  const char *expected =
+    "[qmlog] 6 messages dropped while the file could not be opened\n"
+    "message number 006\n"
+    "message number 007\n"
+    "message number 008\n"
+    "message number 009\n"
+    "too early\n"
+    "the file is there\n" ;
+  log_assert(text==expected, "%s", text.c_str()) ;
+
+  /* A message with newlines is dropped as a whole */
+  unlink(path.c_str()) ;
+  rmdir(directory) ;
+  file->reopen() ;
+  d->message(qmlog::Debug, "two\nlines") ;
+  for (int i=0; i<5; ++i)
+    d->message(qmlog::Debug, "message number %03d", i) ;
+  mkdir(directory, 0777) ;
+  usleep(250*1000) ;
+  d->message(qmlog::Debug, "the file is there") ;
+  text = file_contents(path.c_str()) ;
+  expected =
+    "[qmlog] 1 messages dropped while the file could not be opened\n"
+    "message number 000\n"
+    "message number 001\n"
+    "message number 002\n"
+    "message number 003\n"
+    "message number 004\n"
+    "the file is there\n" ;
+  log_assert(text==expected, "%s", text.c_str()) ;
+  delete d ;
+  unlink(path.c_str()) ;
+  rmdir(directory) ;
+  log_notice("success") ;
+}
+
+/* Remembers the ids of the call sites it gets */
+class site_log : public qmlog::log_file
+{
+public:
+  vector<unsigned> ids ;
+  site_log(const char *path, qmlog::dispatcher_t *d) : qmlog::log_file(path, qmlog::Full, d) { }
+  void compose_message(qmlog::dispatcher_t *d, const qmlog::site_t *site, const char *fmt, va_list args)
+  {
+    ids.push_back(site->id) ;
+    qmlog::log_file::compose_message(d, site, fmt, args) ;
+  }
+} ;
+
+void test_call_sites()
+{
+  /* A site is registered with its first message and keeps its id,
+   * the location is logged as without a site */
+  const char *path = "/tmp/test_call_sites.log" ;
+  unlink(path) ;
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  site_log *file = new site_log(path, d) ;
+  file->set_fields(qmlog::Message | qmlog::Line | qmlog::Function) ;
+
+  for (int i=0; i<2; ++i)
+  {
+    static qmlog::site_t site = { qmlog::Info, 100, "loop.cpp", "loop", 0, NULL, false } ;
+    d->message(&site, "message %d", i) ;
+  }
+  static qmlog::site_t other = { qmlog::Info, 200, "other.cpp", "other", 0, NULL, false } ;
+  d->message(&other) ;
+  d->message(qmlog::Info, other.line, other.file, other.func) ; // without a site
+  static qmlog::site_t quiet = { qmlog::Debug, 300, "quiet.cpp", "quiet", 0, NULL, false } ;
+  d->log_level(qmlog::Info) ;
+  d->message(&quiet, "not logged") ;
+
+  vector<unsigned> ids = file->ids ;
+  delete d ;
+
+  string text = file_contents(path) ;
+  const char *expected =
+    "at loop.cpp:100 in loop: message 0\n"
+    "at loop.cpp:100 in loop: message 1\n"
+    "at other.cpp:200 in other\n"
+    "at other.cpp:200 in other\n" ;
+  log_assert(text==expected, "%s", text.c_str()) ;
+  log_assert(ids.size()==4) ;
+  log_assert(ids[0]!=0 and ids[1]==ids[0] and ids[2]!=0 and ids[2]!=ids[0] and ids[3]==0) ;
+  log_assert(other.location and (string)other.location=="at other.cpp:200") ;
+  log_assert(quiet.id==0, "a site below the log level is not registered") ;
+  log_notice("success") ;
+}
+
+void test_site_switches()
+{
+  /* The debug messages of one directory only, then the same rules from
+   * a file; the last matching rule wins */
+  const char *path = "/tmp/test_site_switches.log" ;
+  const char *rules = "/tmp/test_site_switches.rules" ;
+  unlink(path) ;
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  (new qmlog::log_file(path, qmlog::Full, d))->set_fields(qmlog::Message) ;
+
+  static qmlog::site_t net_debug = { qmlog::Debug, 10, "src/net/socket.cpp", "void send()", 0, NULL, false } ;
+  static qmlog::site_t ui_debug = { qmlog::Debug, 20, "src/ui/window.cpp", "void draw()", 0, NULL, false } ;
+  static qmlog::site_t ui_error = { qmlog::Error, 30, "src/ui/window.cpp", "void draw()", 0, NULL, false } ;
+  qmlog::site_t *sites[] = { &net_debug, &ui_debug, &ui_error } ;
+  const char *names[] = { "net debug", "ui debug", "ui error" } ;
+
+  d->message(&ui_debug, "registered before the rules") ;
+  for (int round=0; round<3; ++round)
+  {
+    if (round==0)
+    {
+      qmlog::disable_sites("*", NULL, qmlog::Debug) ;
+      qmlog::enable_sites("src/net/*", NULL, qmlog::Debug) ;
+    }
+    else if (round==1)
+    {
+      FILE *fp = fopen(rules, "w") ;
+      fprintf(fp, "# errors and the debugging of draw()\n\noff * * info\non src/ui/* *draw* DEBUG\n") ;
+      fclose(fp) ;
+      char list[] = "a b" ; // the library leaves strtok() of the application alone
+      const char *first = strtok(list, " ") ;
+      log_assert(qmlog::object.read_site_rules(rules)) ;
+      const char *second = strtok(NULL, " ") ;
+      log_assert(first and second and strcmp(second, "b")==0, "strtok() disturbed") ;
+    }
+    else
+      qmlog::object.reset_sites() ;
+    for (int i=0; i<3; ++i)
+      if (qmlog::site_on(sites[i])) // as done by the macros
+        d->message(sites[i], "%s, round %d", names[i], round) ;
+  }
+  delete d ;
+  unlink(rules) ;
+
+  string text = file_contents(path) ;
+  const char *expected =
+    "registered before the rules\n"
+    "net debug, round 0\n"
+    "ui error, round 0\n"
+    "ui debug, round 1\n"
+    "ui error, round 1\n"
+    "net debug, round 2\n"
+    "ui debug, round 2\n"
+    "ui error, round 2\n" ;
+  log_assert(text==expected, "%s", text.c_str()) ;
+  log_notice("success") ;
+}
+
+void write_file(const char *path, const char *text)
+{
+  string temporary = (string)path + ".new" ; // the watcher never sees a half-written file
+  FILE *fp = fopen(temporary.c_str(), "w") ;
+  log_assert(fp!=NULL, "can't write '%s': %m", temporary.c_str()) ;
+  fputs(text, fp) ;
+  fclose(fp) ;
+  rename(temporary.c_str(), path) ;
+}
+
+/* waits up to 5 seconds for the watcher thread */
+#define wait_for(condition) for (int i=0; i<500 and not (condition); ++i) usleep(10*1000)
+
+/* The threads of this process */
+static int thread_count()
+{
+  int n = 0 ;
+  string status = file_contents("/proc/self/status") ;
+  string::size_type at = status.find("\nThreads:") ;
+  log_assert(at!=string::npos and sscanf(status.c_str()+at, "\nThreads: %d", &n)==1) ;
+  return n ;
+}
+
+void test_control_file()
+{
+  /* The settings are changed while the program is running */
+  const char *control = "/tmp/test_control_file.conf" ;
+  const char *path = "/tmp/test_control_file.log" ;
+  unlink(control) ;
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  qmlog::log_file *file = new qmlog::log_file(path, qmlog::Full, d) ;
+  static qmlog::site_t site = { qmlog::Debug, 10, "src/net/socket.cpp", "void send()", 0, NULL, false } ;
+  d->message(&site, "registered") ;
+
+  qmlog::object.set_control_file(control) ; // not there: disabled at once
+  log_assert(not qmlog::enabled()) ;
+
+  write_file(control,
+    "# a comment\n"
+    "dispatcher all level notice\n"
+    "log /tmp/test_control_file.log fields Message|Level\n"
+    "log /tmp/test_control_file.log level warning\n"
+    "off src/net/* * debug\n") ;
+  wait_for(d->log_level()==qmlog::Notice) ;
+  log_assert(qmlog::enabled()) ;
+  log_assert(d->log_level()==qmlog::Notice) ;
+  log_assert(file->get_fields()==(qmlog::Message|qmlog::Level), "fields: %#x", file->get_fields()) ;
+  log_assert(file->log_level()==qmlog::Warning) ;
+  log_assert(not qmlog::site_on(&site)) ;
+
+  write_file(control, "enabled no\n") ;
+  wait_for(not qmlog::enabled()) ;
+  log_assert(not qmlog::enabled()) ;
+  log_assert(qmlog::site_on(&site), "the rules of the file are dropped with it") ;
+  log_assert(d->log_level()==qmlog::Notice, "the rest is left as it is") ;
+
+  write_file(control, "enabled yes\nbad line\ndispatcher default level debug\n") ;
+  wait_for(qmlog::enabled()) ;
+  log_assert(qmlog::enabled()) ;
+  log_assert(qmlog::log_level()==qmlog::Debug) ;
+
+  unlink(control) ;
+  wait_for(not qmlog::enabled()) ;
+  log_assert(not qmlog::enabled()) ;
+
+  /* A thread is running only while a file is watched; a child of fork()
+   * starts its own with its first message */
+  int threads = thread_count() ;
+  qmlog::object.set_control_file(NULL) ;
+  log_assert(thread_count()==threads-1, "%d threads, %d before", thread_count(), threads) ;
+  qmlog::object.set_control_file(control) ;
+  pid_t child = fork() ;
+  if (child==0)
+  {
+    bool none = thread_count()==1 ;
+    d->message(qmlog::Warning, "in the child") ;
+    _exit(none and thread_count()==2 ? 0 : 1) ;
+  }
+  int status = -1 ;
+  waitpid(child, &status, 0) ;
+  log_assert(WIFEXITED(status) and WEXITSTATUS(status)==0, "status %d", status) ;
+
+  /* The directory made after the watch started, two levels of it */
+  system("rm -rf /tmp/test_control_dir") ;
+  qmlog::object.set_control_file("/tmp/test_control_dir/sub/control.conf") ;
+  log_assert(not qmlog::enabled()) ;
+  mkdir("/tmp/test_control_dir", 0755) ;
+  mkdir("/tmp/test_control_dir/sub", 0755) ;
+  write_file("/tmp/test_control_dir/sub/control.conf", "enabled yes\n") ;
+  wait_for(qmlog::enabled()) ;
+  log_assert(qmlog::enabled()) ;
+  system("rm -rf /tmp/test_control_dir") ;
+  wait_for(not qmlog::enabled()) ;
+  log_assert(not qmlog::enabled()) ;
+  mkdir("/tmp/test_control_dir", 0755) ;
+  mkdir("/tmp/test_control_dir/sub", 0755) ;
+  write_file("/tmp/test_control_dir/sub/control.conf", "enabled yes\n") ;
+  wait_for(qmlog::enabled()) ;
+  log_assert(qmlog::enabled(), "the directory made again") ;
+  system("rm -rf /tmp/test_control_dir") ;
+
+  qmlog::object.set_control_file(NULL) ;
+  qmlog::enable() ;
+  delete d ;
+  unlink(path) ;
+  log_notice("success") ;
+}
+
+void test_process_name()
+{
+  /* The dispatchers share the name of the process until it's changed */
+  const char *path = "/tmp/test_process_name.log" ;
+  unlink(path) ;
+  string started_as = qmlog::process_name() ;
+  log_assert(started_as=="qmlog-example", "%s", started_as.c_str()) ;
+
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  qmlog::log_file *file = new qmlog::log_file(path, qmlog::Full, d) ;
+  file->set_fields(qmlog::Name | qmlog::Message) ;
+  d->message(qmlog::Info, -1, __FILE__, NULL, "first") ;
+  qmlog::process_name("renamed") ;
+  d->message(qmlog::Info, -1, __FILE__, NULL, "second") ;
+  qmlog::process_name(started_as) ;
+  d->message(qmlog::Info, -1, __FILE__, NULL, "third") ;
+  delete d ;
+
+  string text = file_contents(path) ;
+  const char *expected =
+    "[qmlog-example] first\n"
+    "[renamed] second\n"
+    "[qmlog-example] third\n" ;
+  log_assert(text==expected, "%s", text.c_str()) ;
+  log_notice("success") ;
+}
+
+static bool stop_logging = false ;
+
+void *log_until_stopped(void *d)
+{
+  for (int i=0; not __atomic_load_n(&stop_logging, __ATOMIC_RELAXED); ++i)
+    ((qmlog::dispatcher_t *)d)->message(qmlog::Debug, "thread message #%d", i) ;
+  return NULL ;
+}
+
+static qmlog::log_file *toggled = NULL ;
+
+void *toggle_fields_until_stopped(void *d)
+{
+  for (int i=0; not __atomic_load_n(&stop_logging, __ATOMIC_RELAXED); ++i)
+  {
+    toggled->set_fields(i%2 ? qmlog::Message : qmlog::Pid | qmlog::Message) ;
+    ((qmlog::dispatcher_t *)d)->message(qmlog::Debug, "toggled #%d", i) ;
+  }
+  return NULL ;
+}
+
+void test_fork()
+{
+  /* A child writes its own messages with its own pid, not the ones the
+   * parent keeps back or has queued, while another thread keeps logging */
+  const char *path = "/tmp/test_fork.log" ;
+  const char *async_path = "/tmp/test_fork_async.log" ;
+  unlink(path) ;
+  unlink(async_path) ;
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  qmlog::log_file *file = new qmlog::log_file(path, qmlog::Full, d) ;
+  file->set_fields(qmlog::Pid | qmlog::Message) ;
+  file->set_flush_policy(1<<20) ;
+  d->message(qmlog::Info, "kept back by the parent") ;
+  qmlog::dispatcher_t *a = new qmlog::dispatcher_t ;
+  (new qmlog::log_file(async_path, qmlog::Full, a))->set_fields(qmlog::Message) ;
+  a->set_async(16) ;
+  stop_logging = false ;
+  pthread_t thread ;
+  pthread_create(&thread, NULL, log_until_stopped, a) ;
+
+  const int N = 10 ;
+  pid_t children[N] ;
+  for (int i=0; i<N; ++i)
+  {
+    if ((children[i] = fork())==0)
+    {
+      alarm(10) ; // a lock held by the thread of the parent
+      d->message(qmlog::Info, "child %d", i) ;
+      a->message(qmlog::Info, "from child %d", i) ;
+      d->flush() ;
+      a->flush() ; // needs a writer thread of its own
+      _exit(0) ;
+    }
+    int status = 0 ;
+    waitpid(children[i], &status, 0) ;
+    log_assert(WIFEXITED(status) and WEXITSTATUS(status)==0, "child %d: status %d", i, status) ;
+  }
+  __atomic_store_n(&stop_logging, true, __ATOMIC_RELAXED) ;
+  pthread_join(thread, NULL) ;
+  delete a ;
+  delete d ;
+
+  string expected ;
+  char line[64] ;
+  for (int i=0; i<N; ++i)
+  {
+    sprintf(line, "[%d] child %d\n", children[i], i) ;
+    expected += line ;
+  }
+  sprintf(line, "[%d] kept back by the parent\n", getpid()) ;
+  expected += line ;
+  string text = file_contents(path) ;
+  log_assert(text==expected, "%s", text.c_str()) ;
+
+  /* each message of the thread is written by the parent, once */
+  text = file_contents(async_path) ;
+  int next = 0, children_seen = 0 ;
+  for (string::size_type start = 0, end; (end = text.find('\n', start)) != string::npos; start = end + 1)
+  {
+    int number ;
+    if (sscanf(text.c_str() + start, "thread message #%d", &number)==1)
+      log_assert(number==next++, "message #%d after #%d", number, next-1) ;
+    else
+    {
+      log_assert(text.compare(start, 10, "from child")==0, "%s", text.substr(start, end-start).c_str()) ;
+      ++children_seen ;
+    }
+  }
+  log_assert(children_seen==N and next>0, "%d children, %d thread messages", children_seen, next) ;
+
+  /* Forked while the flush timer waits with nothing to do: the child
+   * starts a timer of its own */
+  const char *timer_path = "/tmp/test_fork_timer.log" ;
+  unlink(timer_path) ;
+  d = new qmlog::dispatcher_t ;
+  file = new qmlog::log_file(timer_path, qmlog::Full, d) ;
+  file->set_fields(qmlog::Message) ;
+  file->set_flush_policy(1<<20, 50, qmlog::Critical) ;
+  d->message(qmlog::Info, "parent") ;
+  usleep(300000) ; // written by the timer, idle again
+  pid_t child = fork() ;
+  if (child==0)
+  {
+    alarm(5) ;
+    for (int i=0; i<5; ++i)
+    {
+      d->message(qmlog::Info, "child %d", i) ;
+      usleep(80000) ;
+    }
+    _exit(0) ;
+  }
+  int status = 0 ;
+  waitpid(child, &status, 0) ;
+  log_assert(WIFEXITED(status) and WEXITSTATUS(status)==0, "timer child: status %d", status) ;
+  delete d ;
+  text = file_contents(timer_path) ;
+  log_assert(text=="parent\nchild 0\nchild 1\nchild 2\nchild 3\nchild 4\n", "%s", text.c_str()) ;
+
+  /* Forked while another thread changes the fields of a log: the child
+   * makes a layout of its own */
+  d = new qmlog::dispatcher_t ;
+  toggled = new qmlog::log_file("/dev/null", qmlog::Full, d) ;
+  stop_logging = false ;
+  pthread_create(&thread, NULL, toggle_fields_until_stopped, d) ;
+  for (int i=0; i<300; ++i)
+  {
+    if ((child = fork())==0)
+    {
+      alarm(5) ;
+      (new qmlog::log_file("/dev/null", qmlog::Full, d))->set_fields(qmlog::Name | qmlog::Message) ;
+      d->message(qmlog::Info, "child %d", i) ;
+      _exit(0) ;
+    }
+    waitpid(child, &status, 0) ;
+    log_assert(WIFEXITED(status) and WEXITSTATUS(status)==0, "layout child %d: status %d", i, status) ;
+  }
+  __atomic_store_n(&stop_logging, true, __ATOMIC_RELAXED) ;
+  pthread_join(thread, NULL) ;
+  delete d ;
+  log_notice("success") ;
+}
+
+void test_structured()
+{
+  /* The same pairs as text, JSON and logfmt; with deferred formatting the
+   * pairs become a part of the text */
+  const char *text_path = "/tmp/test_structured.log" ;
+  const char *json_path = "/tmp/test_structured.json" ;
+  const char *logfmt_path = "/tmp/test_structured.logfmt" ;
+  const char *deferred_path = "/tmp/test_structured_deferred.log" ;
+  unlink(text_path) ;
+  unlink(json_path) ;
+  unlink(logfmt_path) ;
+  unlink(deferred_path) ;
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  (new qmlog::log_file(text_path, qmlog::Full, d))->set_fields(qmlog::Level | qmlog::Message) ;
+  (new qmlog::log_json(json_path, qmlog::Full, d))->set_fields(qmlog::Level | qmlog::Line | qmlog::Message) ;
+  (new qmlog::log_logfmt(logfmt_path, qmlog::Full, d))->set_fields(qmlog::Level | qmlog::Message) ;
+
+  static qmlog::site_t site = { qmlog::Info, 10, "kv.cpp", NULL, 0, NULL, false } ;
+  string user = "a \"b\"" ;
+  d->message(&site, qmlog::kv("user", user)("bytes", 1024u)("delta", -3)("ok", true)("ratio", 0.5), "request %d", 7) ;
+  d->message(qmlog::Warning, qmlog::kv("path", "/tmp/x y\n")) ;
+  d->message(qmlog::Debug, "plain") ;
+  d->message(qmlog::Debug, qmlog::kv("a b", 1)("k=v", 2)("", 3)) ;
+  delete d ;
+
+  string text = file_contents(text_path) ;
+  const char *expected_text =
+    "INFO: request 7 user=\"a \\\"b\\\"\" bytes=1024 delta=-3 ok=true ratio=0.5\n"
+    "WARNING: path=\"/tmp/x y\\n\"\n"
+    "DEBUG: plain\n"
+    "DEBUG: \"a b\"=1 \"k=v\"=2 \"\"=3\n" ;
+  log_assert(text==expected_text, "%s", text.c_str()) ;
+
+  string json = file_contents(json_path) ;
+  const char *expected_json =
+    "{\"level\":\"info\",\"file\":\"kv.cpp\",\"line\":10,\"msg\":\"request 7\",\"user\":\"a \\\"b\\\"\",\"bytes\":1024,\"delta\":-3,\"ok\":true,\"ratio\":0.5}\n"
+    "{\"level\":\"warning\",\"path\":\"/tmp/x y\\n\"}\n"
+    "{\"level\":\"debug\",\"msg\":\"plain\"}\n"
+    "{\"level\":\"debug\",\"a b\":1,\"k=v\":2,\"\":3}\n" ;
+  log_assert(json==expected_json, "%s", json.c_str()) ;
+
+  string logfmt = file_contents(logfmt_path) ;
+  const char *expected_logfmt =
+    "level=info msg=\"request 7\" user=\"a \\\"b\\\"\" bytes=1024 delta=-3 ok=true ratio=0.5\n"
+    "level=warning path=\"/tmp/x y\\n\"\n"
+    "level=debug msg=plain\n"
+    "level=debug \"a b\"=1 \"k=v\"=2 \"\"=3\n" ;
+  log_assert(logfmt==expected_logfmt, "%s", logfmt.c_str()) ;
+
+  d = new qmlog::dispatcher_t ;
+  (new qmlog::log_json(deferred_path, qmlog::Full, d))->set_fields(qmlog::Message) ;
+  d->set_async(16, qmlog::Block_If_Full, true) ;
+  d->message(qmlog::Info, qmlog::kv("n", 1)("s", "x"), "deferred") ;
+  delete d ;
+  string deferred = file_contents(deferred_path) ;
+  log_assert(deferred=="{\"msg\":\"deferred n=1 s=x\"}\n", "%s", deferred.c_str()) ;
+  log_notice("success") ;
+}
+
+/* The next datagram waiting at 'fd', with the contents of the memfd passed instead, if any */
+static string receive_datagram(int fd)
+{
+  static char data[64*1024] ;
+  union { struct cmsghdr header ; char space[CMSG_SPACE(sizeof(int))] ; } control ;
+  struct iovec iov = { data, sizeof(data) } ;
+  struct msghdr m ;
+  memset(&m, 0, sizeof(m)) ;
+  m.msg_iov = &iov ;
+  m.msg_iovlen = 1 ;
+  m.msg_control = &control ;
+  m.msg_controllen = sizeof(control) ;
+  ssize_t size = recvmsg(fd, &m, MSG_DONTWAIT) ;
+  if (size<0)
+    return "(none)" ;
+  struct cmsghdr *c = CMSG_FIRSTHDR(&m) ;
+  if (c==NULL or c->cmsg_type!=SCM_RIGHTS)
+    return string(data, size) ;
+  int passed ;
+  memcpy(&passed, CMSG_DATA(c), sizeof(int)) ;
+  string contents ;
+  lseek(passed, 0, SEEK_SET) ;
+  for (ssize_t n; (n = read(passed, data, sizeof(data)))>0; )
+    contents.append(data, n) ;
+  close(passed) ;
+  return contents ;
+}
+
+/* A socket bound to 'path', standing in for a daemon */
+static int bound_socket(const char *path, int type)
+{
+  unlink(path) ;
+  int fd = socket(AF_UNIX, type, 0) ;
+  struct sockaddr_un address ;
+  memset(&address, 0, sizeof(address)) ;
+  address.sun_family = AF_UNIX ;
+  strcpy(address.sun_path, path) ;
+  log_assert(bind(fd, (struct sockaddr *)&address, sizeof(address))==0, "%m") ;
+  if (type==SOCK_STREAM)
+    listen(fd, 1) ;
+  return fd ;
+}
+
+void test_journal()
+{
+  /* The datagrams of the native journal protocol, received by a socket
+   * standing in for journald */
+  const char *path = "/tmp/test_journal.socket" ;
+  int receiver = bound_socket(path, SOCK_DGRAM) ;
+
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  new qmlog::log_journal(qmlog::Full, d, path) ;
+  static qmlog::site_t site = { qmlog::Info, 42, "journal.cpp", "void f()", 0, NULL, false } ;
+  d->message(&site, "hello %d", 1) ;
+  d->message(qmlog::Warning, "two\nlines") ;
+  string big(300000, 'x') ;
+  d->message(qmlog::Debug, "%s", big.c_str()) ;
+  delete d ;
+
+  char pid[32] ;
+  sprintf(pid, "%d", getpid()) ;
+  string header = "SYSLOG_IDENTIFIER=qmlog-example\nSYSLOG_PID=" + string(pid) + "\n" ;
+  string first = receive_datagram(receiver) ;
+  string expected = "PRIORITY=6\n" + header + "CODE_FILE=journal.cpp\nCODE_LINE=42\nCODE_FUNC=void f()\nMESSAGE=hello 1\n" ;
+  log_assert(first==expected, "%s", first.c_str()) ;
+
+  string second = receive_datagram(receiver) ;
+  expected = "PRIORITY=4\n" + header + "MESSAGE\n" + string("\x09\0\0\0\0\0\0\0", 8) + "two\nlines\n" ;
+  log_assert(second==expected, "%s", second.c_str()) ;
+
+  string third = receive_datagram(receiver) ;
+  expected = "PRIORITY=7\n" + header + "MESSAGE=" + big + "\n" ;
+  log_assert(third==expected, "%u bytes: %.100s", (unsigned)third.size(), third.c_str()) ;
+  log_assert(receive_datagram(receiver)=="(none)") ;
+  close(receiver) ;
+  unlink(path) ;
+  log_notice("success") ;
+}
+
+static bool ends_with(const string &s, const string &end)
+{
+  return s.size()>=end.size() and s.compare(s.size()-end.size(), end.size(), end)==0 ;
+}
+
+void test_syslog_socket()
+{
+  /* The headers of RFC 5424 and 3164 at a datagram socket, the messages
+   * dropped while nobody reads them, the framing of a stream */
+  const char *path = "/tmp/test_syslog.socket" ;
+  const char *stream_path = "/tmp/test_syslog_stream.socket" ;
+  int receiver = bound_socket(path, SOCK_DGRAM) ;
+  char pid[32] ;
+  sprintf(pid, "%d", getpid()) ;
+
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  qmlog::log_syslog_socket *log = new qmlog::log_syslog_socket(path, qmlog::Full, d, qmlog::Rfc5424) ;
+  d->message(qmlog::Info, "hello") ;
+  delete d ;
+  string datagram = receive_datagram(receiver) ;
+  log_assert(datagram.compare(0, 6, "<30>1 ")==0 and ends_with(datagram, " qmlog-example " + string(pid) + " - - INFO: hello"), "%s", datagram.c_str()) ;
+
+  d = new qmlog::dispatcher_t ;
+  log = new qmlog::log_syslog_socket(path, qmlog::Full, d) ;
+  d->message(qmlog::Warning, "careful") ;
+  log->set_max_pending(4096) ;
+  const int messages = 3000 ;
+  for (int i=0; i<messages; ++i)
+    d->message(qmlog::Debug, "message number %d, nobody reads it yet", i) ;
+  int received = 0 ;
+  datagram = receive_datagram(receiver) ;
+  log_assert(datagram.compare(0, 4, "<28>")==0 and ends_with(datagram, " qmlog-example[" + string(pid) + "]: WARNING: careful"), "%s", datagram.c_str()) ;
+  for (int before=-1; before!=received; ) // until flushing sends no more
+  {
+    before = received ;
+    while (receive_datagram(receiver)!="(none)")
+      ++received ;
+    d->flush() ;
+  }
+  unsigned long dropped = log->dropped() ;
+  delete d ;
+  log_assert(dropped>0 and received+dropped==(unsigned long)messages, "received %d, dropped %lu", received, dropped) ;
+  close(receiver) ;
+  unlink(path) ;
+
+  int listener = bound_socket(stream_path, SOCK_STREAM) ;
+  d = new qmlog::dispatcher_t ;
+  log = new qmlog::log_syslog_socket(stream_path, qmlog::Full, d, qmlog::Rfc5424) ;
+  log->set_flush_policy(4096) ;
+  d->message(qmlog::Info, "one") ;
+  d->message(qmlog::Info, "two") ;
+  d->flush() ;
+  int connection = accept(listener, NULL, NULL) ;
+  delete d ;
+  string text ;
+  char chunk[1024] ;
+  for (ssize_t n; (n = read(connection, chunk, sizeof(chunk)))>0; )
+    text.append(chunk, n) ;
+  close(connection) ;
+  close(listener) ;
+  unlink(stream_path) ;
+  vector<string> framed ;
+  for (size_t at=0; at<text.size(); )
+  {
+    size_t space = text.find(' ', at) ;
+    log_assert(space!=string::npos, "%s", text.c_str()) ;
+    unsigned length = atoi(text.c_str()+at) ;
+    framed.push_back(text.substr(space+1, length)) ;
+    at = space + 1 + length ;
+  }
+  log_assert(framed.size()==2 and ends_with(framed[0], "INFO: one") and ends_with(framed[1], "INFO: two"), "%s", text.c_str()) ;
+  log_notice("success") ;
+}
+
+/* What log_shm_ring::tail() prints for the ring 'name' */
+static string ring_contents(const char *name)
+{
+  const char *path = "/tmp/test_shm_ring.out" ;
+  FILE *out = fopen(path, "w") ;
+  bool found = qmlog::log_shm_ring::tail(name, out) ;
+  fclose(out) ;
+  return found ? file_contents(path) : "(none)" ;
+}
+
+void test_shm_ring()
+{
+  /* The messages in the ring, the newest ones when it was full; the
+   * ring named after the pid, gone with the log */
+  /* made by someone else in advance to read the messages: replaced */
+  int fd = shm_open("/qmlog-test-ring", O_RDWR | O_CREAT, 0666) ;
+  log_assert(fd>=0 and ftruncate(fd, 1<<16)==0, "%m") ;
+  fchmod(fd, 0666) ;
+  char *spy = (char *) mmap(NULL, 1<<16, PROT_READ, MAP_SHARED, fd, 0) ;
+  close(fd) ;
+  log_assert(spy!=MAP_FAILED, "%m") ;
+
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  (new qmlog::log_shm_ring("/qmlog-test-ring", qmlog::Full, d, 4096))->set_fields(qmlog::Message) ;
+  log_assert(ring_contents("/qmlog-test-ring")=="") ;
+  d->message(qmlog::Info, "one") ;
+  d->message(qmlog::Info, "two") ;
+  d->message(qmlog::Info, "three") ;
+  string text = ring_contents("/qmlog-test-ring") ;
+  log_assert(text=="one\ntwo\nthree\n", "%s", text.c_str()) ;
+  log_assert(memmem(spy, 1<<16, "three", 5)==NULL, "written to the old ring") ;
+  munmap(spy, 1<<16) ;
+
+  for (int i=0; i<1000; ++i)
+    d->message(qmlog::Info, "message %d", i) ;
+  text = ring_contents("/qmlog-test-ring") ;
+  int first = -1, count = 0 ;
+  sscanf(text.c_str(), "message %d", &first) ;
+  for (size_t at=0; (at = text.find('\n', at))!=string::npos; ++at)
+    ++count ;
+  log_assert(first>0 and first+count==1000 and text.size()<4096, "%s", text.c_str()) ;
+  for (int i=first; i<1000; ++i)
+  {
+    char line[32] ;
+    sprintf(line, "message %d\n", i) ;
+    log_assert(text.find(line)!=string::npos, "%s missing", line) ;
+  }
+  delete d ;
+  log_assert(ring_contents("/qmlog-test-ring")=="(none)") ;
+
+  d = new qmlog::dispatcher_t ;
+  (new qmlog::log_shm_ring(NULL, qmlog::Full, d))->set_fields(qmlog::Level | qmlog::Message) ;
+  d->message(qmlog::Warning, "by pid") ;
+  char pid[32] ;
+  sprintf(pid, "%d", getpid()) ;
+  text = ring_contents(pid) ;
+  log_assert(text=="WARNING: by pid\n", "%s", text.c_str()) ;
+  delete d ;
+  log_notice("success") ;
+}
+
+void test_flight_recorder()
+{
+  /* The debug messages kept in memory only, the newest ones dumped when
+   * the program is to be aborted or crashes; a dump has the records
+   * stored since the previous one */
+  const char *path = "/tmp/test_flight.log", *dump = "/tmp/test_flight.dump" ;
+  unlink(path) ;
+  unlink(dump) ;
+  qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+  (new qmlog::log_file(path, qmlog::Warning, d))->set_fields(qmlog::Level | qmlog::Message) ;
+  new qmlog::log_flight_recorder(qmlog::Full, d, 4096, dump) ;
+  for (int i=0; i<100; ++i)
+    d->message(qmlog::Debug, __LINE__, __FILE__, __func__, "debug %d", i) ;
+  d->message(qmlog::Warning, "visible") ;
+  string text = file_contents(path) ;
+  log_assert(text=="WARNING: visible\n", "%s", text.c_str()) ;
+  log_assert(access(dump, F_OK)!=0, "dumped too early") ;
+
+  d->message_abortion(false, __LINE__, __FILE__, __func__) ;
+  text = file_contents(dump) ;
+  log_assert(text.find("-- flight recorder of process")==0, "%s", text.c_str()) ;
+  log_assert(text.find("DEBUG at ")!=string::npos and text.find(" in test_flight_recorder: debug 99\n")!=string::npos, "%s", text.c_str()) ;
+  log_assert(text.find("debug 0\n")==string::npos and text.find("WARNING: visible\n")!=string::npos, "%s", text.c_str()) ;
+  log_assert(text.find("Program is to be aborted")!=string::npos, "%s", text.c_str()) ;
+  log_assert(text.find("visible")<text.find("Program is to be aborted"), "%s", text.c_str()) ;
+  size_t date = text.find('\n') + 1 ;
+  log_assert(text.size()>date+30 and text[date+4]=='-' and text.compare(date+26, 5, " UTC ")==0, "%s", text.c_str()) ;
+
+  unlink(dump) ;
+  pid_t child = fork() ;
+  if (child==0)
+  {
+    qmlog::log_flight_recorder::dump_on_fatal_signals() ;
+    d->message(qmlog::Debug, "before crash") ;
+    new qmlog::log_flight_recorder(qmlog::Full, d, 1<<20, dump) ;
+    d->message(qmlog::Debug, "n=%d u=%u x=%lx s=%s f=%.2f p=%p c=%c%%", -42, 7u, 255ul, "abc", 1.5, (void*)0x10, 'z') ;
+    string huge(128<<10, 'h') ;
+    d->message(qmlog::Debug, "huge %s", huge.c_str()) ;
+    raise(SIGSEGV) ;
+    _exit(0) ;
+  }
+  int status = 0 ;
+  waitpid(child, &status, 0) ;
+  log_assert(WIFSIGNALED(status) and WTERMSIG(status)==SIGSEGV, "status %d", status) ;
+  text = file_contents(dump) ;
+  log_assert(text.find("DEBUG: before crash\n")!=string::npos and text.find("debug 99")==string::npos, "%s", text.c_str()) ;
+  log_assert(text.find("DEBUG: n=-42 u=7 x=ff s=abc f=1.50 p=0x10 c=z%\n")!=string::npos, "%s", text.c_str()) ;
+  size_t huge = text.find("DEBUG: huge hhh") ;
+  log_assert(huge!=string::npos and text.find('\n', huge) - huge < (64<<10) and *text.rbegin()=='\n', "cut: %d", (int)(text.size()-huge)) ;
+  delete d ;
+  unlink(path) ;
+  unlink(dump) ;
+  log_notice("success") ;
+}
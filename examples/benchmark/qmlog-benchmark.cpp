@@ -0,0 +1,662 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <string>
+using namespace std ;
+
+#include <qmlog>
+
+/* All the benchmarks are using their own dispatchers,
+ * the time spent in the logging calls is printed to stdout */
+
+void bench_threads(int argc, char *argv[]) ;
+void bench_caller(int argc, char *argv[]) ;
+void bench_binary(int argc, char *argv[]) ;
+void bench_timestamp(int argc, char *argv[]) ;
+void bench_compose(int argc, char *argv[]) ;
+void bench_fanout(int argc, char *argv[]) ;
+void bench_flush(int argc, char *argv[]) ;
+void bench_batch(int argc, char *argv[]) ;
+void bench_reopen(int argc, char *argv[]) ;
+void bench_sites(int argc, char *argv[]) ;
+void bench_switches(int argc, char *argv[]) ;
+void bench_startup(int argc, char *argv[]) ;
+void bench_structured(int argc, char *argv[]) ;
+void bench_syslog(int argc, char *argv[]) ;
+void bench_ring(int argc, char *argv[]) ;
+void bench_recorder(int argc, char *argv[]) ;
+
+int main(int argc, char *argv[])
+{
+  if (argc<2)
+  {
+    printf("usage: %s <benchmark> [parameters]\n", argv[0]) ;
+    printf("  bench_threads [max_threads]  -- throughput of concurrent logging\n") ;
+    printf("  bench_caller                 -- time spent by the caller: sync, async, deferred\n") ;
+    printf("  bench_binary [directory]     -- text, binary and mapped log files\n") ;
+    printf("  bench_timestamp              -- composing the time fields and the pid\n") ;
+    printf("  bench_compose                -- composing with the fields of the usual logs\n") ;
+    printf("  bench_fanout                 -- the same message to several logs\n") ;
+    printf("  bench_flush [directory]      -- log file flushing each message or keeping them back\n") ;
+    printf("  bench_batch [directory]      -- batches of 1, 10, 100 messages: stdio versus writev()\n") ;
+    printf("  bench_reopen [directory]     -- following external rotation: Close_After_Write, Reopen_If_Moved\n") ;
+    printf("  bench_sites [directory]      -- location given with each call or by a call site\n") ;
+    printf("  bench_switches               -- a debug message not logged: level or call site switch\n") ;
+    printf("  bench_startup [directory]    -- running \"hello, world\" with and without libqmlog\n") ;
+    printf("  bench_structured [directory] -- key/value pairs: printf text, text, JSON, logfmt\n") ;
+    printf("  bench_syslog [directory]     -- syslog socket: a datagram per message or batches\n") ;
+    printf("  bench_ring [directory]       -- text, mapped log file and shared memory ring\n") ;
+    printf("  bench_recorder               -- debug messages not logged, with and without a flight recorder\n") ;
+    return 1 ;
+  }
+
+  if (not true) (void)true ;
+#define run_if_match(x) else if((string)argv[1]==#x) x(argc-2, argv+2)
+  run_if_match(bench_threads) ;
+  run_if_match(bench_caller) ;
+  run_if_match(bench_binary) ;
+  run_if_match(bench_timestamp) ;
+  run_if_match(bench_compose) ;
+  run_if_match(bench_fanout) ;
+  run_if_match(bench_flush) ;
+  run_if_match(bench_batch) ;
+  run_if_match(bench_reopen) ;
+  run_if_match(bench_sites) ;
+  run_if_match(bench_switches) ;
+  run_if_match(bench_startup) ;
+  run_if_match(bench_structured) ;
+  run_if_match(bench_syslog) ;
+  run_if_match(bench_ring) ;
+  run_if_match(bench_recorder) ;
+  else
+  {
+    fprintf(stderr, "invalid benchmark name: '%s'\n", argv[1]) ;
+    return 1 ;
+  }
+#undef run_if_match
+
+  return 0 ;
+}
+
+/* A log throwing the messages away: measures the library, not the disk */
+class log_null : public qmlog::abstract_log_t
+{
+public:
+  log_null(qmlog::dispatcher_t *d) : qmlog::abstract_log_t(qmlog::Full, d) { }
+  virtual ~log_null() { detach_all() ; }
+  void submit_message(qmlog::dispatcher_t *, int, const char *) { }
+} ;
+
+/* What log_file used to do: fprintf() to a stream, fflush() after a batch */
+class log_stdio : public qmlog::abstract_log_t
+{
+  FILE *fp ;
+  int batch, count ;
+public:
+  log_stdio(const char *path, int batch, qmlog::dispatcher_t *d) : qmlog::abstract_log_t(qmlog::Full, d), batch(batch), count(0)
+  {
+    fp = fopen(path, "a") ;
+  }
+  virtual ~log_stdio() { detach_all() ; fclose(fp) ; }
+  void submit_message(qmlog::dispatcher_t *, int, const char *message)
+  {
+    fprintf(fp, "%s\n", message) ;
+    if (++count % batch == 0)
+      fflush(fp) ;
+  }
+} ;
+
+double seconds()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return ts.tv_sec + ts.tv_nsec / 1e9 ;
+}
+
+struct worker_t
+{
+  pthread_t thread ;
+  qmlog::dispatcher_t *d ;
+  int id, messages ;
+} ;
+
+void *worker(void *p)
+{
+  worker_t *w = (worker_t *) p ;
+  for (int i=0; i<w->messages; ++i)
+    w->d->message(qmlog::Debug, __LINE__, __FILE__, __PRETTY_FUNCTION__, "thread %d, message %d", w->id, i) ;
+  return NULL ;
+}
+
+double run_threads(qmlog::dispatcher_t *d, int threads, int messages)
+{
+  worker_t *w = new worker_t[threads] ;
+  double start = seconds() ;
+  for (int i=0; i<threads; ++i)
+  {
+    w[i].d = d, w[i].id = i, w[i].messages = messages ;
+    pthread_create(&w[i].thread, NULL, worker, &w[i]) ;
+  }
+  for (int i=0; i<threads; ++i)
+    pthread_join(w[i].thread, NULL) ;
+  double elapsed = seconds() - start ;
+  delete[] w ;
+  return threads * messages / elapsed ;
+}
+
+void bench_threads(int argc, char *argv[])
+{
+  /* Each thread is logging the same number of messages,
+   * ideal scaling would multiply the throughput by the number of threads */
+  int max_threads = argc>0 ? atoi(argv[0]) : sysconf(_SC_NPROCESSORS_ONLN) ;
+  const int messages = 200000 ;
+
+  for (int sink=0; sink<2; ++sink)
+  {
+    qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+    qmlog::abstract_log_t *l ;
+    if (sink==0)
+      l = new log_null(d) ;
+    else
+      l = new qmlog::log_file("/dev/null", qmlog::Full, d) ;
+    l->enable_fields(qmlog::Monotonic_Micro | qmlog::Time_Micro) ;
+
+    printf("%s, %d messages per thread\n", sink==0 ? "composing only" : "writing to /dev/null", messages) ;
+    printf("%8s %14s %8s\n", "threads", "messages/s", "scaling") ;
+    double single = 0 ;
+    for (int threads=1; threads<=max_threads; ++threads)
+    {
+      double rate = run_threads(d, threads, messages) ;
+      if (threads==1)
+        single = rate ;
+      printf("%8d %14.0f %8.2f\n", threads, rate, rate/single) ;
+    }
+    printf("\n") ;
+    delete d ;
+  }
+}
+
+void bench_caller(int, char *[])
+{
+  /* Only the time spent in the logging call is measured,
+   * the writer thread is running on another core (if any) */
+  const int messages = 500000 ;
+  const char *modes[] = { "synchronous", "asynchronous", "deferred formatting" } ;
+  printf("%d messages to /dev/null, queue of %d\n", messages, messages) ;
+  printf("%22s %12s\n", "mode", "ns/message") ;
+  for (int mode=0; mode<3; ++mode)
+  {
+    qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+    qmlog::log_file *file = new qmlog::log_file("/dev/null", qmlog::Full, d) ;
+    file->enable_fields(qmlog::Monotonic_Micro | qmlog::Time_Micro) ;
+    if (mode>0)
+      d->set_async(messages, qmlog::Block_If_Full, mode==2) ;
+    double start = seconds() ;
+    for (int i=0; i<messages; ++i)
+      d->message(qmlog::Debug, __LINE__, __FILE__, __PRETTY_FUNCTION__, "message %d of %d: '%s' %5.2f", i, messages, "string argument", i/3.0) ;
+    double elapsed = seconds() - start ;
+    printf("%22s %12.1f\n", modes[mode], elapsed / messages * 1e9) ;
+    delete d ;
+  }
+}
+
+void bench_binary(int argc, char *argv[])
+{
+  /* The logs are written with the default fields to a real file,
+   * the size of the binary one doesn't depend on the fields */
+  string directory = argc>0 ? argv[0] : "/tmp" ;
+  const int messages = 200000 ;
+  const char *kinds[] = { "text", "binary", "mmap" } ;
+  printf("%d messages to %s\n", messages, directory.c_str()) ;
+  printf("%8s %12s %14s %10s\n", "log", "ns/message", "bytes", "bytes/msg") ;
+  for (int kind=0; kind<3; ++kind)
+  {
+    string path = directory + "/qmlog-benchmark." + kinds[kind] ;
+    unlink(path.c_str()) ;
+    qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+    if (kind==1)
+      new qmlog::log_binary_file(path.c_str(), qmlog::Full, d) ;
+    else if (kind==2)
+      new qmlog::log_mmap_file(path.c_str(), qmlog::Full, d, 64<<20) ;
+    else
+      new qmlog::log_file(path.c_str(), qmlog::Full, d) ;
+    double start = seconds() ;
+    for (int i=0; i<messages; ++i)
+      d->message(qmlog::Debug, __LINE__, __FILE__, __PRETTY_FUNCTION__, "message %d of %d: '%s' %5.2f", i, messages, "string argument", i/3.0) ;
+    double elapsed = seconds() - start ;
+    delete d ;
+    struct stat st ;
+    stat(path.c_str(), &st) ;
+    printf("%8s %12.1f %14lld %10.1f\n", kinds[kind], elapsed / messages * 1e9, (long long)st.st_size, (double)st.st_size / messages) ;
+    unlink(path.c_str()) ;
+    unlink((path + ".1").c_str()) ;
+  }
+}
+
+void bench_timestamp(int, char *[])
+{
+  /* A tight loop: nearly all the messages are logged in the same second */
+  const int messages = 1000000 ;
+  struct { const char *name ; int fields ; } cases[] =
+  {
+    { "Message", qmlog::Message },
+    { "Date|Time_Micro|Timezone_Offset", qmlog::Message | qmlog::Date | qmlog::Time_Micro | qmlog::Timezone_Offset },
+    { "Monotonic_Nano", qmlog::Message | qmlog::Monotonic_Nano },
+    { "Time_Milli|Timezone_Abbreviation", qmlog::Message | qmlog::Time_Milli | qmlog::Timezone_Abbreviation },
+    { "Timezone_Symlink", qmlog::Message | qmlog::Timezone_Symlink },
+    { "Pid", qmlog::Message | qmlog::Pid },
+  } ;
+  printf("%d messages, composing only\n", messages) ;
+  printf("%34s %12s\n", "fields", "ns/message") ;
+  for (unsigned c=0; c<sizeof(cases)/sizeof(*cases); ++c)
+  {
+    qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+    (new log_null(d))->set_fields(cases[c].fields) ;
+    double start = seconds() ;
+    for (int i=0; i<messages; ++i)
+      d->message(qmlog::Debug, "message") ;
+    double elapsed = seconds() - start ;
+    printf("%34s %12.1f\n", cases[c].name, elapsed / messages * 1e9) ;
+    delete d ;
+  }
+}
+
+void bench_compose(int, char *[])
+{
+  /* The fields as set up by the constructors of the logs */
+  const int messages = 1000000 ;
+  const int file_fields = qmlog::All_Fields & ~(qmlog::Time_Micro ^ qmlog::Time) & ~(qmlog::Monotonic_Nano ^ qmlog::Monotonic) ;
+  struct { const char *name ; int fields ; } cases[] =
+  {
+    { "log_file", file_fields },
+    { "log_stderr", (file_fields & ~qmlog::Timestamp_Mask) | qmlog::Time },
+    { "log_syslog", file_fields & ~qmlog::Timestamp_Mask & ~qmlog::Process_Block & ~qmlog::Multiline & ~qmlog::Timezone_Symlink },
+    { "Message|Level", qmlog::Message | qmlog::Level },
+    { "All_Fields, nano and micro", qmlog::All_Fields },
+  } ;
+  printf("%d messages with location, composing only\n", messages) ;
+  printf("%28s %12s\n", "fields", "ns/message") ;
+  for (unsigned c=0; c<sizeof(cases)/sizeof(*cases); ++c)
+  {
+    qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+    (new log_null(d))->set_fields(cases[c].fields) ;
+    double start = seconds() ;
+    for (int i=0; i<messages; ++i)
+      d->message(qmlog::Info, __LINE__, __FILE__, __PRETTY_FUNCTION__, "message %d", i) ;
+    double elapsed = seconds() - start ;
+    printf("%28s %12.1f\n", cases[c].name, elapsed / messages * 1e9) ;
+    delete d ;
+  }
+}
+
+void bench_fanout(int, char *[])
+{
+  /* Logs with the default fields of log_file: adding one more
+   * should only cost the writing, not the composing */
+  const int messages = 500000 ;
+  printf("%d messages with location, composing only\n", messages) ;
+  printf("%6s %12s\n", "logs", "ns/message") ;
+  for (int logs=1; logs<=4; ++logs)
+  {
+    qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+    for (int i=0; i<logs; ++i)
+      new log_null(d) ;
+    double start = seconds() ;
+    for (int i=0; i<messages; ++i)
+      d->message(qmlog::Info, __LINE__, __FILE__, __PRETTY_FUNCTION__, "message %d: '%s' %5.2f", i, "string argument", i/3.0) ;
+    double elapsed = seconds() - start ;
+    printf("%6d %12.1f\n", logs, elapsed / messages * 1e9) ;
+    delete d ;
+  }
+}
+
+void bench_flush(int argc, char *argv[])
+{
+  /* One write() per message versus one per 64K */
+  string path = (argc>0 ? argv[0] : "/tmp") + string("/qmlog-benchmark.log") ;
+  const int messages = 200000 ;
+  printf("%d messages to %s\n", messages, path.c_str()) ;
+  printf("%12s %12s\n", "flush", "ns/message") ;
+  for (int kept_back=0; kept_back<2; ++kept_back)
+  {
+    unlink(path.c_str()) ;
+    qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+    qmlog::log_file *file = new qmlog::log_file(path.c_str(), qmlog::Full, d) ;
+    if (kept_back)
+      file->set_flush_policy(64*1024, 1000) ;
+    double start = seconds() ;
+    for (int i=0; i<messages; ++i)
+      d->message(qmlog::Debug, __LINE__, __FILE__, __PRETTY_FUNCTION__, "message %d of %d", i, messages) ;
+    delete d ;
+    double elapsed = seconds() - start ;
+    printf("%12s %12.1f\n", kept_back ? "every 64K" : "every one", elapsed / messages * 1e9) ;
+    unlink(path.c_str()) ;
+  }
+}
+
+void bench_batch(int argc, char *argv[])
+{
+  /* The messages have the same length: a batch is a number of bytes */
+  string path = (argc>0 ? argv[0] : "/tmp") + string("/qmlog-benchmark.log") ;
+  const int messages = 200000, length = sizeof("message 12345678") ;
+  printf("%d messages to %s\n", messages, path.c_str()) ;
+  printf("%6s %12s %12s\n", "batch", "stdio", "writev") ;
+  for (int batch=1; batch<=100; batch*=10)
+  {
+    printf("%6d", batch) ;
+    for (int raw=0; raw<2; ++raw)
+    {
+      unlink(path.c_str()) ;
+      qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+      qmlog::abstract_log_t *l ;
+      if (raw)
+      {
+        qmlog::log_file *file = new qmlog::log_file(path.c_str(), qmlog::Full, d) ;
+        if (batch>1)
+          file->set_flush_policy(batch*length) ;
+        l = file ;
+      }
+      else
+        l = new log_stdio(path.c_str(), batch, d) ;
+      l->set_fields(qmlog::Message) ;
+      double start = seconds() ;
+      for (int i=0; i<messages; ++i)
+        d->message(qmlog::Debug, "message %08d", i) ;
+      delete d ;
+      double elapsed = seconds() - start ;
+      printf(" %12.1f", elapsed / messages * 1e9) ;
+      unlink(path.c_str()) ;
+    }
+    printf("\n") ;
+  }
+  printf("(ns/message)\n") ;
+}
+
+void bench_reopen(int argc, char *argv[])
+{
+  string path = (argc>0 ? argv[0] : "/tmp") + string("/qmlog-benchmark.log") ;
+  const int messages = 200000 ;
+  struct { const char *name ; int fields ; } cases[] =
+  {
+    { "none", 0 },
+    { "Close_After_Write", qmlog::Close_After_Write },
+    { "Reopen_If_Moved", qmlog::Reopen_If_Moved },
+  } ;
+  printf("%d messages to %s\n", messages, path.c_str()) ;
+  printf("%18s %12s\n", "fields", "ns/message") ;
+  for (unsigned c=0; c<sizeof(cases)/sizeof(*cases); ++c)
+  {
+    unlink(path.c_str()) ;
+    qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+    qmlog::log_file *file = new qmlog::log_file(path.c_str(), qmlog::Full, d) ;
+    file->set_fields(qmlog::Message | cases[c].fields) ;
+    double start = seconds() ;
+    for (int i=0; i<messages; ++i)
+      d->message(qmlog::Debug, "message %d of %d", i, messages) ;
+    delete d ;
+    double elapsed = seconds() - start ;
+    printf("%18s %12.1f\n", cases[c].name, elapsed / messages * 1e9) ;
+    unlink(path.c_str()) ;
+  }
+}
+
+void bench_sites(int argc, char *argv[])
+{
+  /* The same messages with "file:line" rendered for each of them or
+   * once for their call site, composed only and in a binary log */
+  string path = (argc>0 ? argv[0] : "/tmp") + string("/qmlog-benchmark.bin") ;
+  const int messages = 500000 ;
+  printf("%d messages with location\n", messages) ;
+  printf("%10s %16s %16s %10s\n", "location", "composing ns", "binary ns", "bytes/msg") ;
+  for (int by_site=0; by_site<2; ++by_site)
+  {
+    qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+    (new log_null(d))->set_fields(qmlog::Message | qmlog::Location_Block) ;
+    static qmlog::site_t site = { qmlog::Info, __LINE__, __FILE__, __PRETTY_FUNCTION__, 0, NULL, false } ;
+    double start = seconds() ;
+    for (int i=0; i<messages; ++i)
+      if (by_site)
+        d->message(&site, "message %d", i) ;
+      else
+        d->message(qmlog::Info, site.line, site.file, site.func, "message %d", i) ;
+    double composing = seconds() - start ;
+    delete d ;
+
+    unlink(path.c_str()) ;
+    d = new qmlog::dispatcher_t ;
+    new qmlog::log_binary_file(path.c_str(), qmlog::Full, d) ;
+    start = seconds() ;
+    for (int i=0; i<messages; ++i)
+      if (by_site)
+        d->message(&site, "message %d", i) ;
+      else
+        d->message(qmlog::Info, site.line, site.file, site.func, "message %d", i) ;
+    double binary = seconds() - start ;
+    delete d ;
+    struct stat st ;
+    stat(path.c_str(), &st) ;
+    printf("%10s %16.1f %16.1f %10.1f\n", by_site ? "site" : "each call", composing / messages * 1e9, binary / messages * 1e9, (double)st.st_size / messages) ;
+    unlink(path.c_str()) ;
+  }
+}
+
+void bench_switches(int, char *[])
+{
+  /* log_debug() with the dispatcher on the Info level, then with the
+   * level Full and the debug call sites switched off */
+  const int messages = 10000000 ;
+  printf("%d log_debug() calls, nothing logged\n", messages) ;
+  printf("%12s %12s\n", "by", "ns/call") ;
+  qmlog::enable() ; // the global switch is checked first in any case
+  for (int by_site=0; by_site<2; ++by_site)
+  {
+    qmlog::log_level(by_site ? qmlog::Full : qmlog::Info) ;
+    if (by_site)
+      qmlog::disable_sites("*", NULL, qmlog::Debug) ;
+    double start = seconds() ;
+    for (int i=0; i<messages; ++i)
+      log_debug("message %d", i) ;
+    double elapsed = seconds() - start ;
+    printf("%12s %12.2f\n", by_site ? "site switch" : "level", elapsed / messages * 1e9) ;
+  }
+  qmlog::object.reset_sites() ;
+}
+
+void bench_startup(int argc, char *argv[])
+{
+  /* The programs of examples/startup, their output goes to /dev/null */
+  string directory = argc>0 ? argv[0] : "/usr/bin" ;
+  const int runs = 500 ;
+  const char *programs[] = { "qmlog-hello-plain", "qmlog-hello" } ;
+  printf("%d runs of each program in %s\n", runs, directory.c_str()) ;
+  printf("%18s %12s\n", "program", "us/run") ;
+  for (int p=0; p<2; ++p)
+  {
+    string path = directory + "/" + programs[p] ;
+    double start = seconds() ;
+    for (int i=0; i<runs; ++i)
+    {
+      pid_t pid = fork() ;
+      if (pid==0)
+      {
+        int null = open("/dev/null", O_WRONLY) ;
+        dup2(null, 1) ;
+        execl(path.c_str(), programs[p], (char*)NULL) ;
+        _exit(127) ;
+      }
+      int status = 0 ;
+      waitpid(pid, &status, 0) ;
+      if (not WIFEXITED(status) or WEXITSTATUS(status)!=0)
+      {
+        printf("%s: failed\n", path.c_str()) ;
+        return ;
+      }
+    }
+    double elapsed = seconds() - start ;
+    printf("%18s %12.1f\n", programs[p], elapsed / runs * 1e6) ;
+  }
+}
+
+void bench_structured(int argc, char *argv[])
+{
+  /* The same data as a printf message and as key/value pairs written by
+   * the text, JSON and logfmt logs, all with the default fields of log_file */
+  string path = (argc>0 ? argv[0] : "/tmp") + string("/qmlog-benchmark.log") ;
+  const int messages = 500000 ;
+  const char *cases[] = { "printf", "text", "json", "logfmt" } ;
+  printf("%d messages with location and 4 values\n", messages) ;
+  printf("%10s %12s %10s\n", "log", "ns/message", "bytes/msg") ;
+  for (unsigned c=0; c<sizeof(cases)/sizeof(*cases); ++c)
+  {
+    unlink(path.c_str()) ;
+    qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+    if (c==2)
+      new qmlog::log_json(path.c_str(), qmlog::Full, d) ;
+    else if (c==3)
+      new qmlog::log_logfmt(path.c_str(), qmlog::Full, d) ;
+    else
+      new qmlog::log_file(path.c_str(), qmlog::Full, d) ;
+    static qmlog::site_t site = { qmlog::Info, __LINE__, __FILE__, __PRETTY_FUNCTION__, 0, NULL, false } ;
+    double start = seconds() ;
+    for (int i=0; i<messages; ++i)
+      if (c==0)
+        d->message(&site, "request done user=%s bytes=%d ratio=%g ok=%s", "someone", i, i/3.0, "true") ;
+      else
+        d->message(&site, qmlog::kv("user", "someone")("bytes", i)("ratio", i/3.0)("ok", true), "request done") ;
+    double elapsed = seconds() - start ;
+    delete d ;
+    struct stat st ;
+    stat(path.c_str(), &st) ;
+    printf("%10s %12.1f %10.1f\n", cases[c], elapsed / messages * 1e9, (double)st.st_size / messages) ;
+    unlink(path.c_str()) ;
+  }
+}
+
+static void *receive_until_closed(void *fd)
+{
+  char datagram[4096] ;
+  while (recv(*(int*)fd, datagram, sizeof(datagram), 0)>0)
+    ;
+  return NULL ;
+}
+
+void bench_syslog(int argc, char *argv[])
+{
+  /* A thread standing in for syslogd reads as fast as it can, the
+   * messages it can't take are dropped instead of waited for */
+  string path = (argc>0 ? argv[0] : "/tmp") + string("/qmlog-benchmark.socket") ;
+  const int messages = 500000 ;
+  printf("%d messages\n", messages) ;
+  printf("%14s %12s %10s\n", "sending", "ns/message", "dropped") ;
+  for (int batched=0; batched<2; ++batched)
+  {
+    unlink(path.c_str()) ;
+    int receiver = socket(AF_UNIX, SOCK_DGRAM, 0) ;
+    struct sockaddr_un address ;
+    memset(&address, 0, sizeof(address)) ;
+    address.sun_family = AF_UNIX ;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path)-1) ;
+    bind(receiver, (struct sockaddr *)&address, sizeof(address)) ;
+    pthread_t thread ;
+    pthread_create(&thread, NULL, receive_until_closed, &receiver) ;
+
+    qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+    qmlog::log_syslog_socket *log = new qmlog::log_syslog_socket(path.c_str(), qmlog::Full, d) ;
+    if (batched)
+      log->set_flush_policy(16*1024) ;
+    double start = seconds() ;
+    for (int i=0; i<messages; ++i)
+      d->message(qmlog::Info, "message %d", i) ;
+    d->flush() ;
+    double elapsed = seconds() - start ;
+    unsigned long dropped = log->dropped() ;
+    delete d ;
+    shutdown(receiver, SHUT_RDWR) ;
+    pthread_join(thread, NULL) ;
+    close(receiver) ;
+    unlink(path.c_str()) ;
+    printf("%14s %12.1f %10lu\n", batched ? "16K batches" : "each message", elapsed / messages * 1e9, dropped) ;
+  }
+}
+
+void bench_ring(int argc, char *argv[])
+{
+  /* The debug messages nobody reads unless something happens: written to
+   * a file, to a mapped file or to a ring in shared memory */
+  string path = (argc>0 ? argv[0] : "/tmp") + string("/qmlog-benchmark.log") ;
+  const int messages = 1000000 ;
+  const char *cases[] = { "log_file", "log_mmap_file", "log_shm_ring" } ;
+  printf("%d messages with location\n", messages) ;
+  printf("%14s %12s\n", "log", "ns/message") ;
+  for (unsigned c=0; c<sizeof(cases)/sizeof(*cases); ++c)
+  {
+    unlink(path.c_str()) ;
+    qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+    if (c==0)
+      new qmlog::log_file(path.c_str(), qmlog::Full, d) ;
+    else if (c==1)
+      new qmlog::log_mmap_file(path.c_str(), qmlog::Full, d) ;
+    else
+      new qmlog::log_shm_ring(NULL, qmlog::Full, d) ;
+    double start = seconds() ;
+    for (int i=0; i<messages; ++i)
+      d->message(qmlog::Debug, __LINE__, __FILE__, __PRETTY_FUNCTION__, "message %d", i) ;
+    double elapsed = seconds() - start ;
+    delete d ;
+    printf("%14s %12.1f\n", cases[c], elapsed / messages * 1e9) ;
+    unlink(path.c_str()) ;
+    unlink((path + ".1").c_str()) ;
+  }
+}
+
+void bench_recorder(int, char *[])
+{
+  /* What keeping the debug messages for a dump costs: the visible log
+   * wants warnings only, a flight recorder all the messages */
+  const int messages = 1000000 ;
+  const char *cases[] = { "log_null", "+ recorder" } ;
+  printf("%d debug messages with location, the log at Warning\n", messages) ;
+  printf("%14s %12s\n", "logs", "ns/message") ;
+  for (unsigned c=0; c<sizeof(cases)/sizeof(*cases); ++c)
+  {
+    qmlog::dispatcher_t *d = new qmlog::dispatcher_t ;
+    (new log_null(d))->reduce_max_level(qmlog::Warning) ;
+    if (c==1)
+      new qmlog::log_flight_recorder(qmlog::Full, d) ;
+    double start = seconds() ;
+    for (int i=0; i<messages; ++i)
+      d->message(qmlog::Debug, __LINE__, __FILE__, __PRETTY_FUNCTION__, "message %d", i) ;
+    double elapsed = seconds() - start ;
+    delete d ;
+    printf("%14s %12.1f\n", cases[c], elapsed / messages * 1e9) ;
+  }
+}
@@ -1,3 +1,3 @@
 TEMPLATE = subdirs
 
-SUBDIRS = application # library client server
+SUBDIRS = application benchmark format startup # library client server
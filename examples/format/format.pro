@@ -0,0 +1,14 @@
+TEMPLATE = app
+TARGET = qmlog-format-example
+
+SOURCES += qmlog-format-example.cpp
+INCLUDEPATH += ../../src/ ../../
+
+QMAKE_LIBDIR_FLAGS += -L../../src
+LIBS += -lqmlog -lpthread
+
+target.path = $$(DESTDIR)/usr/bin
+
+QMAKE_CXXFLAGS = -std=c++0x -Wall -Werror -Wno-psabi
+
+INSTALLS += target
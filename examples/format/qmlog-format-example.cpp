@@ -0,0 +1,141 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+using namespace std ;
+
+/* The macros log to this one, see QMLOG_DISPATCHER */
+namespace qmlog { class dispatcher_t ; }
+qmlog::dispatcher_t *current_dispatcher ;
+#define QMLOG_DISPATCHER current_dispatcher
+
+#include <qmlog>
+#include <libqmlog/format.h>
+
+/* The "{}" front end of libqmlog/format.h, a C++11 program */
+
+void test_format() ;
+void test_format_levels() ;
+void run_all() ;
+
+int main(int argc, char *argv[])
+{
+  current_dispatcher = qmlog::object.get_default_dispatcher() ;
+  log_notice_fmt("started with {} arguments", argc-1) ;
+
+  for(int i=1; i<argc; ++i)
+  {
+    if (not true) (void)true ;
+#define run_if_match(x) else if((string)argv[i]==#x) x()
+    run_if_match(test_format) ;
+    run_if_match(test_format_levels) ;
+    run_if_match(run_all) ;
+    else
+      log_error_fmt("invalid function name: '{}'", argv[i]) ;
+#undef  run_if_match
+  }
+  return 0 ;
+}
+
+void run_all()
+{
+  test_format() ;
+  test_format_levels() ;
+}
+
+string file_contents(const char *path)
+{
+  string text ;
+  FILE *fp = fopen(path, "r") ;
+  log_assert(fp!=NULL, "can't read '%s': %m", path) ;
+  for (int c; (c=fgetc(fp))!=EOF; )
+    text += (char)c ;
+  fclose(fp) ;
+  return text ;
+}
+
+enum color_t { Red, Green, Blue } ;
+
+void test_format()
+{
+  /* Every supported kind of argument */
+  const char *path = "/tmp/test_format.log" ;
+  unlink(path) ;
+  qmlog::dispatcher_t *d = current_dispatcher = new qmlog::dispatcher_t ;
+  (new qmlog::log_file(path, qmlog::Full, d))->set_fields(qmlog::Message) ;
+
+  const char *null = NULL ;
+  string s = "std::string" ;
+  log_info_fmt("int {} unsigned {} long long {} short {}", -42, 42u, -1234567890123LL, (short)-7) ;
+  log_info_fmt("char {} bool {} {} enum {}", 'x', true, false, Blue) ;
+  log_info_fmt("double {} float {}", 2.5, 0.125f) ;
+  log_info_fmt("string '{}' '{}' '{}'", "literal", s, null) ;
+  log_info_fmt("pointer {}", (void*)0x1234) ;
+  log_info_fmt("braces {{}} {{{}}}", 1) ;
+  log_info_fmt("no arguments") ;
+  log_info_fmt("{}{}", "adjacent", 2) ;
+
+  current_dispatcher = qmlog::object.get_default_dispatcher() ;
+  delete d ;
+
+  string text = file_contents(path) ;
+  const char *expected =
+    "int -42 unsigned 42 long long -1234567890123 short -7\n"
+    "char x bool true false enum 2\n"
+    "double 2.5 float 0.125\n"
+    "string 'literal' 'std::string' '(null)'\n"
+    "pointer 0x1234\n"
+    "braces {} {1}\n"
+    "no arguments\n"
+    "adjacent2\n" ;
+  log_assert(text==expected, "%s", text.c_str()) ;
+  log_notice_fmt("success") ;
+}
+
+void test_format_levels()
+{
+  /* Nothing is formatted for a level nobody wants, the location is
+   * added as by the printf-like macros */
+  const char *path = "/tmp/test_format_levels.log" ;
+  unlink(path) ;
+  qmlog::dispatcher_t *d = current_dispatcher = new qmlog::dispatcher_t ;
+  (new qmlog::log_file(path, qmlog::Full, d))->set_fields(qmlog::Message | qmlog::Line) ;
+  d->log_level(qmlog::Notice) ;
+
+  int evaluated = 0 ;
+  log_debug_fmt("not wanted {}", ++evaluated) ;
+  log_warning_fmt("wanted") ;
+  log_debug("printf-like, not wanted") ;
+  log_internal_fmt("with location") ; int line = __LINE__ ;
+
+  current_dispatcher = qmlog::object.get_default_dispatcher() ;
+  delete d ;
+
+  char expected[100] ;
+  snprintf(expected, sizeof(expected), "wanted\nat %s:%d: with location\n", __FILE__, line) ;
+  string text = file_contents(path) ;
+  log_assert(text==expected, "%s", text.c_str()) ;
+  log_assert(evaluated==1) ; // the arguments are evaluated, as with printf
+  log_notice_fmt("success") ;
+}
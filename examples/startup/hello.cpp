@@ -0,0 +1,38 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <cstdio>
+
+#ifdef WITH_QMLOG
+#include <qmlog>
+#endif
+
+/* The same "hello, world" built with and without libqmlog:
+ * 'qmlog-benchmark bench_startup' runs both */
+
+int main()
+{
+  printf("hello, world\n") ;
+#ifdef WITH_QMLOG
+  log_debug("said hello") ;
+#endif
+  return 0 ;
+}
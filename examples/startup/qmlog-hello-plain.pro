@@ -0,0 +1,11 @@
+TEMPLATE = app
+TARGET = qmlog-hello-plain
+CONFIG -= qt
+
+SOURCES += hello.cpp
+
+target.path = $$(DESTDIR)/usr/bin
+
+QMAKE_CXXFLAGS = -Wall -Werror -Wno-psabi
+
+INSTALLS += target
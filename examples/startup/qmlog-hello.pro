@@ -0,0 +1,16 @@
+TEMPLATE = app
+TARGET = qmlog-hello
+CONFIG -= qt
+
+SOURCES += hello.cpp
+INCLUDEPATH += ../../src/ ../../
+DEFINES += WITH_QMLOG
+
+QMAKE_LIBDIR_FLAGS += -L../../src
+LIBS += -lqmlog -lpthread
+
+target.path = $$(DESTDIR)/usr/bin
+
+QMAKE_CXXFLAGS = -Wall -Werror -Wno-psabi
+
+INSTALLS += target
@@ -0,0 +1,3 @@
+TEMPLATE = subdirs
+
+SUBDIRS = qmlog-hello.pro qmlog-hello-plain.pro
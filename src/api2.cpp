@@ -20,18 +20,34 @@
 #   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
 \_______________________________________________________________________*/
 #include <syslog.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #include <string>
 #include <set>
+#include <algorithm>
 using namespace std ;
 
 #include "api2.h"
+#include "async.h"
+#include "thread.h"
+#include "record.h"
+#include "timezone.h"
+#include "layout.h"
+#include "rotation.h"
+#include "site.h"
+#include "control.h"
+#include "flush.h"
+#include "structured.h"
 
 namespace qmlog
 {
@@ -42,6 +58,8 @@ namespace qmlog
     default_dispatcher = NULL ;
     syslog_logger = NULL ;
     stderr_logger = NULL ;
+    timezone_watcher = NULL ;
+    control_watcher = NULL ;
 
     // fprintf(::stderr, "%s\n", __PRETTY_FUNCTION__) ;
     static bool first = true ;
@@ -56,62 +74,95 @@ namespace qmlog
     first = false ;
 
     currently_enabled = false ;
-    if(access(QMLOG_ENABLER1, F_OK)==0)
-      currently_enabled = true ;
+    process_name = NULL ;
+    __atomic_store_n(&timezone_watcher, new timezone_watcher_t, __ATOMIC_RELEASE) ;
     register_dispatcher(default_dispatcher=new dispatcher_t) ;
     new qmlog::log_syslog(qmlog::Full, default_dispatcher) ;
     new qmlog::log_stderr(qmlog::Full, default_dispatcher) ;
     // fprintf(::stderr, "syslog_logger=%p, stderr_logger=%p\n", syslog_logger, stderr_logger) ;
+    pthread_atfork(before_fork, after_fork_in_parent, after_fork_in_child) ;
 
-    set_process_name(calculate_process_name()) ;
+    if (const char *rules = getenv("QMLOG_SITES"))
+      read_site_rules(rules) ;
+
+    // Only a control file asked for is watched by a thread of its own
+    if (const char *control = getenv("QMLOG_CONTROL"))
+      set_control_file(control) ;
+    else
+      control_watcher_t::apply_once(QMLOG_ENABLER1) ; // enables logging if it exists
   }
 
   object_t::~object_t()
   {
+    set_control_file(NULL) ; // its thread takes the lock
+    config_lock_t lock ;
     set<dispatcher_t*> d_copy = dispatchers ;
     for(set<dispatcher_t*>::iterator it=d_copy.begin(); it!=d_copy.end(); ++it)
       delete *it ;
+    timezone_watcher_t *w = timezone_watcher ;
+    __atomic_store_n(&timezone_watcher, (timezone_watcher_t*)NULL, __ATOMIC_RELEASE) ;
+    synchronize_readers() ; // messages logged later check the timezone every second
+    delete w ;
   }
 
-  string object_t::calculate_process_name()
+  void object_t::set_timezone_check_interval(int seconds)
   {
-    static const char *anonymous = "<unknown>" ;
-    const unsigned int len = 256 ;
-    char buf[len+1] ;
-
-    FILE *fp = fopen("/proc/self/cmdline", "r") ;
-
-    if(fp==NULL)
-      return anonymous ;
-
-    string name ;
+    config_lock_t lock ;
+    if (timezone_watcher)
+      timezone_watcher->set_interval(seconds) ;
+  }
 
-    for(bool word_done=false; not word_done; )
+  // The name is not needed before the first message, and most programs
+  // never change it: glibc already has it, elsewhere /proc is read once.
+  const char *object_t::default_process_name()
+  {
+    static const char *anonymous = "<unknown>" ;
+#ifdef __GLIBC__
+    const char *name = program_invocation_short_name ;
+#else
+    static char buf[PATH_MAX+1] ;
+    static const char *name = NULL ;
+    static pthread_once_t once = PTHREAD_ONCE_INIT ;
+    struct reader
     {
-      size_t x = fread(buf, 1, len, fp) ;
-      buf[x] = '\0' ;
-      word_done = strlen(buf) < len ;
-      name += buf ;
-    }
-
-    fclose(fp) ;
-
-    const char *p = name.c_str(), *q = strrchr(p, '/') ;
-
-    if(q==NULL) // no slash at all
-      return name ;
+      static void run()
+      {
+        int fd = open("/proc/self/cmdline", O_RDONLY|O_CLOEXEC) ;
+        if (fd < 0)
+          return ;
+        ssize_t len = read(fd, buf, PATH_MAX) ; // argv[0] is all we need
+        close(fd) ;
+        if (len <= 0)
+          return ;
+        buf[len] = '\0' ;
+        const char *slash = strrchr(buf, '/') ;
+        __atomic_store_n(&name, slash ? slash+1 : buf, __ATOMIC_RELEASE) ;
+      }
+    } ;
+    pthread_once(&once, reader::run) ;
+#endif
+    return name and *name ? name : anonymous ; // empty after a trailing slash
+  }
 
-    if(q[1]=='\0') // trailing slash, again paranoid
-      return anonymous ;
+  const char *object_t::str_process_name()
+  {
+    const string *name = __atomic_load_n(&process_name, __ATOMIC_ACQUIRE) ;
+    return name ? name->c_str() : default_process_name() ;
+  }
 
-    return q+1 ;
+  string object_t::get_process_name()
+  {
+    read_section_t section ;
+    return str_process_name() ;
   }
 
   void object_t::set_process_name(const string &new_name)
   {
-    process_name = new_name ;
-    for(set<dispatcher_t*>::iterator it=dispatchers.begin(); it!=dispatchers.end(); ++it)
-      (*it)->set_process_name(process_name) ;
+    config_lock_t lock ;
+    const string *old_name = process_name ;
+    __atomic_store_n(&process_name, new string(new_name), __ATOMIC_RELEASE) ;
+    synchronize_readers() ;
+    delete old_name ;
   }
 
 #if 0
@@ -137,19 +188,25 @@ namespace qmlog
 
   dispatcher_t::dispatcher_t()
   {
+    config_lock_t lock ;
     object.register_dispatcher(this) ;
-    name = object.get_process_name() ;
-    last_pid = (pid_t) 0 ;
+    name = NULL ;
+    active_logs = new vector<abstract_log_t*> ;
     current_level = qmlog::Full ;
     proxy = NULL ;
+    queue = NULL ;
+    dropped_before = 0 ;
   }
 
   dispatcher_t::~dispatcher_t()
   {
+    set_sync() ; // writes everything still queued
+    config_lock_t lock ;
     object.unregister_dispatcher(this) ;
     set<dispatcher_t*> slaves_copy = slaves ;
     for(set<dispatcher_t*>::const_iterator it=slaves_copy.begin(); it!=slaves_copy.end(); ++it)
       (*it)->set_proxy(proxy) ;
+    set_proxy(NULL) ;
     set<abstract_log_t*> logs_copy = logs ;
     for(set<abstract_log_t*>::const_iterator it=logs_copy.begin(); it!=logs_copy.end(); ++it)
     {
@@ -158,11 +215,18 @@ namespace qmlog
       if (l->d_counter()==0)
         delete *it ;
     }
+    synchronize_readers() ; // nobody is forwarding messages through us now
+    delete active_logs ;
+    delete name ;
   }
 
   void dispatcher_t::set_process_name(const string &new_name)
   {
-    name = new_name ;
+    config_lock_t lock ;
+    const string *old_name = name ;
+    __atomic_store_n(&name, new string(new_name), __ATOMIC_RELEASE) ;
+    synchronize_readers() ;
+    delete old_name ;
   }
 
   int dispatcher_t::log_level(int new_level)
@@ -177,25 +241,144 @@ namespace qmlog
 
   void dispatcher_t::attach(abstract_log_t *l)
   {
+    config_lock_t lock ;
     logs.insert(l) ;
     l->dispatchers.insert(this) ;
+    publish_logs() ;
   }
 
   void dispatcher_t::detach(abstract_log_t *l)
   {
+    config_lock_t lock ;
     logs.erase(l) ;
     l->dispatchers.erase(this) ;
+    publish_logs() ;
+    flush() ; // the queue may still refer to the log
+  }
+
+  void dispatcher_t::publish_logs()
+  {
+    const vector<abstract_log_t*> *old_logs = active_logs ;
+    __atomic_store_n(&active_logs, new vector<abstract_log_t*>(logs.begin(), logs.end()), __ATOMIC_RELEASE) ;
+    synchronize_readers() ;
+    delete old_logs ;
+  }
+
+  void dispatcher_t::set_async(unsigned capacity, int overflow_policy, bool defer_formatting)
+  {
+    config_lock_t lock ;
+    set_sync() ;
+    __atomic_store_n(&queue, new async_queue_t(capacity, overflow_policy, defer_formatting), __ATOMIC_RELEASE) ;
+  }
+
+  void dispatcher_t::set_sync()
+  {
+    config_lock_t lock ;
+    if (queue)
+    {
+      async_queue_t *q = queue ;
+      __atomic_store_n(&queue, (async_queue_t*)NULL, __ATOMIC_RELEASE) ;
+      synchronize_readers() ; // nobody is pushing to the old queue any more
+      dropped_before += q->dropped() ;
+      delete q ;
+    }
+  }
+
+  bool dispatcher_t::is_async()
+  {
+    return __atomic_load_n(&queue, __ATOMIC_ACQUIRE) != NULL ;
+  }
+
+  void dispatcher_t::flush()
+  {
+    read_section_t section ;
+    if (async_queue_t *q = __atomic_load_n(&queue, __ATOMIC_ACQUIRE))
+      q->flush() ;
+    const vector<abstract_log_t*> *list = __atomic_load_n(&active_logs, __ATOMIC_ACQUIRE) ;
+    for(vector<abstract_log_t*>::const_iterator it=list->begin(); it!=list->end(); ++it)
+      (*it)->flush_locked() ;
+  }
+
+  unsigned long dispatcher_t::dropped()
+  {
+    config_lock_t lock ;
+    return dropped_before + (queue ? queue->dropped() : 0) ;
+  }
+
+  void dispatcher_t::deliver(abstract_log_t *l, int level, const char *message)
+  {
+    async_queue_t *q = __atomic_load_n(&queue, __ATOMIC_ACQUIRE) ;
+    if (q and not q->is_writer())
+      q->push(this, l, level, message) ;
+    else
+      l->submit_locked(this, level, message) ;
+  }
+
+  void dispatcher_t::deliver(abstract_log_t *l, const record_t &r, const char *arguments, unsigned size)
+  {
+    async_queue_t *q = __atomic_load_n(&queue, __ATOMIC_ACQUIRE) ;
+    if (q and not q->is_writer())
+      q->push(this, l, r, arguments, size) ;
+    else
+      l->submit_record_locked(this, r, arguments, size) ;
+  }
+
+  static void compose(abstract_log_t *l, dispatcher_t *d, const site_t *site, const char *fmt, ...)
+  {
+    va_list args ;
+    va_start(args, fmt) ;
+    l->compose_message(d, site, fmt, args) ;
+    va_end(args) ;
+  }
+
+  void dispatcher_t::replay(const record_t &r, const char *arguments, unsigned size)
+  {
+    read_section_t section ;
+    thread_state_t *state = thread_state() ;
+    state->new_message() ;
+    state->set_timestamp(r.monotonic_timestamp, r.timestamp) ;
+
+    record_buffer &text = state->text ;
+    bool formatted = false ;
+    const char *fmt = r.fmt==NULL or *r.fmt ? "%s" : "" ;
+    site_t here = { r.level, r.line, r.file, r.func, 0, NULL, false } ; // decoded records have no site
+    const site_t *site = r.site ? r.site : &here ;
+
+    const vector<abstract_log_t*> *list = __atomic_load_n(&active_logs, __ATOMIC_ACQUIRE) ;
+    dispatch_t dispatch(state) ;
+    for(vector<abstract_log_t*>::const_iterator it=list->begin(); it!=list->end(); ++it)
+    {
+      abstract_log_t *l = *it ;
+      if (r.level>l->log_level())
+        continue ;
+      if (l->takes_records)
+      {
+        l->submit_record_locked(this, r, arguments, size) ;
+        continue ;
+      }
+      if (not formatted)
+      {
+        text.rewind() ;
+        if (r.fmt)
+          format_arguments(text, r.fmt, arguments, size) ;
+        else
+          text.append(arguments, size) ;
+        formatted = true ;
+      }
+      compose(l, this, site, fmt, text.c_str()) ;
+    }
   }
 
   void dispatcher_t::set_proxy(dispatcher_t *pd)
   {
+    config_lock_t lock ;
     if (pd==proxy)
       return ;
     if (proxy) // unregister at current proxy
       proxy->slaves.erase(this) ;
     if (pd) // register at the new one
       pd->slaves.insert(this) ;
-    proxy = pd ;
+    __atomic_store_n(&proxy, pd, __ATOMIC_RELEASE) ;
   }
 
 #if 0
@@ -248,6 +431,69 @@ namespace qmlog
     }
   }
 
+  void dispatcher_t::message(site_t *site)
+  {
+    const char *empty_format = "" ;
+    if (site->level<=current_level)
+      message(site, empty_format) ;
+  }
+
+  void dispatcher_t::message(site_t *site, const char *fmt, ...)
+  {
+    if (site->level<=current_level)
+    {
+      if (not registered(site))
+        register_site(site) ;
+      if (not site_on(site)) // the rules are applied by the registration
+        return ;
+      va_list arg ;
+      va_start(arg, fmt) ;
+      generic(site, fmt, arg) ;
+      va_end(arg) ;
+    }
+  }
+
+  void dispatcher_t::message(int level, const kv_list_t &kv)
+  {
+    const char *empty_format = "" ;
+    if (level<=current_level)
+      message(level, kv, empty_format) ;
+  }
+
+  void dispatcher_t::message(int level, const kv_list_t &kv, const char *fmt, ...)
+  {
+    if (level<=current_level)
+    {
+      site_t here = { level, -1, NULL, NULL, 0, NULL, false } ;
+      va_list arg ;
+      va_start(arg, fmt) ;
+      generic(&here, &kv, fmt, arg) ;
+      va_end(arg) ;
+    }
+  }
+
+  void dispatcher_t::message(site_t *site, const kv_list_t &kv)
+  {
+    const char *empty_format = "" ;
+    if (site->level<=current_level)
+      message(site, kv, empty_format) ;
+  }
+
+  void dispatcher_t::message(site_t *site, const kv_list_t &kv, const char *fmt, ...)
+  {
+    if (site->level<=current_level)
+    {
+      if (not registered(site))
+        register_site(site) ;
+      if (not site_on(site))
+        return ;
+      va_list arg ;
+      va_start(arg, fmt) ;
+      generic(site, &kv, fmt, arg) ;
+      va_end(arg) ;
+    }
+  }
+
   void dispatcher_t::message_failed_assertion(bool abortion, const char *assertion, int line, const char *file, const char *func)
   {
     const char *empty_format = "" ;
@@ -273,7 +519,8 @@ namespace qmlog
 
   void dispatcher_t::message_abortion(bool abortion, int line, const char *file, const char *func)
   {
-    message_abortion(abortion, line, file, func) ;
+    const char *empty_format = "" ;
+    message_abortion(abortion, line, file, func, empty_format) ;
   }
 
   void dispatcher_t::message_abortion(bool abortion, int line, const char *file, const char *func, const char *fmt, ...)
@@ -298,214 +545,164 @@ namespace qmlog
       message(QMLOG_INTERNAL, "the program will terminate due to internal error above") ;
     else
       message(QMLOG_INTERNAL, "the program execution will be continued as abortion was disabled at compile time") ;
+    (proxy ? proxy : this) -> flush() ;
+    log_flight_recorder::dump_all() ;
   }
 
-  void dispatcher_t::generic(int level, int line, const char *file, const char *func, const char *fmt, va_list arg)
+  // the timestamp goes to 'r', the arguments to the capture buffer of the thread;
+  // a record has no room for key/value pairs: they are appended to the text
+  static void capture(thread_state_t *state, record_t &r, const site_t *site, const kv_list_t *kv, const char *fmt, va_list arg)
   {
-    if (proxy)
+    state->get_timestamp() ;
+    r.level = site->level, r.line = site->line, r.file = site->file, r.func = site->func, r.fmt = fmt ;
+    r.site = site->id ? site : NULL ;
+    r.monotonic_timestamp = state->monotonic_timestamp ;
+    r.timestamp = state->timestamp ;
+    state->capture.rewind() ;
+    if (kv or not capture_arguments(state->capture, fmt, arg))
     {
-      proxy  -> generic(level, line, file, func, fmt, arg) ;
-      return ;
+      r.fmt = NULL ;
+      state->capture.vprintf(fmt, arg) ;
+      if (kv and kv->size())
+      {
+        if (*fmt)
+          append(state->capture, " ") ;
+        append_logfmt_pairs(state->capture, *kv) ;
+      }
     }
+  }
 
-    got_timestamp = got_localtime =
-      has_monotonic = has_monotonic_nano = has_monotonic_micro = has_monotonic_milli =
-      has_gmt_offset = has_tz_symlink =
-      has_date = has_time = has_time_micro = has_time_milli = false ;
+  void dispatcher_t::generic(int level, int line, const char *file, const char *func, const char *fmt, va_list arg)
+  {
+    site_t here = { level, line, file, func, 0, NULL, false } ;
+    generic(&here, fmt, arg) ;
+  }
 
-    for(set<abstract_log_t*>::iterator it=logs.begin(); it!=logs.end(); ++it)
-      if (level<=(*it)->log_level())
-        (*it)->compose_message(this, level, line, file, func, fmt, arg) ;
+  void dispatcher_t::generic(const site_t *site, const char *fmt, va_list arg)
+  {
+    generic(site, NULL, fmt, arg) ;
   }
 
-  void dispatcher_t::get_timestamp()
+  void dispatcher_t::generic(const site_t *site, const kv_list_t *kv, const char *fmt, va_list arg)
   {
-    if (not got_timestamp)
+    control_watcher_t::start_in_child() ; // outside of the section: applies the file
+    read_section_t section ;
+
+    if (dispatcher_t *p = __atomic_load_n(&proxy, __ATOMIC_ACQUIRE))
     {
-      // Not checking, if call is successful: nothing can be done even if not
-      clock_gettime(CLOCK_MONOTONIC, &monotonic_timestamp) ;
-      gettimeofday(&timestamp, NULL) ;
-      got_timestamp = true ;
+      p -> generic(site, kv, fmt, arg) ;
+      return ;
     }
-  }
 
-  void dispatcher_t::get_localtime()
-  {
-    if (not got_localtime)
+    int level = site->level ;
+
+    thread_state_t *state = thread_state() ;
+    state->new_message() ;
+
+    const vector<abstract_log_t*> *list = __atomic_load_n(&active_logs, __ATOMIC_ACQUIRE) ;
+
+    async_queue_t *q = __atomic_load_n(&queue, __ATOMIC_ACQUIRE) ;
+    if (q and q->deferred() and not q->is_writer())
     {
-      get_timestamp() ;
-      tzset() ;
-      if (not localtime_r(&timestamp.tv_sec, &localtime))
+      bool wanted = false ;
+      for(vector<abstract_log_t*>::const_iterator it=list->begin(); it!=list->end() and not wanted; ++it)
+        wanted = level<=(*it)->log_level() ;
+      if (not wanted)
+        return ;
+
+      // only copy the arguments, the writer thread will do the rest
+      record_t r ;
+      capture(state, r, site, kv, fmt, arg) ;
+      q->push(this, r, state->capture.c_str(), state->capture.position()) ;
+      return ;
+    }
+
+    record_t r ;
+    bool captured = false ;
+    dispatch_t dispatch(state, kv) ; // logs with the same fields get the same text
+    for(vector<abstract_log_t*>::const_iterator it=list->begin(); it!=list->end(); ++it)
+    {
+      abstract_log_t *l = *it ;
+      if (level>l->log_level())
+        continue ;
+      if (not l->takes_records)
       {
-        // theoretically localtime_r() may fail on a 64 bit architecture
-        // due to year value overflow, let's fill the structure with zeroes
-        // then...
-        memset(&localtime, 0, sizeof(struct tm)) ;
+        l->compose_message(this, site, fmt, arg) ;
+        continue ;
       }
-      got_localtime = true ;
+      if (not captured) // once for all the logs taking records
+      {
+        capture(state, r, site, kv, fmt, arg) ;
+        captured = true ;
+      }
+      deliver(l, r, state->capture.c_str(), state->capture.position()) ;
     }
   }
 
   const char *dispatcher_t::str_monotonic()
   {
-    if (not has_monotonic)
-    {
-      get_timestamp() ;
-      s_mono.rewind(0) ;
-      s_mono.printf("%lld", (long long)monotonic_timestamp.tv_sec) ;
-      has_monotonic = true ;
-    }
-    return s_mono.c_str() ;
+    return thread_state()->str_monotonic() ;
   }
 
   const char *dispatcher_t::str_monotonic_nano()
   {
-    if (not has_monotonic_nano)
-    {
-      get_timestamp() ;
-      s_mono_nano.rewind(0) ;
-      s_mono_nano.printf("%09ld", monotonic_timestamp.tv_nsec) ;
-      has_monotonic_nano = true ;
-    }
-    return s_mono_nano.c_str() ;
+    return thread_state()->str_monotonic_nano() ;
   }
 
   const char *dispatcher_t::str_monotonic_micro()
   {
-    if (not has_monotonic_micro)
-    {
-      get_timestamp() ;
-      s_mono_micro.rewind(0) ;
-      s_mono_micro.printf("%06ld", monotonic_timestamp.tv_nsec / 1000) ;
-      has_monotonic_micro = true ;
-    }
-    return s_mono_micro.c_str() ;
+    return thread_state()->str_monotonic_micro() ;
   }
 
   const char *dispatcher_t::str_monotonic_milli()
   {
-    if (not has_monotonic_milli)
-    {
-      get_timestamp() ;
-      s_mono_milli.rewind(0) ;
-      s_mono_milli.printf("%03ld", monotonic_timestamp.tv_nsec / (1000*1000)) ;
-      has_monotonic_milli = true ;
-    }
-    return s_mono_milli.c_str() ;
+    return thread_state()->str_monotonic_milli() ;
   }
 
   const char *dispatcher_t::str_time()
   {
-    if (not has_time)
-    {
-      get_localtime() ;
-      s_time.rewind() ;
-      s_time.printf("%02d:%02d:%02d", localtime.tm_hour, localtime.tm_min, localtime.tm_sec) ;
-      has_time = true ;
-    }
-    return s_time.c_str() ;
+    return thread_state()->str_time() ;
   }
 
   const char *dispatcher_t::str_time_micro()
   {
-    if (not has_time_micro)
-    {
-      get_timestamp() ;
-      s_time_micro.rewind() ;
-      s_time_micro.printf("%06d", (int)timestamp.tv_usec) ;
-      has_time_micro = true ;
-    }
-    return s_time_micro.c_str() ;
+    return thread_state()->str_time_micro() ;
   }
 
   const char *dispatcher_t::str_time_milli()
   {
-    if (not has_time_milli)
-    {
-      get_timestamp() ;
-      s_time_milli.rewind() ;
-      s_time_milli.printf("%03d", (int)timestamp.tv_usec / 1000) ;
-      has_time_milli = true ;
-    }
-    return s_time_milli.c_str() ;
+    return thread_state()->str_time_milli() ;
   }
 
   const char *dispatcher_t::str_gmt_offset()
   {
-    if (not has_gmt_offset)
-    {
-      get_localtime() ;
-      s_gmt_offset.rewind() ;
-      int sec = localtime.tm_gmtoff ;
-      char sign = sec<0 ? (sec = -sec, '-') : '+' ;
-      int min = sec/60, hour = min/60 ;
-      sec %= 60, min %=60 ;
-      // s_gmt_offset.printf("GMT") ;
-      if (sec)
-        s_gmt_offset.printf("%c" "%d:%02d:%02d", sign, hour, min, sec) ;
-      else if(min)
-        s_gmt_offset.printf("%c" "%d:%02d", sign, hour, min) ;
-      else
-        s_gmt_offset.printf("%c" "%d", sign, hour) ;
-      has_gmt_offset = true ;
-    }
-    return s_gmt_offset.c_str() ;
+    return thread_state()->str_gmt_offset() ;
   }
 
   const char *dispatcher_t::str_tz_symlink()
   {
-    if (not has_tz_symlink)
-    {
-      s_tz_symlink.rewind() ;
-      if (s_tz_symlink.readlink("/etc/localtime")<0)
-      {
-        s_tz_symlink.printf("%m") ;
-        tz_symlink_offset = 0 ;
-      }
-      else
-      {
-        static const char base[] = "/usr/share/zoneinfo/" ;
-        static const int base_len = sizeof(base) - 1 ;
-        tz_symlink_offset = strncmp(s_tz_symlink.c_str(), base, base_len) ? 0 : base_len ;
-      }
-      has_tz_symlink = true ;
-    }
-    return s_tz_symlink.c_str() + tz_symlink_offset ;
+    return thread_state()->str_tz_symlink() ;
   }
 
   const char *dispatcher_t::str_date()
   {
-    if (not has_date)
-    {
-      get_localtime() ;
-      s_date.rewind() ;
-      s_date.printf("%d-%02d-%02d", localtime.tm_year+1900, localtime.tm_mon+1, localtime.tm_mday) ;
-      has_date = true ;
-    }
-    return s_date.c_str() ;
+    return thread_state()->str_date() ;
   }
 
   const char *dispatcher_t::str_tz_abbreviation()
   {
-    get_localtime() ;
-    return localtime.tm_zone ;
+    return thread_state()->str_tz_abbreviation() ;
   }
 
   const char *dispatcher_t::str_name()
   {
-    return name.c_str() ;
+    const string *own = __atomic_load_n(&name, __ATOMIC_ACQUIRE) ;
+    return own ? own->c_str() : object.str_process_name() ;
   }
 
   const char *dispatcher_t::str_pid()
   {
-    pid_t pid = getpid() ;
-    if (last_pid != pid)
-    {
-      s_pid.rewind() ;
-      s_pid.printf("%d", pid) ;
-      last_pid = pid ;
-    }
-    return s_pid.c_str() ;
+    return thread_state()->str_pid() ;
   }
 
   const char *dispatcher_t::str_level(int level)
@@ -521,15 +718,42 @@ namespace qmlog
 
   abstract_log_t::abstract_log_t(int maximal_log_level, dispatcher_t *d)
   {
+    init(maximal_log_level) ;
+    attach_to(d) ;
+  }
+
+  abstract_log_t::abstract_log_t(int maximal_log_level)
+  {
+    init(maximal_log_level) ;
+  }
+
+  void abstract_log_t::init(int maximal_log_level)
+  {
+    init_mutex() ;
     level = max_level = maximal_log_level ;
-    dispatcher_t *dd = d ?: object.get_default_dispatcher() ;
-    dd->attach(this) ;
+    takes_records = false ;
+    layout = NULL ;
     fields = 0 ;
     enable_fields(All_Fields) ;
     disable_fields(Time_Micro ^ Time) ;
     disable_fields(Monotonic_Nano ^ Monotonic) ;
   }
 
+  void abstract_log_t::init_mutex()
+  {
+    pthread_mutexattr_t attr ;
+    pthread_mutexattr_init(&attr) ;
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE) ; // a log may log itself
+    pthread_mutex_init(&mutex, &attr) ;
+    pthread_mutexattr_destroy(&attr) ;
+  }
+
+  void abstract_log_t::attach_to(dispatcher_t *d)
+  {
+    dispatcher_t *dd = d ?: object.get_default_dispatcher() ;
+    dd->attach(this) ;
+  }
+
   int abstract_log_t::log_level(int new_level)
   {
     if (new_level<=max_level)
@@ -572,218 +796,638 @@ namespace qmlog
     return fields &= ~mask ;
   }
 
+  const char *abstract_log_t::get_path()
+  {
+    return NULL ;
+  }
+
   abstract_log_t::~abstract_log_t()
   {
+    detach_all() ;
+    pthread_mutex_destroy(&mutex) ;
+  }
+
+  void abstract_log_t::detach_all()
+  {
+    config_lock_t lock ;
     set<dispatcher_t*> d_copy = dispatchers ;
     for(set<dispatcher_t*>::iterator it=d_copy.begin(); it!=d_copy.end(); ++it)
       (*it)->detach(this) ;
+    flush_timer_t::cancel(this) ;
+  }
+
+  void abstract_log_t::submit_locked(dispatcher_t *d, int level, const char *message)
+  {
+    pthread_mutex_lock(&mutex) ;
+    submit_message(d, level, message) ;
+    pthread_mutex_unlock(&mutex) ;
+  }
+
+  void abstract_log_t::deliver(dispatcher_t *d, int level, const char *message)
+  {
+    d->deliver(this, level, message) ;
+  }
+
+  void abstract_log_t::submit_record_locked(dispatcher_t *d, const record_t &r, const char *arguments, unsigned size)
+  {
+    pthread_mutex_lock(&mutex) ;
+    submit_record(d, r, arguments, size) ;
+    pthread_mutex_unlock(&mutex) ;
+  }
+
+  void abstract_log_t::submit_record(dispatcher_t *, const record_t &, const char *, unsigned)
+  {
+    // only called for logs setting 'takes_records'
+  }
+
+  void abstract_log_t::flush_locked()
+  {
+    pthread_mutex_lock(&mutex) ;
+    flush_buffer() ;
+    pthread_mutex_unlock(&mutex) ;
+  }
+
+  void abstract_log_t::flush_buffer()
+  {
+    // nothing is kept back by default
   }
 
-  void abstract_log_t::compose_message(dispatcher_t *dispatcher, int level, int line, const char *file, const char *func, const char *fmt, va_list args)
+  void abstract_log_t::before_fork()
   {
-    smart_buffer<1024> buf ;
-    const char *separator = "" ;
-    if (fields & Time_Info_Block)
+    pthread_mutex_lock(&mutex) ;
+  }
+
+  void abstract_log_t::after_fork_in_parent()
+  {
+    pthread_mutex_unlock(&mutex) ;
+  }
+
+  void abstract_log_t::after_fork_in_child()
+  {
+    init_mutex() ; // locked by a thread of the parent
+  }
+
+  void abstract_log_t::compose_message(dispatcher_t *dispatcher, const site_t *site, const char *fmt, va_list args)
+  {
+    int level = site->level, line = site->line ;
+    const char *file = site->file, *func = site->func ;
+    const layout_t *current = __atomic_load_n(&layout, __ATOMIC_ACQUIRE) ;
+    if (current==NULL or current->fields != (fields & All_Fields))
+      __atomic_store_n(&layout, current = layout_t::get(fields), __ATOMIC_RELEASE) ;
+    int mask = current->fields ; // 'fields' may be changed meanwhile
+
+    thread_state_t *state = thread_state() ;
+    thread_state_t::composed_t *cache = NULL ;
+    if (state->dispatch_serial and not state->composing)
     {
-      const char *ti_separator = "" ;
-      buf.printf("[") ;
-      if (int mono = fields & qmlog::Monotonic_Mask)
+      for (int i=0; i<thread_state_t::composed_slots; ++i)
       {
-        buf.printf("%s", dispatcher->str_monotonic()) ;
-        if (mono & qmlog::Monotonic_Milli)
+        thread_state_t::composed_t &c = state->composed[i] ;
+        if (c.serial!=state->dispatch_serial)
         {
-          if (mono == qmlog::Monotonic_Nano)
-            buf.printf(".%s", dispatcher->str_monotonic_nano()) ;
-          else if (mono == qmlog::Monotonic_Micro)
-            buf.printf(".%s", dispatcher->str_monotonic_micro()) ;
-          else if (mono == qmlog::Monotonic_Milli)
-            buf.printf(".%s", dispatcher->str_monotonic_milli()) ;
+          if (cache==NULL)
+            cache = &c ;
+          continue ;
         }
-        ti_separator = " " ;
-      }
-      if (int tz = fields & qmlog::Timezone_Tm_Block)
-      {
-        buf.printf("%s(", ti_separator) ;
-        const char *tz_separator = "" ;
-        if (tz & qmlog::Timezone_Abbreviation)
-        {
-          buf.printf("%s", dispatcher->str_tz_abbreviation()) ;
-          tz_separator = "," ;
-        }
-        if (tz & qmlog::Timezone_Offset)
-          buf.printf("%s" "GMT" "%s", tz_separator, dispatcher->str_gmt_offset()) ;
-        buf.printf(")") ;
-        ti_separator = " " ;
-      }
-      if (fields & qmlog::Date)
-      {
-        buf.printf("%s%s", ti_separator, dispatcher->str_date()) ;
-        ti_separator = " " ;
-      }
-      if (int time = fields & qmlog::Time_Mask)
-      {
-        buf.printf("%s%s", ti_separator, dispatcher->str_time()) ;
-        if (time & qmlog::Time_Milli)
+        if (c.layout!=current)
+          continue ;
+        // another log of this dispatch has the same fields
+        const char *text = c.text.c_str() ;
+        if (c.wrapped)
         {
-          if (time == qmlog::Time_Micro)
-            buf.printf(".%s", dispatcher->str_time_micro()) ;
-          else if (time == qmlog::Time_Milli)
-            buf.printf(".%s", dispatcher->str_time_milli()) ;
+          dispatcher->deliver(this, level, text) ;
+          text += c.first_length + 1 ;
         }
-        ti_separator = " " ;
+        dispatcher->deliver(this, level, text) ;
+        return ;
       }
-      if (fields & qmlog::Timezone_Symlink)
-        buf.printf("%s'%s'", ti_separator, dispatcher->str_tz_symlink()) ;
-      buf.printf("]") ;
-      separator = " " ;
     }
-    if (fields & Process_Block) // [program:123] | [program] | [123]
+
+    smart_buffer<1024> nested ; // only used if a log is logging from submit_message()
+    bool was_composing = state->composing ;
+    record_buffer &buf = cache ? cache->text : was_composing ? nested : state->line ;
+    state->composing = true ;
+    if (cache)
     {
-      const char *p_separator = "" ;
-      buf.printf("%s[", separator) ;
-      if (fields & Name)
-      {
-        buf.printf("%s", dispatcher->str_name()) ;
-        p_separator = "," ;
-      }
-      if (fields & Pid)
-        buf.printf("%s%s", p_separator, dispatcher->str_pid()) ;
-      buf.printf("]") ;
-      separator = " " ;
+      cache->serial = state->dispatch_serial ;
+      cache->layout = current ;
+      cache->wrapped = false ;
     }
-    int prefix = buf.position() ;
 
-    bool message = (*fmt!='\0') && (fields & qmlog::Message) ;
-    bool output_line = line>0 && (fields & qmlog::Line) ;
-    bool output_func = func!=NULL && (fields & qmlog::Function) ;
+    buf.rewind() ;
+    current->append_prefix(buf, dispatcher, state) ;
+    const char *separator = current->separator ;
+    unsigned prefix = buf.position() ;
+
+    const kv_list_t *kv = state->kv and state->kv->size() ? state->kv : NULL ;
+    bool message = (*fmt!='\0' or kv) && (mask & qmlog::Message) ;
+    bool output_line = line>0 && (mask & qmlog::Line) ;
+    bool output_func = func!=NULL && (mask & qmlog::Function) ;
     bool location = output_line or output_func ;
-    bool wrap = output_func and message and (fields & qmlog::Multiline) ;
+    bool wrap = output_func and message and (mask & qmlog::Multiline) ;
 
-    if (fields & qmlog::Level)
+    if (mask & qmlog::Level)
     {
-      buf.printf("%s%s", separator, dispatcher_t::str_level(level)) ;
+      append(buf, separator) ;
+      append(buf, dispatcher_t::str_level(level)) ;
       if (not message and not location)
-        buf.printf(".") ;
+        append(buf, ".") ;
       else if (not message or not location)
-        buf.printf(":") ;
+        append(buf, ":") ;
       separator = " " ;
     }
 
     if (output_line)
     {
-      buf.printf("%s" "at %s:%d", separator, file, line) ;
+      append(buf, separator) ;
+      if (site->location) // rendered at the registration
+        append(buf, site->location) ;
+      else
+      {
+        append(buf, "at ") ;
+        append(buf, file) ;
+        append(buf, ":") ;
+        append_number(buf, line) ;
+      }
       separator = " " ;
     }
 
     if (output_func)
     {
-      buf.printf("%s" "in %s", separator, func) ;
+      append(buf, separator) ;
+      append(buf, "in ") ;
+      append(buf, func) ;
       separator = " " ;
     }
 
     if (message and location)
-      buf.printf(":") ;
+      append(buf, ":") ;
 
+    unsigned start = 0 ;
     if (wrap)
     {
-      submit_message(dispatcher, level, buf.c_str()) ;
-      buf.rewind(prefix) ;
+      dispatcher->deliver(this, level, buf.c_str()) ;
+      if (cache) // the first line is kept for the other logs
+      {
+        smart_buffer<256> copy ; // appending from 'buf' itself would break, if it grows
+        copy.append(buf.c_str(), prefix) ;
+        cache->wrapped = true ;
+        cache->first_length = buf.position() ;
+        buf.append("", 1) ;
+        start = buf.position() ;
+        buf.append(copy.c_str(), prefix) ;
+      }
+      else
+        buf.rewind(prefix) ;
       separator = " -- " ;
     }
 
     if (message)
     {
-      buf.printf("%s", separator) ;
+      append(buf, separator) ;
       buf.vprintf(fmt, args) ;
+      if (kv)
+      {
+        if (*fmt)
+          append(buf, " ") ;
+        append_logfmt_pairs(buf, *kv) ;
+      }
     }
 
-    submit_message(dispatcher, level, buf.c_str()) ;
+    dispatcher->deliver(this, level, buf.c_str() + start) ;
+    state->composing = was_composing ;
+  }
+
+  static unsigned long reopen_requests = 0 ; // see log_file::reopen_all()
+
+  // continues after partial writes, gives up on errors: there is no one to tell
+  static void write_all(int fd, struct iovec *iov, int count)
+  {
+    while (count>0)
+    {
+      ssize_t written = writev(fd, iov, count) ;
+      if (written<0 and errno==EINTR)
+        continue ;
+      if (written<0)
+        return ;
+      for (; count>0 and (size_t)written>=iov->iov_len; ++iov, --count)
+        written -= iov->iov_len ;
+      if (count>0)
+      {
+        iov->iov_base = (char*)iov->iov_base + written ;
+        iov->iov_len -= written ;
+      }
+    }
+  }
+
+  void log_file::setup(FILE *given)
+  {
+    fp = given ;
+    fd = -1 ;
+    failed = by_fp and fp == NULL ; // don't try reopen non existing path, even if fp is NULL
+    flush_bytes = flush_milliseconds = 0 ;
+    flush_level = Error ;
+    rotation = NULL ;
+    reopen_wanted = false ;
+    reopen_seen = __atomic_load_n(&reopen_requests, __ATOMIC_RELAXED) ;
+    moved_checked = 0 ;
+    cache = NULL ;
+    cache_size = 64*1024 ;
+    cache_start = cache_length = 0 ;
+    cache_dropped = 0 ;
+    next_open.tv_sec = next_open.tv_nsec = 0 ;
+    open_delay = 0 ;
   }
 
   log_file::log_file(const char *path, int maximal_log_level, dispatcher_t *d)
-    : abstract_log_t(maximal_log_level, d), file_path(path), by_fp(false)
+    : abstract_log_t(maximal_log_level), file_path(path), by_fp(false)
   {
-    fp = NULL ;
-    failed = false ;
+    setup(NULL) ;
+    attach_to(d) ;
   }
 
   log_file::log_file(FILE *fp, int maximal_log_level, dispatcher_t *d)
-    : abstract_log_t(maximal_log_level, d), by_fp(true)
+    : abstract_log_t(maximal_log_level), by_fp(true)
+  {
+    setup(fp) ;
+    attach_to(d) ;
+  }
+
+  log_file::log_file(int maximal_log_level, const char *path)
+    : abstract_log_t(maximal_log_level), file_path(path), by_fp(false)
   {
-    this->fp = fp ;
-    failed = fp == NULL ; // don't try reopen non existing path, even if fp is NULL
+    setup(NULL) ;
+  }
+
+  log_file::log_file(int maximal_log_level, FILE *fp)
+    : abstract_log_t(maximal_log_level), by_fp(true)
+  {
+    setup(fp) ;
   }
 
   log_file::~log_file()
   {
-#if 0
-    if (to_be_closed)
-      fclose(fp) ;
-#endif
-    if (not cache.empty())
+    detach_all() ;
+    if (cache_length or cache_dropped)
+    {
+      next_open.tv_sec = 0 ; // the last chance
       open() ; // will write cache, if possible
+    }
     close() ;
+    delete rotation ;
+    delete[] cache ;
   }
 
   bool log_file::open()
   {
-    if (fp==NULL)
+    if (fd<0)
     {
       bool already_failed = failed and (by_fp or not (fields & Retry_If_Failed)) ;
       if (already_failed)
         return false ;
-      bool create_file = not (fields & Dont_Create_File) ;
-      int open_mode = 0666, open_flags = O_WRONLY | O_APPEND | ( create_file ? O_CREAT : 0) ;
-      int fd = ::open(file_path.c_str(), open_flags, open_mode) ;
+      if (by_fp)
+        fd = fileno(fp) ;
+      else
+      {
+        struct timespec now ;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now) ;
+        if (now.tv_sec < next_open.tv_sec or (now.tv_sec == next_open.tv_sec and now.tv_nsec < next_open.tv_nsec))
+          return false ;
+        bool create_file = not (fields & Dont_Create_File) ;
+        int open_mode = 0666, open_flags = O_WRONLY | O_APPEND | ( create_file ? O_CREAT : 0) ;
+        fd = ::open(file_path.c_str(), open_flags, open_mode) ;
+        if (fd<0)
+        {
+          open_delay = open_delay ? min(2*open_delay, 60*1000u) : 100 ;
+          long long ns = now.tv_nsec + open_delay % 1000 * 1000000LL ;
+          next_open.tv_sec = now.tv_sec + open_delay / 1000 + ns / 1000000000 ;
+          next_open.tv_nsec = ns % 1000000000 ;
+        }
+        else
+          open_delay = 0 ;
+      }
       if (fd<0)
         return false ;
-      fp = fdopen(fd, "a") ;
-    }
-    if (fp!=NULL)
+      struct stat st ;
+      bool known = fstat(fd, &st)==0 ;
+      to_pipe = known and S_ISFIFO(st.st_mode) ;
+      written = known ? st.st_size : 0 ;
+      moved_checked = started_at = time(NULL) ;
+      file_dev = known ? st.st_dev : 0 ;
+      file_ino = known ? st.st_ino : 0 ;
       flush_cache() ;
-    return fp!=NULL ;
+    }
+    return true ;
   }
 
   void log_file::close()
   {
-    if (fp!=NULL and not by_fp)
+    flush_buffer() ;
+    if (fd>=0 and not by_fp)
+    {
+      ::close(fd) ;
+      fd = -1 ;
+    }
+  }
+
+  // Each cached message is its length (uint32_t, without the '\n') and
+  // the line, both may wrap around the end of the ring: a message may
+  // have newlines of its own.
+  static void cache_put(char *cache, unsigned size, unsigned at, const void *from, unsigned length)
+  {
+    unsigned first = min(length, size - at) ;
+    memcpy(cache + at, from, first) ;
+    memcpy(cache, (const char *)from + first, length - first) ;
+  }
+
+  static void cache_get(const char *cache, unsigned size, unsigned at, void *to, unsigned length)
+  {
+    unsigned first = min(length, size - at) ;
+    memcpy(to, cache + at, first) ;
+    memcpy((char *)to + first, cache, length - first) ;
+  }
+
+  void log_file::cache_message(const char *message)
+  {
+    uint32_t length = strlen(message) ;
+    unsigned total = sizeof(length) + length + 1 ;
+    if (total > cache_size)
     {
-      fclose(fp) ;
-      fp = NULL ;
+      ++cache_dropped ;
+      return ;
     }
+    if (cache==NULL)
+      cache = new char[cache_size] ;
+    while (cache_length + total > cache_size)
+      drop_cached() ;
+    unsigned end = (cache_start + cache_length) % cache_size ;
+    cache_put(cache, cache_size, end, &length, sizeof(length)) ;
+    cache_put(cache, cache_size, (end + sizeof(length)) % cache_size, message, length) ;
+    cache[(end + total - 1) % cache_size] = '\n' ;
+    cache_length += total ;
+  }
+
+  // the oldest message
+  void log_file::drop_cached()
+  {
+    uint32_t length ;
+    cache_get(cache, cache_size, cache_start, &length, sizeof(length)) ;
+    unsigned total = sizeof(length) + length + 1 ;
+    cache_start = (cache_start + total) % cache_size ;
+    cache_length -= total ;
+    ++cache_dropped ;
   }
 
   void log_file::flush_cache()
   {
-    for (unsigned i=0; i<cache.size(); ++i)
-      write_message(cache[i].c_str()) ;
-    fflush(fp) ;
-    cache.resize(0) ;
+    if (cache_dropped)
+    {
+      char line[100] ;
+      snprintf(line, sizeof(line), "[qmlog] %lu messages dropped while the file could not be opened", cache_dropped) ;
+      write_pending(line) ;
+      cache_dropped = 0 ;
+    }
+    if (cache_length)
+    {
+      string lines ; // the lengths taken out
+      lines.reserve(cache_length) ;
+      for (unsigned at = cache_start, left = cache_length; left > 0; )
+      {
+        uint32_t length ;
+        cache_get(cache, cache_size, at, &length, sizeof(length)) ;
+        unsigned from = (at + sizeof(length)) % cache_size, first = min(length + 1, cache_size - from) ;
+        lines.append(cache + from, first) ;
+        lines.append(cache, length + 1 - first) ;
+        at = (at + sizeof(length) + length + 1) % cache_size ;
+        left -= sizeof(length) + length + 1 ;
+      }
+      struct iovec iov ;
+      iov.iov_base = &lines[0], iov.iov_len = lines.size() ;
+      write_all(fd, &iov, 1) ;
+      written += lines.size() ;
+    }
+    delete[] cache ;
+    cache = NULL ;
+    cache_start = cache_length = 0 ;
   }
 
-  void log_file::write_message(const char *message)
+  void log_file::set_cache_size(unsigned bytes)
   {
-    fprintf(fp, "%s\n", message) ;
+    pthread_mutex_lock(&mutex) ;
+    if (cache)
+    {
+      while (cache_length > bytes)
+        drop_cached() ;
+      char *fresh = new char[bytes] ;
+      unsigned first = min(cache_length, cache_size - cache_start) ;
+      memcpy(fresh, cache + cache_start, first) ;
+      memcpy(fresh + first, cache, cache_length - first) ;
+      delete[] cache ;
+      cache = fresh ;
+      cache_start = 0 ;
+    }
+    cache_size = bytes ;
+    pthread_mutex_unlock(&mutex) ;
   }
 
-  void log_file::submit_message(dispatcher_t *, int /* level */, const char *message)
+  // The pending messages and then 'message' (if not NULL) with a single
+  // writev(), without copying them. With O_APPEND a write to a regular
+  // file is not mixed with the writes of others, to a pipe only if it's
+  // not longer than PIPE_BUF: submit_message() takes care of that.
+  void log_file::write_pending(const char *message)
   {
+    if (by_fp)
+      fflush(fp) ; // what others printed to the stream goes first
+    struct iovec iov[3] ;
+    int count = 0 ;
+    if (not pending.empty())
+    {
+      iov[count].iov_base = const_cast<char*>(pending.data()) ;
+      iov[count++].iov_len = pending.size() ;
+    }
+    if (message)
+    {
+      iov[count].iov_base = const_cast<char*>(message) ;
+      iov[count++].iov_len = strlen(message) ;
+      iov[count].iov_base = const_cast<char*>("\n") ;
+      iov[count++].iov_len = 1 ;
+    }
+    write_all(fd, iov, count) ;
+    for (int i=0; i<count; ++i)
+      written += iov[i].iov_len ;
+    pending.clear() ; // the capacity stays for the next ones
+  }
+
+  void log_file::submit_message(dispatcher_t *, int level, const char *message)
+  {
+    if (fd>=0 and not by_fp and moved())
+      close() ;
     bool opened = open() ;
 
     if (not opened)
     {
       if (fields & Cache_If_Cant_Open)
-        cache.push_back(message) ;
+        cache_message(message) ;
       return ;
     }
 
-    write_message(message) ;
-    fflush(fp) ;
+    if (flush_bytes==0 or (fields & Close_After_Write))
+      write_pending(message) ;
+    else
+    {
+      unsigned length = strlen(message) + 1 ;
+      if (to_pipe and pending.size() + length > PIPE_BUF)
+        write_pending(NULL) ; // only whole messages within PIPE_BUF
+      bool full = pending.size() + length >= flush_bytes or level <= flush_level ;
+      if (flush_milliseconds)
+      {
+        struct timespec now ;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now) ;
+        if (pending.empty())
+          pending_since = now ;
+        long long age = (now.tv_sec - pending_since.tv_sec) * 1000LL + (now.tv_nsec - pending_since.tv_nsec) / 1000000 ;
+        full = full or age >= flush_milliseconds ;
+      }
+      if (full)
+        write_pending(message) ;
+      else
+      {
+        if (pending.empty() and flush_milliseconds)
+          flush_timer_t::arm(this, flush_timer_t::deadline(pending_since, flush_milliseconds)) ;
+        pending.append(message, length-1) ;
+        pending += '\n' ;
+      }
+    }
+
+    if (rotation and rotation->due(written, started_at))
+      rotate() ;
 
     if (fields & Close_After_Write)
       close() ;
   }
 
+  void log_file::rotate()
+  {
+    flush_buffer() ;
+    int fresh = rotation->rotate() ;
+    ::close(fd) ;
+    fd = -1 ;
+    if (fresh<0)
+      open() ;
+    else
+    {
+      fd = fresh ;
+      written = 0 ;
+      started_at = time(NULL) ;
+      struct stat st ;
+      if (fstat(fd, &st)==0)
+        file_dev = st.st_dev, file_ino = st.st_ino ;
+    }
+  }
+
+  void log_file::reopen()
+  {
+    __atomic_store_n(&reopen_wanted, true, __ATOMIC_RELAXED) ;
+  }
+
+  void log_file::reopen_all()
+  {
+    __atomic_add_fetch(&reopen_requests, 1, __ATOMIC_RELAXED) ;
+  }
+
+  static void reopen_handler(int)
+  {
+    log_file::reopen_all() ;
+  }
+
+  void log_file::reopen_on_signal(int signal)
+  {
+    struct sigaction sa ;
+    memset(&sa, 0, sizeof(sa)) ;
+    sa.sa_handler = reopen_handler ;
+    sa.sa_flags = SA_RESTART ;
+    sigemptyset(&sa.sa_mask) ;
+    sigaction(signal, &sa, NULL) ;
+  }
+
+  // whether the file is to be opened again
+  bool log_file::moved()
+  {
+    bool wanted = __atomic_exchange_n(&reopen_wanted, false, __ATOMIC_RELAXED) ;
+    unsigned long requests = __atomic_load_n(&reopen_requests, __ATOMIC_RELAXED) ;
+    if (requests != reopen_seen)
+      reopen_seen = requests, wanted = true ;
+    if (wanted or not (fields & Reopen_If_Moved))
+      return wanted ;
+    time_t now = time(NULL) ;
+    if (now == moved_checked)
+      return false ;
+    moved_checked = now ;
+    struct stat st ;
+    return stat(file_path.c_str(), &st)<0 or st.st_dev!=file_dev or st.st_ino!=file_ino ;
+  }
+
+  void log_file::set_rotation(unsigned long max_bytes, unsigned max_seconds, unsigned generations, bool compress)
+  {
+    if (by_fp)
+      return ;
+    rotation_t *fresh = new rotation_t(file_path, max_bytes, max_seconds, generations, compress) ;
+    pthread_mutex_lock(&mutex) ;
+    rotation_t *old = rotation ;
+    rotation = fresh ;
+    started_at = time(NULL) ;
+    pthread_mutex_unlock(&mutex) ;
+    delete old ; // waits for its compression
+  }
+
+  const char *log_file::get_path()
+  {
+    return by_fp ? NULL : file_path.c_str() ;
+  }
+
+  void log_file::set_flush_policy(unsigned bytes, unsigned milliseconds, int level)
+  {
+    pthread_mutex_lock(&mutex) ;
+    flush_bytes = bytes ;
+    flush_milliseconds = milliseconds ;
+    flush_level = level ;
+    flush_buffer() ;
+    pthread_mutex_unlock(&mutex) ;
+  }
+
+  void log_file::flush_buffer()
+  {
+    if (fd>=0 and not pending.empty())
+      write_pending(NULL) ;
+  }
+
+  void log_file::before_fork()
+  {
+    abstract_log_t::before_fork() ;
+    if (rotation)
+      rotation->before_fork() ;
+  }
+
+  void log_file::after_fork_in_parent()
+  {
+    if (rotation)
+      rotation->after_fork_in_parent() ;
+    abstract_log_t::after_fork_in_parent() ;
+  }
+
+  // The parent writes what it kept back: the flush policy and the cache
+  void log_file::after_fork_in_child()
+  {
+    if (rotation)
+      rotation->after_fork_in_child() ;
+    pending.clear() ;
+    delete[] cache ;
+    cache = NULL ;
+    cache_start = cache_length = 0 ;
+    cache_dropped = 0 ;
+    abstract_log_t::after_fork_in_child() ;
+  }
+
   log_stderr::log_stderr(int maximal_log_level, dispatcher_t *d)
     : log_file(::stderr, maximal_log_level, d)
   {
@@ -807,7 +1451,7 @@ namespace qmlog
   }
 
   log_syslog::log_syslog(int maximal_log_level, dispatcher_t *d)
-    : abstract_log_t(maximal_log_level, d)
+    : abstract_log_t(maximal_log_level)
   {
     disable_fields(Timestamp_Mask) ;
     disable_fields(Process_Block) ;
@@ -816,21 +1460,31 @@ namespace qmlog
     initialized = false ;
     if (not object.syslog_logger)
       object.syslog_logger = this ;
+    attach_to(d) ;
   }
 
   log_syslog::~log_syslog()
   {
+    detach_all() ;
     if (initialized)
       closelog() ;
     if (object.syslog_logger==this)
       object.syslog_logger = NULL ;
   }
 
+  // openlog() again with the name of the child, the socket may stay shared
+  void log_syslog::after_fork_in_child()
+  {
+    initialized = false ;
+    abstract_log_t::after_fork_in_child() ;
+  }
+
   void log_syslog::submit_message(dispatcher_t *d, int level, const char *message)
   {
     if (not initialized)
     {
-      openlog(d->str_name(), LOG_PID | LOG_NDELAY, LOG_DAEMON);
+      ident = d->str_name() ;
+      openlog(ident.c_str(), LOG_PID | LOG_NDELAY, LOG_DAEMON);
       initialized = true ;
     }
     static int syslog_names[] =
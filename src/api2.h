@@ -38,6 +38,9 @@
 #include <stdarg.h>
 #include <time.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <cassert>
 #include <cstring>
@@ -47,6 +50,7 @@
 #include <set>
 #include <vector>
 #include <string>
+#include <map>
 
 #ifndef QMLOG_DISPATCHER
 #define QMLOG_DISPATCHER qmlog::object.get_default_dispatcher()
@@ -82,6 +86,10 @@
 
 #define QMLOG_LOCATION __LINE__,__FILE__,__PRETTY_FUNCTION__
 
+// A static qmlog::site_t for each expansion of a logging macro
+#define QMLOG_SITE(level) static qmlog::site_t qmlog_site = { level, __LINE__, __FILE__, __PRETTY_FUNCTION__, 0, NULL, false }
+#define QMLOG_SITE_WITHOUT_LOCATION(level) static qmlog::site_t qmlog_site = { level, -1, __FILE__, NULL, 0, NULL, false }
+
 #ifdef NDEBUG
 #define QMLOG_ABORTION 0
 #else
@@ -98,9 +106,9 @@
 
 #if QMLOG_LEVEL >= QMLOG_INTERNAL
 # if (QMLOG_LOCATION_MASK) & (1<<QMLOG_INTERNAL)
-#  define log_internal(...) QMLOG_IF (QMLOG_DISPATCHER)->message(QMLOG_INTERNAL, QMLOG_LOCATION, ## __VA_ARGS__) ; QMLOG_ENDIF
+#  define log_internal(...) QMLOG_IF QMLOG_SITE(QMLOG_INTERNAL) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, ## __VA_ARGS__) ; QMLOG_ENDIF
 # else
-#  define log_internal(...) QMLOG_IF (QMLOG_DISPATCHER)->message(QMLOG_INTERNAL, ## __VA_ARGS__) ; QMLOG_ENDIF
+#  define log_internal(...) QMLOG_IF QMLOG_SITE_WITHOUT_LOCATION(QMLOG_INTERNAL) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, ## __VA_ARGS__) ; QMLOG_ENDIF
 # endif
 #else
 # define log_internal(...) (void)(0)
@@ -108,9 +116,9 @@
 
 #if QMLOG_LEVEL >= QMLOG_CRITICAL
 # if (QMLOG_LOCATION_MASK) & (1<<QMLOG_CRITICAL)
-#  define log_critical(...) QMLOG_IF (QMLOG_DISPATCHER)->message(QMLOG_CRITICAL, QMLOG_LOCATION, ## __VA_ARGS__) ; QMLOG_ENDIF
+#  define log_critical(...) QMLOG_IF QMLOG_SITE(QMLOG_CRITICAL) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, ## __VA_ARGS__) ; QMLOG_ENDIF
 # else
-#  define log_critical(...) QMLOG_IF (QMLOG_DISPATCHER)->message(QMLOG_CRITICAL, ## __VA_ARGS__) ; QMLOG_ENDIF
+#  define log_critical(...) QMLOG_IF QMLOG_SITE_WITHOUT_LOCATION(QMLOG_CRITICAL) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, ## __VA_ARGS__) ; QMLOG_ENDIF
 # endif
 #else
 # define log_critical(...) (void)(0)
@@ -118,9 +126,9 @@
 
 #if QMLOG_LEVEL >= QMLOG_ERROR
 # if (QMLOG_LOCATION_MASK) & (1<<QMLOG_ERROR)
-#  define log_error(...) QMLOG_IF (QMLOG_DISPATCHER)->message(QMLOG_ERROR, QMLOG_LOCATION, ## __VA_ARGS__) ; QMLOG_ENDIF
+#  define log_error(...) QMLOG_IF QMLOG_SITE(QMLOG_ERROR) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, ## __VA_ARGS__) ; QMLOG_ENDIF
 # else
-#  define log_error(...) QMLOG_IF (QMLOG_DISPATCHER)->message(QMLOG_ERROR, ## __VA_ARGS__) ; QMLOG_ENDIF
+#  define log_error(...) QMLOG_IF QMLOG_SITE_WITHOUT_LOCATION(QMLOG_ERROR) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, ## __VA_ARGS__) ; QMLOG_ENDIF
 # endif
 #else
 # define log_error(...) (void)(0)
@@ -128,9 +136,9 @@
 
 #if QMLOG_LEVEL >= QMLOG_WARNING
 # if (QMLOG_LOCATION_MASK) & (1<<QMLOG_WARNING)
-#  define log_warning(...) QMLOG_IF (QMLOG_DISPATCHER)->message(QMLOG_WARNING, QMLOG_LOCATION, ## __VA_ARGS__) ; QMLOG_ENDIF
+#  define log_warning(...) QMLOG_IF QMLOG_SITE(QMLOG_WARNING) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, ## __VA_ARGS__) ; QMLOG_ENDIF
 # else
-#  define log_warning(...) QMLOG_IF (QMLOG_DISPATCHER)->message(QMLOG_WARNING, ## __VA_ARGS__) ; QMLOG_ENDIF
+#  define log_warning(...) QMLOG_IF QMLOG_SITE_WITHOUT_LOCATION(QMLOG_WARNING) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, ## __VA_ARGS__) ; QMLOG_ENDIF
 # endif
 #else
 # define log_warning(...) (void)(0)
@@ -138,9 +146,9 @@
 
 #if QMLOG_LEVEL >= QMLOG_NOTICE
 # if (QMLOG_LOCATION_MASK) & (1<<QMLOG_NOTICE)
-#  define log_notice(...) QMLOG_IF (QMLOG_DISPATCHER)->message(QMLOG_NOTICE, QMLOG_LOCATION, ## __VA_ARGS__) ; QMLOG_ENDIF
+#  define log_notice(...) QMLOG_IF QMLOG_SITE(QMLOG_NOTICE) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, ## __VA_ARGS__) ; QMLOG_ENDIF
 # else
-#  define log_notice(...) QMLOG_IF (QMLOG_DISPATCHER)->message(QMLOG_NOTICE, ## __VA_ARGS__) ; QMLOG_ENDIF
+#  define log_notice(...) QMLOG_IF QMLOG_SITE_WITHOUT_LOCATION(QMLOG_NOTICE) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, ## __VA_ARGS__) ; QMLOG_ENDIF
 # endif
 #else
 # define log_notice(...) (void)(0)
@@ -148,9 +156,9 @@
 
 #if QMLOG_LEVEL >= QMLOG_INFO
 # if (QMLOG_LOCATION_MASK) & (1<<QMLOG_INFO)
-#  define log_info(...) QMLOG_IF (QMLOG_DISPATCHER)->message(QMLOG_INFO, QMLOG_LOCATION, ## __VA_ARGS__) ; QMLOG_ENDIF
+#  define log_info(...) QMLOG_IF QMLOG_SITE(QMLOG_INFO) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, ## __VA_ARGS__) ; QMLOG_ENDIF
 # else
-#  define log_info(...) QMLOG_IF (QMLOG_DISPATCHER)->message(QMLOG_INFO, ## __VA_ARGS__) ; QMLOG_ENDIF
+#  define log_info(...) QMLOG_IF QMLOG_SITE_WITHOUT_LOCATION(QMLOG_INFO) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, ## __VA_ARGS__) ; QMLOG_ENDIF
 # endif
 #else
 # define log_info(...) (void)(0)
@@ -158,14 +166,89 @@
 
 #if QMLOG_LEVEL >= QMLOG_DEBUG
 # if (QMLOG_LOCATION_MASK) & (1<<QMLOG_DEBUG)
-#  define log_debug(...) QMLOG_IF (QMLOG_DISPATCHER)->message(QMLOG_DEBUG, QMLOG_LOCATION, ## __VA_ARGS__) ; QMLOG_ENDIF
+#  define log_debug(...) QMLOG_IF QMLOG_SITE(QMLOG_DEBUG) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, ## __VA_ARGS__) ; QMLOG_ENDIF
 # else
-#  define log_debug(...) QMLOG_IF (QMLOG_DISPATCHER)->message(QMLOG_DEBUG, ## __VA_ARGS__) ; QMLOG_ENDIF
+#  define log_debug(...) QMLOG_IF QMLOG_SITE_WITHOUT_LOCATION(QMLOG_DEBUG) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, ## __VA_ARGS__) ; QMLOG_ENDIF
 # endif
 #else
 # define log_debug(...) (void)(0)
 #endif
 
+// The same with key/value pairs, the first argument is made by qmlog::kv():
+//   log_info_kv(qmlog::kv("user", name)("bytes", size), "request %d done", id) ;
+#define QMLOG_KV(level, ...) QMLOG_IF QMLOG_SITE(level) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, __VA_ARGS__) ; QMLOG_ENDIF
+#define QMLOG_KV_WITHOUT_LOCATION(level, ...) QMLOG_IF QMLOG_SITE_WITHOUT_LOCATION(level) ; if (qmlog::site_on(&qmlog_site)) (QMLOG_DISPATCHER)->message(&qmlog_site, __VA_ARGS__) ; QMLOG_ENDIF
+
+#if QMLOG_LEVEL >= QMLOG_INTERNAL
+# if (QMLOG_LOCATION_MASK) & (1<<QMLOG_INTERNAL)
+#  define log_internal_kv(...) QMLOG_KV(QMLOG_INTERNAL, __VA_ARGS__)
+# else
+#  define log_internal_kv(...) QMLOG_KV_WITHOUT_LOCATION(QMLOG_INTERNAL, __VA_ARGS__)
+# endif
+#else
+# define log_internal_kv(...) (void)(0)
+#endif
+
+#if QMLOG_LEVEL >= QMLOG_CRITICAL
+# if (QMLOG_LOCATION_MASK) & (1<<QMLOG_CRITICAL)
+#  define log_critical_kv(...) QMLOG_KV(QMLOG_CRITICAL, __VA_ARGS__)
+# else
+#  define log_critical_kv(...) QMLOG_KV_WITHOUT_LOCATION(QMLOG_CRITICAL, __VA_ARGS__)
+# endif
+#else
+# define log_critical_kv(...) (void)(0)
+#endif
+
+#if QMLOG_LEVEL >= QMLOG_ERROR
+# if (QMLOG_LOCATION_MASK) & (1<<QMLOG_ERROR)
+#  define log_error_kv(...) QMLOG_KV(QMLOG_ERROR, __VA_ARGS__)
+# else
+#  define log_error_kv(...) QMLOG_KV_WITHOUT_LOCATION(QMLOG_ERROR, __VA_ARGS__)
+# endif
+#else
+# define log_error_kv(...) (void)(0)
+#endif
+
+#if QMLOG_LEVEL >= QMLOG_WARNING
+# if (QMLOG_LOCATION_MASK) & (1<<QMLOG_WARNING)
+#  define log_warning_kv(...) QMLOG_KV(QMLOG_WARNING, __VA_ARGS__)
+# else
+#  define log_warning_kv(...) QMLOG_KV_WITHOUT_LOCATION(QMLOG_WARNING, __VA_ARGS__)
+# endif
+#else
+# define log_warning_kv(...) (void)(0)
+#endif
+
+#if QMLOG_LEVEL >= QMLOG_NOTICE
+# if (QMLOG_LOCATION_MASK) & (1<<QMLOG_NOTICE)
+#  define log_notice_kv(...) QMLOG_KV(QMLOG_NOTICE, __VA_ARGS__)
+# else
+#  define log_notice_kv(...) QMLOG_KV_WITHOUT_LOCATION(QMLOG_NOTICE, __VA_ARGS__)
+# endif
+#else
+# define log_notice_kv(...) (void)(0)
+#endif
+
+#if QMLOG_LEVEL >= QMLOG_INFO
+# if (QMLOG_LOCATION_MASK) & (1<<QMLOG_INFO)
+#  define log_info_kv(...) QMLOG_KV(QMLOG_INFO, __VA_ARGS__)
+# else
+#  define log_info_kv(...) QMLOG_KV_WITHOUT_LOCATION(QMLOG_INFO, __VA_ARGS__)
+# endif
+#else
+# define log_info_kv(...) (void)(0)
+#endif
+
+#if QMLOG_LEVEL >= QMLOG_DEBUG
+# if (QMLOG_LOCATION_MASK) & (1<<QMLOG_DEBUG)
+#  define log_debug_kv(...) QMLOG_KV(QMLOG_DEBUG, __VA_ARGS__)
+# else
+#  define log_debug_kv(...) QMLOG_KV_WITHOUT_LOCATION(QMLOG_DEBUG, __VA_ARGS__)
+# endif
+#else
+# define log_debug_kv(...) (void)(0)
+#endif
+
 template<int bytes>
 struct smart_buffer
 {
@@ -219,6 +302,14 @@ struct smart_buffer
       delete[] p ;
   }
 
+  void append(const void *data, unsigned size)
+  {
+    while (len - pos <= size)
+      grow() ;
+    memcpy(p+pos, data, size) ;
+    p[pos += size] = '\0' ;
+  }
+
   void printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)))
   {
     va_list args ;
@@ -232,7 +323,10 @@ struct smart_buffer
     for(bool written = false; not written; )
     {
       unsigned space = len - pos ;
-      unsigned needed = vsnprintf(p+pos, space, fmt, args) ;
+      va_list attempt ;
+      va_copy(attempt, args) ; // a retry after grow() needs the arguments again
+      unsigned needed = vsnprintf(p+pos, space, fmt, attempt) ;
+      va_end(attempt) ;
       written = needed < space ;
       if (not written)
         grow() ;
@@ -301,6 +395,7 @@ namespace qmlog
     Cache_If_Cant_Open    = 1 << (last_field+2),
     Dont_Create_File      = 1 << (last_field+3),
     Retry_If_Failed       = 1 << (last_field+4),
+    Reopen_If_Moved       = 1 << (last_field+5), // checked once a second
 
     Monotonic_Mask        = Monotonic|Monotonic2|Monotonic3|Monotonic4,
     Time_Mask             = Time|Time2|Time3,
@@ -326,6 +421,22 @@ namespace qmlog
     Full     = QMLOG_FULL
   } ;
 
+  // what an asynchronous dispatcher does if its queue is full
+  enum overflow_policies
+  {
+    Block_If_Full,   // wait for the writer thread to catch up
+    Drop_Newest,     // discard the message being logged
+    Drop_Oldest      // discard the oldest queued message
+  } ;
+
+  // the header of the messages sent by log_syslog_socket
+  enum syslog_formats
+  {
+    Rfc3164,         // "<PRI>Mmm dd hh:mm:ss name[pid]: ", as syslog() does
+    Rfc5424          // "<PRI>1 yyyy-mm-ddThh:mm:ss+hh:mm host name pid - - "
+  } ;
+
+  struct site_t ;
   class object_t ;
   class dispatcher_t ;
   class abstract_log_t ;
@@ -333,28 +444,161 @@ namespace qmlog
   class log_stderr ;
   class log_stdout ;
   class log_syslog ;
+  class log_binary_file ;
   class settings_modifier ;
+  class async_queue_t ;
+  class timezone_watcher_t ;
+  class control_watcher_t ;
+  class flush_timer_t ;
+  class rotation_t ;
+  class layout_t ;
+  struct record_t ;
+  struct ring_header_t ;
 
   extern object_t object ;
 
+  // The place a logging macro is used at, made by the compiler (see
+  // QMLOG_SITE) without any code to run. The library registers it with the
+  // first message logged there: the id is unique in the process and never
+  // changes, "at file:line" is rendered once. 'line' is -1 and 'func' is
+  // NULL, if the location is not logged (QMLOG_LOCATION_MASK).
+  struct site_t
+  {
+    int level, line ;
+    const char *file, *func ;
+    unsigned id ; // 0 until registered
+    const char *location ; // "at file:line", NULL without a line
+    bool off ; // by the rules of object_t::switch_sites(), checked by the macros
+  } ;
+
+  // A typed value attached to a message, see kv_list_t. Strings are not
+  // copied: they have to live until the message is logged.
+  struct kv_t
+  {
+    enum type_t { String, Signed, Unsigned, Double, Boolean } type ;
+    const char *key ;
+    union
+    {
+      const char *s ;
+      long long i ;
+      unsigned long long u ;
+      double d ;
+      bool b ;
+    } value ;
+  } ;
+
+  // The key/value pairs of a message: qmlog::kv("user", name) makes the
+  // list, each call adds a pair: kv("user", name)("bytes", size)("ok", true).
+  // It lives on the stack of the caller, the pairs after the first
+  // 'capacity' ones are dropped. The text logs append them to the message
+  // as key=value, log_json and log_logfmt write them with their types.
+  class kv_list_t
+  {
+  public:
+    enum { capacity = 16 } ;
+    kv_list_t() : count(0) { }
+    unsigned size() const { return count ; }
+    const kv_t &operator[](unsigned i) const { return items[i] ; }
+
+    kv_list_t &operator()(const char *key, const char *value) { if (kv_t *e = add(key, kv_t::String)) e->value.s = value ; return *this ; }
+    kv_list_t &operator()(const char *key, const std::string &value) { return (*this)(key, value.c_str()) ; }
+    kv_list_t &operator()(const char *key, bool value) { if (kv_t *e = add(key, kv_t::Boolean)) e->value.b = value ; return *this ; }
+    kv_list_t &operator()(const char *key, int value) { return signed_value(key, value) ; }
+    kv_list_t &operator()(const char *key, long value) { return signed_value(key, value) ; }
+    kv_list_t &operator()(const char *key, long long value) { return signed_value(key, value) ; }
+    kv_list_t &operator()(const char *key, unsigned value) { return unsigned_value(key, value) ; }
+    kv_list_t &operator()(const char *key, unsigned long value) { return unsigned_value(key, value) ; }
+    kv_list_t &operator()(const char *key, unsigned long long value) { return unsigned_value(key, value) ; }
+    kv_list_t &operator()(const char *key, double value) { if (kv_t *e = add(key, kv_t::Double)) e->value.d = value ; return *this ; }
+  private:
+    unsigned count ;
+    kv_t items[capacity] ;
+    kv_t *add(const char *key, kv_t::type_t type)
+    {
+      if (count==capacity)
+        return NULL ;
+      kv_t *e = &items[count++] ;
+      e->key = key ;
+      e->type = type ;
+      return e ;
+    }
+    kv_list_t &signed_value(const char *key, long long value) { if (kv_t *e = add(key, kv_t::Signed)) e->value.i = value ; return *this ; }
+    kv_list_t &unsigned_value(const char *key, unsigned long long value) { if (kv_t *e = add(key, kv_t::Unsigned)) e->value.u = value ; return *this ; }
+  } ;
+
+  template<class T>
+  inline kv_list_t kv(const char *key, const T &value)
+  {
+    kv_list_t list ;
+    list(key, value) ;
+    return list ;
+  }
+
   class object_t
   {
     bool currently_enabled ;
     dispatcher_t *default_dispatcher ;
     abstract_log_t *syslog_logger, *stderr_logger ;
   private:
-    std::string process_name ;
-    static std::string calculate_process_name() ;
+    // NULL until set_process_name(): the name the program was started
+    // with is found on first use, shared by all the dispatchers
+    const std::string *process_name ;
+    static const char *default_process_name() ;
+    const char *str_process_name() ; // in a read section only
   private:
     std::set<dispatcher_t *> dispatchers ;
     void register_dispatcher(dispatcher_t *d) { dispatchers.insert(d) ; }
     void unregister_dispatcher(dispatcher_t *d) { dispatchers.erase(d) ; }
-    friend class dispatcher_t ; // for 2 above methods only
+    friend class dispatcher_t ; // for 3 above methods only
+  private:
+    timezone_watcher_t *timezone_watcher ;
+    friend class timezone_watcher_t ;
+    control_watcher_t *control_watcher ;
+    friend class control_watcher_t ; // changes the dispatchers and their logs
+  private:
+    // The pthread_atfork() handlers: the locks of the library and of the
+    // logs are held across fork(), the child drops the messages queued by
+    // the parent and starts the threads of its own (async writers, control
+    // file watcher, compressor). The pid is looked up once per process.
+    static void before_fork() ;
+    static void after_fork_in_parent() ;
+    static void after_fork_in_child() ;
+    static std::set<abstract_log_t*> attached_logs() ;
   public:
     static bool enabled() __attribute__((always_inline)) ;
-    void enable(bool flag) { currently_enabled = flag ; }
+    void enable(bool flag) { __atomic_store_n(&currently_enabled, flag, __ATOMIC_RELAXED) ; }
     void set_process_name(const std::string &new_name) ;
-    std::string get_process_name() { return process_name ; }
+    std::string get_process_name() ;
+    // how often /etc/localtime and TZ are checked for a change, 1 by default
+    void set_timezone_check_interval(int seconds) ;
+    // Turns the logging macros on or off at the sites with the file and
+    // function matching the shell patterns (NULL matches all, 'func' is as
+    // given by __PRETTY_FUNCTION__) and the level 'level' or a less severe
+    // one. The last rule matching a site decides, the sites matched by none
+    // are on. A site switched off costs a load and a branch, the levels of
+    // the dispatchers and the logs apply to the ones switched on.
+    void switch_sites(bool on, const char *file, const char *func=NULL, int level=qmlog::Internal) ;
+    void reset_sites() ; // drops the rules: all the sites are on
+    // Replaces the rules with the ones in the file, a line per rule:
+    //   on|off <file pattern> [<function pattern> [<level name>]]
+    // empty lines and the ones starting with '#' are skipped. Returns false,
+    // if the file can't be read or a line is not understood (it is skipped).
+    // The constructor reads the file named by $QMLOG_SITES, if set.
+    bool read_site_rules(const char *path) ;
+    // The control file of the running process, named by $QMLOG_CONTROL
+    // (empty: none) or by this call. Logging is enabled while the file
+    // exists; its lines change the settings as soon as it's written, a
+    // thread of the library is watching it. Without either, QMLOG_ENABLER1
+    // is read once when the library starts, no thread is started for it.
+    // The lines of the file:
+    //   enabled yes|no
+    //   dispatcher default|all level <level name>
+    //   log stderr|syslog|all|<path of a log> level <level name>
+    //   log stderr|syslog|all|<path of a log> fields <Field|Field...>
+    //   on|off <file pattern> [<function pattern> [<level name>]]
+    // The last ones replace the rules of switch_sites(), the settings not
+    // mentioned are left as they are. NULL stops watching.
+    void set_control_file(const char *path) ;
 
     friend class log_syslog ;
     friend class log_stderr ;
@@ -367,50 +611,33 @@ namespace qmlog
     dispatcher_t *get_default_dispatcher() { return default_dispatcher ; }
   } ;
 
+  // Logging may happen in any thread: the per-message data lives in the
+  // calling thread, the data read by logging threads (name, log list, proxy)
+  // is replaced as a whole and freed only when no thread is reading it.
+  // Configuration changes (attach, detach, set_proxy...) are serialized.
   class dispatcher_t
   {
-    std::string name ;
+    const std::string *name ; // NULL: the process name of qmlog::object
     std::set<abstract_log_t *> logs ;
+    const std::vector<abstract_log_t *> *active_logs ; // published copy of 'logs'
+    void publish_logs() ;
     std::set<dispatcher_t*> slaves ;
     dispatcher_t *proxy ;
 
-    void get_timestamp() ;
-    bool got_timestamp ;
-    struct timespec monotonic_timestamp ;
-    struct timeval timestamp ;
-
-    void get_localtime() ;
-    bool got_localtime ;
-    struct tm localtime ;
-
-    bool has_monotonic ;
-    bool has_monotonic_nano ;
-    bool has_monotonic_micro ;
-    bool has_monotonic_milli ;
-    dynamic_buffer s_mono, s_mono_nano, s_mono_micro, s_mono_milli ;
-
-    bool has_gmt_offset ;
-    dynamic_buffer s_gmt_offset ;
-
-    bool has_tz_symlink ;
-    int tz_symlink_offset ;
-    dynamic_buffer s_tz_symlink ;
-
-    bool has_date ;
-    dynamic_buffer s_date ;
-
-    bool has_time ;
-    bool has_time_micro ;
-    bool has_time_milli ;
-    dynamic_buffer s_time, s_time_micro, s_time_milli ;
-
-    pid_t last_pid ;
-    dynamic_buffer s_pid ;
-
     int current_level ;
+
+    async_queue_t *queue ;
+    unsigned long dropped_before ;
+    void deliver(abstract_log_t *l, int level, const char *message) ;
+    void deliver(abstract_log_t *l, const record_t &r, const char *arguments, unsigned size) ;
+    friend class abstract_log_t ; // compose_message() calls deliver()
+    void replay(const record_t &r, const char *arguments, unsigned size) ;
+    friend class async_queue_t ; // the writer thread calls replay()
+    friend class object_t ; // the fork() handlers reach the logs and the queue
   protected:
     virtual void set_process_name(const std::string &new_name) ;
-    friend class object_t ; // qmlog::object will call set_process_name()
+    friend class log_binary_file ; // decode() calls replay() and set_process_name()
+    friend class control_watcher_t ; // sets the levels of the logs
   public:
     dispatcher_t() ;
     virtual ~dispatcher_t() ;
@@ -419,16 +646,34 @@ namespace qmlog
     void attach(abstract_log_t *) ;
     void detach(abstract_log_t *) ;
     void set_proxy(dispatcher_t *) ;
+    // asynchronous mode: messages are composed by the caller,
+    // but written to the logs by a dedicated thread;
+    // with 'defer_formatting' the caller only copies the arguments and the
+    // writer thread does the formatting. The format strings have to stay
+    // valid then, in practice they have to be string literals.
+    void set_async(unsigned capacity=1024, int overflow_policy=qmlog::Block_If_Full, bool defer_formatting=false) ;
+    void set_sync() ;
+    bool is_async() ;
+    void flush() ; // returns when all queued and buffered messages are written
+    unsigned long dropped() ; // messages lost due to queue overflow
     void message(int level) ;
     void message(int level, const char *fmt, ...) __attribute__((format(printf,3,4))) ;
     void message(int level, int line, const char *file, const char *func) ;
     void message(int level, int line, const char *file, const char *func, const char *fmt, ...) __attribute__((format(printf,6,7))) ;
+    void message(site_t *site) ;
+    void message(site_t *site, const char *fmt, ...) __attribute__((format(printf,3,4))) ;
+    void message(int level, const kv_list_t &kv) ;
+    void message(int level, const kv_list_t &kv, const char *fmt, ...) __attribute__((format(printf,4,5))) ;
+    void message(site_t *site, const kv_list_t &kv) ;
+    void message(site_t *site, const kv_list_t &kv, const char *fmt, ...) __attribute__((format(printf,4,5))) ;
     void message_failed_assertion(bool abortion, const char *assertion, int line, const char *file, const char *func) ;
     void message_failed_assertion(bool abortion, const char *assertion, int line, const char *file, const char *func, const char *fmt, ...) __attribute__((format(printf,7,8))) ;
     void message_abortion(bool abortion, int line, const char *file, const char *func) ;
     void message_abortion(bool abortion, int line, const char *file, const char *func, const char *fmt, ...) __attribute__((format(printf,6,7))) ;
     void message_ndebug(bool abortion) ;
     void generic(int level, int line, const char *file, const char *func, const char *fmt, va_list arg) ;
+    void generic(const site_t *site, const char *fmt, va_list arg) ;
+    void generic(const site_t *site, const kv_list_t *kv, const char *fmt, va_list arg) ;
     const char *str_monotonic() ;
     const char *str_monotonic_nano() ;
     const char *str_monotonic_micro() ;
@@ -451,7 +696,32 @@ namespace qmlog
     std::set<dispatcher_t*> dispatchers ;
     int level, max_level ;
     int fields ;
+    const layout_t *layout ; // compiled 'fields', made again when they change
+    bool takes_records ; // submit_record() is called instead of compose_message()
+    pthread_mutex_t mutex ; // one message at a time
+    void submit_locked(dispatcher_t *d, int level, const char *message) ;
+    void submit_record_locked(dispatcher_t *d, const record_t &r, const char *arguments, unsigned size) ;
+    void flush_locked() ;
+    void deliver(dispatcher_t *d, int level, const char *message) ; // for compose_message()
+    void init(int maximal_log_level) ;
+    void init_mutex() ;
     friend class dispatcher_t ;
+    friend class async_queue_t ;
+    friend class flush_timer_t ; // flushes the messages kept back when due
+    // Called by the fork() handlers of qmlog::object with 'mutex' locked by
+    // before_fork(); the child has a copy of the log, it must not write
+    // what the parent keeps back, nor share the state of a file with it.
+    virtual void before_fork() ;
+    virtual void after_fork_in_parent() ;
+    virtual void after_fork_in_child() ;
+    friend class object_t ;
+    // Has to be called by the destructor of each class implementing submit_message():
+    // once it returns, no other thread is writing to this log any more.
+    void detach_all() ;
+    // Derived classes may attach themselves only when completely constructed,
+    // otherwise a thread logging to the dispatcher may see a half-made object
+    abstract_log_t(int maximal_log_level) ;
+    void attach_to(dispatcher_t *d) ;
   public:
     abstract_log_t(int maximal_log_level, dispatcher_t *d) ;
     unsigned d_counter() { return dispatchers.size() ; }
@@ -462,27 +732,93 @@ namespace qmlog
     int get_fields() ;
     int enable_fields(int mask) ;
     int disable_fields(int mask) ;
+    virtual const char *get_path() ; // of the file written, NULL if none
     virtual ~abstract_log_t() ;
-    virtual void compose_message(dispatcher_t *d, int level, int line, const char *file, const char *func, const char *fmt, va_list args) ;
+    // 'site' is not registered (id 0), if the message wasn't logged by a macro
+    virtual void compose_message(dispatcher_t *d, const site_t *site, const char *fmt, va_list args) ;
     virtual void submit_message(dispatcher_t *d, int level, const char *message) = 0 ;
+    // the message as captured by the dispatcher, see record.h
+    virtual void submit_record(dispatcher_t *d, const record_t &r, const char *arguments, unsigned size) ;
+    // writes the messages the log keeps back, called by dispatcher_t::flush()
+    virtual void flush_buffer() ;
   } ;
 
   class log_file : public abstract_log_t
   {
     std::string file_path ;
     bool by_fp, failed ;
-    FILE *fp ;
-    std::vector<std::string> cache ;
+    FILE *fp ; // only if given to the constructor
+    int fd ; // written directly, without stdio
+    bool to_pipe ; // writes longer than PIPE_BUF may be mixed with others
+    // Cache_If_Cant_Open: a ring of messages, the oldest are dropped when full
+    char *cache ;
+    unsigned cache_size, cache_start, cache_length ;
+    unsigned long cache_dropped ;
+    struct timespec next_open ; // no attempt before, while it fails
+    unsigned open_delay ; // milliseconds, doubled after each failure
+    unsigned flush_bytes, flush_milliseconds ;
+    int flush_level ;
+    std::string pending ; // messages kept back by the flush policy
+    struct timespec pending_since ;
+    rotation_t *rotation ;
+    unsigned long written ; // to the current file
+    time_t started_at ; // of the current file
+    unsigned long long file_dev, file_ino ; // of the current file
+    time_t moved_checked ;
+    bool reopen_wanted ;
+    unsigned long reopen_seen ; // reopen_all() calls
+    void setup(FILE *given) ;
+  protected:
+    // not attached yet, for the classes composing their own text
+    log_file(int maximal_log_level, const char *path) ;
+    log_file(int maximal_log_level, FILE *fp) ;
+    // the compose_message() of log_json and log_logfmt
+    void compose_structured(bool json, dispatcher_t *d, const site_t *site, const char *fmt, va_list args) ;
   public:
     log_file(const char *path, int maximal_log_level=qmlog::Full, dispatcher_t *dispatcher=NULL) ;
     log_file(FILE *fp, int maximal_log_level=qmlog::Full, dispatcher_t *dispatcher=NULL) ;
     virtual ~log_file() ;
     void submit_message(dispatcher_t *d, int level, const char *message) ;
+    const char *get_path() ;
+    // By default each message is written and flushed on its own. With
+    // 'bytes' > 0 the messages are kept back and written together once
+    // 'bytes' of them are pending, once the oldest of them is older than
+    // 'milliseconds' (if not 0; a thread of the library is woken then) or
+    // with the first message of 'level' or a more severe one. The flush()
+    // of the dispatcher, thus log_abort() and failed assertions, and the
+    // destructor write them as well. Ignored with Close_After_Write.
+    void set_flush_policy(unsigned bytes, unsigned milliseconds=0, int level=qmlog::Error) ;
+    void flush_buffer() ;
+    // Once the file has 'max_bytes' or was started 'max_seconds' ago (0:
+    // no limit), it is renamed to 'path'.1 and a new one takes its place,
+    // the older ones are shifted up to 'path'.'generations' and dropped
+    // after it. With 'compress' they are gzipped by a thread of their own
+    // to 'path'.N.gz. Only for the logs made with a path.
+    void set_rotation(unsigned long max_bytes, unsigned max_seconds=0, unsigned generations=5, bool compress=false) ;
+    // For the rotation done by others, instead of Close_After_Write: the
+    // file is opened again with the next message. reopen_all() does it for
+    // all the logs and is async-signal-safe, reopen_on_signal() installs a
+    // handler calling it. Reopen_If_Moved in the fields makes a log look
+    // for a new file at its path itself.
+    void reopen() ;
+    static void reopen_all() ;
+    static void reopen_on_signal(int signal=SIGHUP) ;
+    // The memory used by Cache_If_Cant_Open, 64K by default. While the file
+    // can't be opened, it's tried again after 0.1 s, 0.2 s... up to a minute.
+    void set_cache_size(unsigned bytes) ;
   private:
     bool open() ;
     void close() ;
+    void cache_message(const char *message) ;
+    void drop_cached() ;
     void flush_cache() ;
-    void write_message(const char *message) ;
+    void write_pending(const char *message) ;
+    void rotate() ;
+    bool moved() ;
+  protected:
+    void before_fork() ;
+    void after_fork_in_parent() ;
+    void after_fork_in_child() ;
   } ;
 
   class log_stderr : public log_file
@@ -499,13 +835,250 @@ namespace qmlog
     virtual ~log_stdout() { }
   } ;
 
+  // JSON Lines: an object per message, written like a log_file. The keys
+  // are the fields of the log: "time" (Date, Time, Time_Milli, Time_Micro:
+  // RFC 3339 with the offset), "mono" (Monotonic...), "level", "name",
+  // "pid", "file" and "line" (Line), "func" (Function) and "msg"; then the
+  // key/value pairs of the message with their types. By default all but
+  // the monotonic time, with microseconds.
+  class log_json : public log_file
+  {
+  public:
+    log_json(const char *path, int maximal_log_level=qmlog::Full, dispatcher_t *dispatcher=NULL) ;
+    log_json(FILE *fp, int maximal_log_level=qmlog::Full, dispatcher_t *dispatcher=NULL) ;
+    virtual ~log_json() ;
+    void compose_message(dispatcher_t *d, const site_t *site, const char *fmt, va_list args) ;
+  } ;
+
+  // The same keys as log_json, as logfmt: key=value separated by spaces,
+  // the keys and values quoted when needed
+  class log_logfmt : public log_file
+  {
+  public:
+    log_logfmt(const char *path, int maximal_log_level=qmlog::Full, dispatcher_t *dispatcher=NULL) ;
+    log_logfmt(FILE *fp, int maximal_log_level=qmlog::Full, dispatcher_t *dispatcher=NULL) ;
+    virtual ~log_logfmt() ;
+    void compose_message(dispatcher_t *d, const site_t *site, const char *fmt, va_list args) ;
+  } ;
+
   class log_syslog : public abstract_log_t
   {
     bool initialized ;
+    std::string ident ; // openlog() keeps the pointer
   public:
     log_syslog(int maximal_log_level=qmlog::Full, dispatcher_t *dispatcher=NULL) ;
     virtual ~log_syslog() ;
     void submit_message(dispatcher_t *d, int level, const char *message) ;
+  protected:
+    void after_fork_in_child() ;
+  } ;
+
+  // Speaks the native protocol of the systemd journal, without syslog():
+  // a datagram per message to 'socket_path' with the fields PRIORITY,
+  // SYSLOG_IDENTIFIER, SYSLOG_PID, CODE_FILE and CODE_LINE (with Line),
+  // CODE_FUNC (with Function) and MESSAGE. The log gets the records, the
+  // message is formatted once, by the thread writing it. A message too
+  // long for a datagram is passed in a sealed memfd.
+  class log_journal : public abstract_log_t
+  {
+    std::string socket_path ;
+    int fd ;
+    bool failed ;
+    smart_buffer<1024> text, buf ;
+  public:
+    log_journal(int maximal_log_level=qmlog::Full, dispatcher_t *dispatcher=NULL, const char *socket_path="/run/systemd/journal/socket") ;
+    virtual ~log_journal() ;
+    void submit_message(dispatcher_t *d, int level, const char *message) ;
+    void submit_record(dispatcher_t *d, const record_t &r, const char *arguments, unsigned size) ;
+    const char *get_path() { return socket_path.c_str() ; }
+  private:
+    bool open() ;
+    void send() ;
+    void send_memfd() ;
+  } ;
+
+  // Talks to the syslog daemon without syslog(): a non-blocking socket
+  // connected to 'path', a datagram per message or, if the daemon listens
+  // on a stream, the messages one after another (RFC 3164: terminated by
+  // '\0', RFC 5424: preceded by their length). The header is made once a
+  // second, with the time in seconds. While the daemon doesn't take them,
+  // the messages are kept, up to 'max_pending' bytes (64K by default),
+  // and dropped after that: a stalled daemon never blocks the logging
+  // thread, dropped() counts the messages lost. A lost connection is made
+  // again with a message after a second.
+  class log_syslog_socket : public abstract_log_t
+  {
+    std::string socket_path ;
+    int format ;
+    int fd ;
+    bool stream ;
+    time_t next_connect ; // monotonic, no attempt before
+    std::string hostname ;
+    time_t header_second ;
+    pid_t header_pid ;
+    std::string header_name ;
+    smart_buffer<128> header ; // the part after "<PRI>", made once a second
+    std::string pending ; // the messages not sent yet, framed
+    std::vector<unsigned> lengths ; // of the pending messages
+    unsigned first_sent ; // bytes of the first pending message sent already
+    unsigned max_pending ;
+    unsigned flush_bytes, flush_milliseconds ;
+    int flush_level ;
+    struct timespec pending_since ;
+    unsigned long lost ;
+    smart_buffer<1024> buf ;
+  public:
+    log_syslog_socket(const char *path="/dev/log", int maximal_log_level=qmlog::Full, dispatcher_t *dispatcher=NULL, int format=qmlog::Rfc3164) ;
+    virtual ~log_syslog_socket() ;
+    void submit_message(dispatcher_t *d, int level, const char *message) ;
+    const char *get_path() { return socket_path.c_str() ; }
+    // Batching: as log_file::set_flush_policy(), the messages kept back
+    // go in a single write() or sendmmsg() call
+    void set_flush_policy(unsigned bytes, unsigned milliseconds=0, int level=qmlog::Error) ;
+    void set_max_pending(unsigned bytes) ;
+    void flush_buffer() ;
+    unsigned long dropped() ;
+  private:
+    bool connect_socket() ;
+    void disconnect() ;
+    void make_header(dispatcher_t *d) ;
+    void send_pending() ;
+    void drop_first() ;
+  protected:
+    void after_fork_in_child() ;
+  } ;
+
+  // Stores the messages unformatted: timestamps, level, pid, references to
+  // the strings (process name, file, function, format) and the arguments,
+  // the messages logged by the macros refer to their call site instead.
+  // Such a file is much smaller and cheaper to write than a text log,
+  // decode() or the qmlog-decode tool turn it into the text a log_file
+  // with the same fields would contain. The strings are numbered by the
+  // writing process, so a child made by fork() doesn't write the file of
+  // its parent: it needs a log of its own.
+  class log_binary_file : public abstract_log_t
+  {
+    std::string file_path ;
+    int fd ;
+    bool failed ;
+    bool inherited ; // in the child of the process which made the log
+    struct interned_t
+    {
+      unsigned id ;
+      std::string value ; // the same pointer may be reused for another string
+    } ;
+    std::map<const char *, interned_t> strings ;
+    unsigned last_id ;
+    std::vector<bool> sites ; // index is the id of a site written already
+    smart_buffer<1024> buf ;
+  public:
+    log_binary_file(const char *path, int maximal_log_level=qmlog::Full, dispatcher_t *dispatcher=NULL) ;
+    virtual ~log_binary_file() ;
+    void submit_message(dispatcher_t *d, int level, const char *message) ;
+    void submit_record(dispatcher_t *d, const record_t &r, const char *arguments, unsigned size) ;
+    const char *get_path() { return file_path.c_str() ; }
+    // Writes the text to 'out', using the fields of the log which wrote
+    // the file, if 'fields' is negative. False if 'in' is not readable.
+    static bool decode(FILE *in, FILE *out, int fields=-1) ;
+  private:
+    bool open() ;
+    unsigned intern(const char *s) ;
+    void define_site(const site_t *site) ;
+  protected:
+    void after_fork_in_child() ;
+  } ;
+
+  // The text of a log_file, stored to a file mapped into memory: a message
+  // costs a memcpy(), the kernel writes the pages back when it wants to.
+  // The file is preallocated 'segment_size' bytes at a time, its first line
+  // "# qmlog XXXXXXXX bytes in use" gives the length of the complete
+  // messages in hex, so the zeros and a torn message after a crash can be
+  // cut off. When a segment is full, it goes to 'path'.1 and a new one is
+  // started; the destructor cuts the file to the used length. The length
+  // is kept by the writing process: the child of a fork() doesn't write.
+  class log_mmap_file : public abstract_log_t
+  {
+    std::string file_path ;
+    unsigned segment_size ;
+    int fd ;
+    bool failed ;
+    char *map ;
+    unsigned used ; // committed length, including the header line
+  public:
+    log_mmap_file(const char *path, int maximal_log_level=qmlog::Full, dispatcher_t *dispatcher=NULL, unsigned segment_size=4<<20) ;
+    virtual ~log_mmap_file() ;
+    void submit_message(dispatcher_t *d, int level, const char *message) ;
+    const char *get_path() { return file_path.c_str() ; }
+  private:
+    bool open() ;
+    void close() ;
+    void commit(unsigned length) ;
+  protected:
+    void after_fork_in_child() ;
+  } ;
+
+  // The newest messages in a ring of POSIX shared memory (shm_open()):
+  // a message costs a memcpy(), a process like qmlog-tail reads the ring
+  // while this one is running or after it crashed. Nothing but the memory
+  // is shared with the readers, the log never waits for them: the oldest
+  // messages are overwritten, a reader falling behind loses them (the
+  // sequence numbers of the messages tell how many). The name is
+  // "/qmlog-<pid>" by default, the size is rounded up to a power of two.
+  // The destructor removes the ring. The child of a fork() makes a ring of
+  // its own, if the name is the default one; else it doesn't write.
+  class log_shm_ring : public abstract_log_t
+  {
+    std::string ring_name ;
+    bool named ; // by the caller, not after the pid
+    unsigned size ;
+    bool failed ;
+    ring_header_t *ring ;
+  public:
+    log_shm_ring(const char *name=NULL, int maximal_log_level=qmlog::Full, dispatcher_t *dispatcher=NULL, unsigned size=1<<20) ;
+    virtual ~log_shm_ring() ;
+    void submit_message(dispatcher_t *d, int level, const char *message) ;
+    const char *get_path() { return ring_name.c_str() ; }
+    // Writes the messages in the ring 'name' (a number: the default name
+    // of that process) to 'out', a line each; with 'follow' it goes on
+    // with the new ones and doesn't return. False if there is no ring.
+    static bool tail(const char *name, FILE *out, bool follow=false) ;
+  private:
+    bool open() ;
+    void close() ;
+  protected:
+    void after_fork_in_child() ;
+  } ;
+
+  // The flight recorder: the newest records in memory, unformatted, to
+  // be written out when things go wrong. Give it a more verbose level than
+  // the other logs of the dispatcher (not the dispatcher itself): the
+  // messages only it wants are captured and copied, never formatted.
+  // message_abortion() and message_failed_assertion() dump all the
+  // recorders, so does a fatal signal after dump_on_fatal_signals().
+  // The dump goes to 'dump_path' (appended) or to stderr, if NULL. In the
+  // signal handler it is formatted without vsnprintf() into memory
+  // allocated in advance (cut at 64K a message) and written with write().
+  class log_flight_recorder : public abstract_log_t
+  {
+    char *data ;
+    unsigned size ; // a power of two
+    unsigned long long head, tail ; // bytes stored since the start
+    unsigned long long dumped ; // 'head' at the last dump
+    std::string dump_path ;
+    smart_buffer<1024> entry, text ; // for a signal handler, grown in advance
+  public:
+    log_flight_recorder(int maximal_log_level=qmlog::Full, dispatcher_t *dispatcher=NULL, unsigned size=256<<10, const char *dump_path=NULL) ;
+    virtual ~log_flight_recorder() ;
+    void submit_message(dispatcher_t *d, int level, const char *message) ;
+    void submit_record(dispatcher_t *d, const record_t &r, const char *arguments, unsigned size) ;
+    void dump() ; // the records stored since the last dump, oldest first
+    static void dump_all() ;
+    // SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT: dump_all(), then the
+    // action the signal had before
+    static void dump_on_fatal_signals() ;
+  private:
+    void dump_unlocked(smart_buffer<1024> &entry, smart_buffer<1024> &text, bool in_signal) ;
+    static void fatal_signal(int signal) ;
   } ;
 
   inline bool object_t::enabled() { return object.currently_enabled ; }
@@ -527,6 +1100,23 @@ namespace qmlog
     enable(false) ;
   }
 
+  static inline bool site_on(const site_t *site) __attribute__((always_inline)) ;
+
+  static inline bool site_on(const site_t *site)
+  {
+    return not __atomic_load_n(&site->off, __ATOMIC_RELAXED) ;
+  }
+
+  static inline void enable_sites(const char *file, const char *func=NULL, int level=qmlog::Internal)
+  {
+    object.switch_sites(true, file, func, level) ;
+  }
+
+  static inline void disable_sites(const char *file, const char *func=NULL, int level=qmlog::Internal)
+  {
+    object.switch_sites(false, file, func, level) ;
+  }
+
   static inline dispatcher_t *dispatcher() __attribute__((always_inline)) ;
 
   static inline dispatcher_t *dispatcher()
@@ -534,6 +1124,11 @@ namespace qmlog
     return QMLOG_DISPATCHER ;
   }
 
+  static inline void flush()
+  {
+    dispatcher()->flush() ;
+  }
+
   static inline int log_level(int level)
   {
     return dispatcher()->log_level(level) ;
@@ -0,0 +1,316 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <signal.h>
+#include <sys/time.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "async.h"
+#include "thread.h"
+
+namespace qmlog
+{
+  static void wait_for(pthread_cond_t *cond, pthread_mutex_t *mutex, int milliseconds)
+  {
+    struct timeval now ;
+    gettimeofday(&now, NULL) ;
+    long long nsec = (long long)now.tv_usec * 1000 + (long long)milliseconds * 1000 * 1000 ;
+    struct timespec deadline ;
+    deadline.tv_sec = now.tv_sec + nsec / (1000*1000*1000) ;
+    deadline.tv_nsec = nsec % (1000*1000*1000) ;
+    pthread_cond_timedwait(cond, mutex, &deadline) ;
+  }
+
+  async_queue_t::async_queue_t(unsigned capacity, int overflow_policy, bool defer_formatting)
+  {
+    unsigned long size = 2 ;
+    while (size < capacity)
+      size <<= 1 ;
+    slots = new slot_t[size] ;
+    for (unsigned long i=0; i<size; ++i)
+      slots[i].sequence = i ;
+    mask = size - 1 ;
+    policy = overflow_policy ;
+    defer = defer_formatting ;
+
+    enqueue_pos = dequeue_pos = 0 ;
+    processed = dropped_counter = 0 ;
+
+    pthread_mutex_init(&mutex, NULL) ;
+    pthread_cond_init(&wake_writer, NULL) ;
+    pthread_cond_init(&wake_producers, NULL) ;
+    writer_sleeping = producers_waiting = 0 ;
+    stopping = false ;
+    start_writer() ;
+  }
+
+  void async_queue_t::start_writer()
+  {
+    // signals are for the application threads, not for our writer
+    sigset_t all, old ;
+    sigfillset(&all) ;
+    pthread_sigmask(SIG_SETMASK, &all, &old) ;
+    pthread_create(&writer, NULL, thread_main, this) ;
+    pthread_sigmask(SIG_SETMASK, &old, NULL) ;
+  }
+
+  // Only the slots published before fork() are sure to own their data, a
+  // slot being filled by another thread at that moment may leak a copy.
+  void async_queue_t::after_fork_in_child()
+  {
+    for (unsigned long pos = dequeue_pos; pos != enqueue_pos; ++pos)
+    {
+      slot_t *s = &slots[pos & mask] ;
+      if (s->sequence==pos+1 and s->data != s->inline_data)
+        free(s->data) ;
+    }
+    for (unsigned long i=0; i<=mask; ++i)
+      slots[i].sequence = i ;
+    enqueue_pos = dequeue_pos = 0 ;
+    processed = 0 ;
+
+    pthread_mutex_init(&mutex, NULL) ;
+    pthread_cond_init(&wake_writer, NULL) ;
+    pthread_cond_init(&wake_producers, NULL) ;
+    writer_sleeping = producers_waiting = 0 ;
+    stopping = false ;
+    start_writer() ;
+  }
+
+  async_queue_t::~async_queue_t()
+  {
+    pthread_mutex_lock(&mutex) ;
+    stopping = true ;
+    pthread_cond_signal(&wake_writer) ;
+    pthread_mutex_unlock(&mutex) ;
+    pthread_join(writer, NULL) ;
+
+    // whatever came in while the writer was exiting
+    while (try_pop(true))
+      ;
+
+    pthread_cond_destroy(&wake_producers) ;
+    pthread_cond_destroy(&wake_writer) ;
+    pthread_mutex_destroy(&mutex) ;
+    delete[] slots ;
+  }
+
+  void *async_queue_t::thread_main(void *self)
+  {
+    static_cast<async_queue_t*>(self)->run() ;
+    return NULL ;
+  }
+
+  bool async_queue_t::is_writer()
+  {
+    return pthread_equal(pthread_self(), writer) ;
+  }
+
+  bool async_queue_t::try_push(dispatcher_t *d, abstract_log_t *l, bool composed, const record_t &r, const char *data, unsigned size)
+  {
+    unsigned long pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED) ;
+    slot_t *s ;
+    for(;;)
+    {
+      s = &slots[pos & mask] ;
+      long diff = (long) (__atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE) - pos) ;
+      if (diff<0) // the slot is not consumed yet: queue is full
+        return false ;
+      if (diff==0 and __atomic_compare_exchange_n(&enqueue_pos, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break ;
+      if (diff>0)
+        pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED) ;
+    }
+
+    s->dispatcher = d ;
+    s->log = l ;
+    s->composed = composed ;
+    s->record = r ;
+    s->data = size <= (unsigned)inline_size ? s->inline_data : (char*) malloc(size) ;
+    if (s->data==NULL) // out of memory: keep what fits
+    {
+      s->data = s->inline_data ;
+      size = inline_size ;
+      if (not composed) // captured arguments can't be cut
+      {
+        s->record.fmt = NULL ;
+        data = "(out of memory)" ;
+        size = strlen(data) ;
+      }
+    }
+    memcpy(s->data, data, size) ;
+    if (composed) // the text stays terminated, even if cut
+      s->data[size-1] = '\0' ;
+    s->size = size ;
+
+    __atomic_store_n(&s->sequence, pos+1, __ATOMIC_RELEASE) ;
+    return true ;
+  }
+
+  bool async_queue_t::try_pop(bool deliver)
+  {
+    unsigned long pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED) ;
+    slot_t *s ;
+    for(;;)
+    {
+      s = &slots[pos & mask] ;
+      long diff = (long) (__atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE) - (pos+1)) ;
+      if (diff<0) // not published yet: queue is empty
+        return false ;
+      if (diff==0 and __atomic_compare_exchange_n(&dequeue_pos, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break ;
+      if (diff>0)
+        pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED) ;
+    }
+
+    if (deliver and s->log)
+    {
+      read_section_t section ; // the dispatcher's name is used by some logs
+      if (s->composed)
+        s->log->submit_locked(s->dispatcher, s->record.level, s->data) ;
+      else
+        s->log->submit_record_locked(s->dispatcher, s->record, s->data, s->size) ;
+    }
+    else if (deliver)
+      s->dispatcher->replay(s->record, s->data, s->size) ;
+    if (s->data != s->inline_data)
+      free(s->data) ;
+
+    __atomic_store_n(&s->sequence, pos+mask+1, __ATOMIC_RELEASE) ;
+    done(1) ;
+    return true ;
+  }
+
+  void async_queue_t::done(unsigned long count)
+  {
+    __atomic_add_fetch(&processed, count, __ATOMIC_SEQ_CST) ;
+    if (__atomic_load_n(&producers_waiting, __ATOMIC_SEQ_CST))
+    {
+      pthread_mutex_lock(&mutex) ;
+      pthread_cond_broadcast(&wake_producers) ;
+      pthread_mutex_unlock(&mutex) ;
+    }
+  }
+
+  void async_queue_t::push(dispatcher_t *d, abstract_log_t *l, int level, const char *text)
+  {
+    record_t r ;
+    r.level = level ;
+    push(d, l, true, r, text, strlen(text)+1) ;
+  }
+
+  void async_queue_t::push(dispatcher_t *d, const record_t &r, const char *arguments, unsigned size)
+  {
+    push(d, NULL, false, r, arguments, size) ;
+  }
+
+  void async_queue_t::push(dispatcher_t *d, abstract_log_t *l, const record_t &r, const char *arguments, unsigned size)
+  {
+    push(d, l, false, r, arguments, size) ;
+  }
+
+  void async_queue_t::push(dispatcher_t *d, abstract_log_t *l, bool composed, const record_t &r, const char *data, unsigned size)
+  {
+    while (not try_push(d, l, composed, r, data, size))
+    {
+      if (policy==Drop_Oldest)
+      {
+        if (try_pop(false))
+          __atomic_add_fetch(&dropped_counter, 1, __ATOMIC_RELAXED) ;
+        continue ;
+      }
+
+      // Drop_Newest, or the writer thread itself is logging (would wait forever)
+      if (policy==Drop_Newest or is_writer())
+      {
+        __atomic_add_fetch(&dropped_counter, 1, __ATOMIC_RELAXED) ;
+        return ;
+      }
+
+      // Block_If_Full: the writer signals us as soon as it frees a slot
+      pthread_mutex_lock(&mutex) ;
+      __atomic_add_fetch(&producers_waiting, 1, __ATOMIC_SEQ_CST) ;
+      bool pushed = try_push(d, l, composed, r, data, size) ;
+      if (not pushed)
+      {
+        pthread_cond_signal(&wake_writer) ;
+        wait_for(&wake_producers, &mutex, 10) ;
+      }
+      __atomic_sub_fetch(&producers_waiting, 1, __ATOMIC_SEQ_CST) ;
+      pthread_mutex_unlock(&mutex) ;
+      if (pushed)
+        break ;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST) ;
+    if (__atomic_load_n(&writer_sleeping, __ATOMIC_RELAXED))
+    {
+      pthread_mutex_lock(&mutex) ;
+      pthread_cond_signal(&wake_writer) ;
+      pthread_mutex_unlock(&mutex) ;
+    }
+  }
+
+  void async_queue_t::run()
+  {
+    for(;;)
+    {
+      if (try_pop(true))
+        continue ;
+
+      pthread_mutex_lock(&mutex) ;
+      __atomic_store_n(&writer_sleeping, 1, __ATOMIC_SEQ_CST) ;
+      __atomic_thread_fence(__ATOMIC_SEQ_CST) ;
+      unsigned long pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED) ;
+      bool empty = __atomic_load_n(&slots[pos & mask].sequence, __ATOMIC_ACQUIRE) != pos+1 ;
+      if (empty and not stopping)
+        wait_for(&wake_writer, &mutex, 1000) ;
+      __atomic_store_n(&writer_sleeping, 0, __ATOMIC_SEQ_CST) ;
+      bool exit = empty and stopping ;
+      pthread_mutex_unlock(&mutex) ;
+      if (exit)
+        return ;
+    }
+  }
+
+  void async_queue_t::flush()
+  {
+    if (is_writer())
+      return ;
+    unsigned long target = __atomic_load_n(&enqueue_pos, __ATOMIC_SEQ_CST) ;
+    pthread_mutex_lock(&mutex) ;
+    __atomic_add_fetch(&producers_waiting, 1, __ATOMIC_SEQ_CST) ;
+    while ((long) (__atomic_load_n(&processed, __ATOMIC_SEQ_CST) - target) < 0)
+    {
+      pthread_cond_signal(&wake_writer) ;
+      wait_for(&wake_producers, &mutex, 10) ;
+    }
+    __atomic_sub_fetch(&producers_waiting, 1, __ATOMIC_SEQ_CST) ;
+    pthread_mutex_unlock(&mutex) ;
+  }
+
+  unsigned long async_queue_t::dropped()
+  {
+    return __atomic_load_n(&dropped_counter, __ATOMIC_RELAXED) ;
+  }
+}
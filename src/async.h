@@ -0,0 +1,93 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+
+// Internal header, not installed: the queue behind dispatcher_t::set_async()
+
+#ifndef LIBQMLOG_ASYNC_H
+#define LIBQMLOG_ASYNC_H
+
+#include <pthread.h>
+
+#include "api2.h"
+#include "record.h"
+
+namespace qmlog
+{
+  // Bounded ring buffer (D. Vyukov's sequence-per-slot queue):
+  // producers are the logging threads, the consumer is the writer thread.
+  // A producer may also consume a slot, that's how Drop_Oldest works.
+  // A slot holds either a message composed for one log, or a record
+  // (message with captured arguments) for one log or for all the logs.
+  class async_queue_t
+  {
+    enum { inline_size = 240 } ;
+    struct slot_t
+    {
+      unsigned long sequence ;
+      dispatcher_t *dispatcher ;
+      abstract_log_t *log ; // NULL for a record to be composed for all logs
+      bool composed ; // 'data' is the text for 'log'
+      record_t record ; // only the level is used for a composed message
+      unsigned size ;
+      char *data ; // text or arguments: either inline_data or a heap copy
+      char inline_data[inline_size] ;
+    } ;
+
+    slot_t *slots ;
+    unsigned long mask ;
+    int policy ;
+    bool defer ;
+
+    unsigned long enqueue_pos ;
+    unsigned long dequeue_pos ;
+    unsigned long processed, dropped_counter ;
+
+    pthread_t writer ;
+    pthread_mutex_t mutex ;
+    pthread_cond_t wake_writer, wake_producers ;
+    int writer_sleeping, producers_waiting ;
+    bool stopping ;
+
+    bool try_push(dispatcher_t *d, abstract_log_t *l, bool composed, const record_t &r, const char *data, unsigned size) ;
+    void push(dispatcher_t *d, abstract_log_t *l, bool composed, const record_t &r, const char *data, unsigned size) ;
+    bool try_pop(bool deliver) ;
+    void done(unsigned long count) ;
+    void run() ;
+    void start_writer() ;
+    static void *thread_main(void *) ;
+  public:
+    async_queue_t(unsigned capacity, int overflow_policy, bool defer_formatting) ;
+   ~async_queue_t() ;
+    void push(dispatcher_t *d, abstract_log_t *l, int level, const char *text) ;
+    void push(dispatcher_t *d, const record_t &r, const char *arguments, unsigned size) ;
+    void push(dispatcher_t *d, abstract_log_t *l, const record_t &r, const char *arguments, unsigned size) ;
+    bool deferred() { return defer ; }
+    void flush() ;
+    unsigned long dropped() ;
+    bool is_writer() ;
+    // The writer thread stays in the parent, which writes what was queued
+    // before fork(): the child drops it and starts a writer of its own.
+    void after_fork_in_child() ;
+  } ;
+}
+
+#endif // LIBQMLOG_ASYNC_H
@@ -0,0 +1,543 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+#include <map>
+using namespace std ;
+
+#include "api2.h"
+#include "thread.h"
+#include "record.h"
+
+/*
+ * The binary log is a sequence of records, each of them is
+ *
+ *   u32 size of the rest (little endian), u8 type, payload
+ *
+ * Unsigned numbers in the payload are LEB128 varints, signed ones are
+ * zigzag encoded first, strings are a varint length followed by the bytes.
+ *
+ *  'H' header, starting each writing session (a new string table):
+ *      "QMLOGBIN", u8 version, u8 sizeof(void*), u8 sizeof(long double),
+ *      u8 1 on little endian machines, fields of the log,
+ *      TZ to be used for decoding (empty: unknown), the timezone symlink
+ *  'S' string: id (counting from 1 in each session), then the characters up
+ *      to the end of the record
+ *  'M' message: u64 monotonic ns, u64 wall clock ns (both little endian),
+ *      level, pid, ids of the process name, signed line, ids of the file,
+ *      function and format (0 for NULL), then the arguments up to the end
+ *      of the record as captured by capture_arguments(), or the text, if
+ *      the format is NULL.
+ *  'C' call site: id (unique in the writing process, see site_t), level,
+ *      signed line, ids of the file and function
+ *  'L' message logged at a call site: the same as 'M', but the id of the
+ *      site instead of the line, file and function
+ *
+ * The captured arguments are in the native format of the writing machine,
+ * so a file is only decoded on the same kind of machine.
+ */
+
+namespace qmlog
+{
+  static const char magic[] = "QMLOGBIN" ;
+  static const unsigned magic_len = sizeof(magic) - 1 ;
+  static const int version = 2 ; // 1 had no call sites
+
+  typedef smart_buffer<1024> binary_buffer ;
+
+  static void put_u8(binary_buffer &b, unsigned value)
+  {
+    unsigned char c = value ;
+    b.append(&c, 1) ;
+  }
+
+  static void put_u64(binary_buffer &b, uint64_t value)
+  {
+    unsigned char c[8] ;
+    for (int i=0; i<8; ++i, value >>= 8)
+      c[i] = value & 0xFF ;
+    b.append(c, 8) ;
+  }
+
+  static void put_varint(binary_buffer &b, uint64_t value)
+  {
+    unsigned char c[10] ;
+    unsigned n = 0 ;
+    for (; value >= 0x80; value >>= 7)
+      c[n++] = (value & 0x7F) | 0x80 ;
+    c[n++] = value ;
+    b.append(c, n) ;
+  }
+
+  static void put_signed(binary_buffer &b, int64_t value)
+  {
+    put_varint(b, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63)) ;
+  }
+
+  static void put_string(binary_buffer &b, const string &s)
+  {
+    put_varint(b, s.size()) ;
+    b.append(s.data(), s.size()) ;
+  }
+
+  // returns the position of the size, which is set by end_record()
+  static unsigned begin_record(binary_buffer &b, char type)
+  {
+    unsigned start = b.position() ;
+    b.append("\0\0\0\0", 4) ;
+    put_u8(b, type) ;
+    return start ;
+  }
+
+  static void end_record(binary_buffer &b, unsigned start)
+  {
+    uint32_t size = b.position() - start - 4 ;
+    for (int i=0; i<4; ++i, size >>= 8)
+      b.p[start+i] = size & 0xFF ;
+  }
+
+  // What the decoder should set TZ to, to get the same local time
+  static string current_timezone()
+  {
+    if (const char *tz = getenv("TZ"))
+      return tz ;
+    smart_buffer<256> link ;
+    if (link.readlink("/etc/localtime")<0)
+      return "" ;
+    const char *zone = strstr(link.c_str(), "zoneinfo/") ;
+    if (zone)
+      return string(":") + (zone + strlen("zoneinfo/")) ;
+    if (link.c_str()[0]=='/')
+      return string(":") + link.c_str() ;
+    return "" ; // relative to /etc, but not in a zoneinfo directory
+  }
+
+  log_binary_file::log_binary_file(const char *path, int maximal_log_level, dispatcher_t *d)
+    : abstract_log_t(maximal_log_level), file_path(path)
+  {
+    fd = -1 ;
+    failed = inherited = false ;
+    last_id = 0 ;
+    takes_records = true ;
+    attach_to(d) ;
+  }
+
+  log_binary_file::~log_binary_file()
+  {
+    detach_all() ;
+    if (fd>=0)
+      ::close(fd) ;
+  }
+
+  bool log_binary_file::open()
+  {
+    if (fd>=0)
+      return true ;
+    if (inherited)
+      return false ;
+    if (failed and not (fields & Retry_If_Failed))
+      return false ;
+    int open_flags = O_WRONLY | O_APPEND | (fields & Dont_Create_File ? 0 : O_CREAT) ;
+    fd = ::open(file_path.c_str(), open_flags, 0666) ;
+    failed = fd<0 ;
+    if (failed)
+      return false ;
+
+    // a new session: the strings are written again
+    strings.clear() ;
+    last_id = 0 ;
+    sites.clear() ;
+    const uint16_t one = 1 ;
+    unsigned start = begin_record(buf, 'H') ;
+    buf.append(magic, magic_len) ;
+    put_u8(buf, version) ;
+    put_u8(buf, sizeof(void*)) ;
+    put_u8(buf, sizeof(long double)) ;
+    put_u8(buf, *(const unsigned char *)&one) ;
+    put_varint(buf, fields) ;
+    put_string(buf, current_timezone()) ;
+    put_string(buf, thread_state()->str_tz_symlink()) ;
+    end_record(buf, start) ;
+    return true ;
+  }
+
+  // The parent goes on with its session, the records of another one in
+  // between would make it undecodable
+  void log_binary_file::after_fork_in_child()
+  {
+    if (fd>=0)
+      ::close(fd) ;
+    fd = -1 ;
+    inherited = true ;
+    abstract_log_t::after_fork_in_child() ;
+  }
+
+  unsigned log_binary_file::intern(const char *s)
+  {
+    if (s==NULL)
+      return 0 ;
+    interned_t &entry = strings[s] ;
+    if (entry.id==0 or entry.value!=s)
+    {
+      entry.id = ++last_id ;
+      entry.value = s ;
+      unsigned start = begin_record(buf, 'S') ;
+      put_varint(buf, entry.id) ;
+      buf.append(s, entry.value.size()) ;
+      end_record(buf, start) ;
+    }
+    return entry.id ;
+  }
+
+  void log_binary_file::define_site(const site_t *site)
+  {
+    if (site->id < sites.size() and sites[site->id])
+      return ;
+    unsigned file = intern(site->file), func = intern(site->func) ;
+    unsigned start = begin_record(buf, 'C') ;
+    put_varint(buf, site->id) ;
+    put_varint(buf, site->level) ;
+    put_signed(buf, site->line) ;
+    put_varint(buf, file) ;
+    put_varint(buf, func) ;
+    end_record(buf, start) ;
+    if (site->id >= sites.size())
+      sites.resize(site->id+1) ;
+    sites[site->id] = true ;
+  }
+
+  void log_binary_file::submit_record(dispatcher_t *d, const record_t &r, const char *arguments, unsigned size)
+  {
+    buf.rewind() ;
+    if (not open())
+      return ;
+
+    unsigned name = intern(d->str_name()) ;
+    unsigned file = 0, func = 0, fmt = intern(r.fmt) ;
+    if (r.site)
+      define_site(r.site) ;
+    else
+      file = intern(r.file), func = intern(r.func) ;
+
+    unsigned start = begin_record(buf, r.site ? 'L' : 'M') ;
+    put_u64(buf, r.monotonic_timestamp.tv_sec * (uint64_t)1000000000 + r.monotonic_timestamp.tv_nsec) ;
+    put_u64(buf, r.timestamp.tv_sec * (uint64_t)1000000000 + r.timestamp.tv_usec * (uint64_t)1000) ;
+    put_varint(buf, r.level) ;
+    put_varint(buf, current_pid()) ;
+    put_varint(buf, name) ;
+    if (r.site)
+      put_varint(buf, r.site->id) ;
+    else
+    {
+      put_signed(buf, r.line) ;
+      put_varint(buf, file) ;
+      put_varint(buf, func) ;
+    }
+    put_varint(buf, fmt) ;
+    buf.append(arguments, size) ;
+    end_record(buf, start) ;
+
+    // one write() per message: O_APPEND keeps the records in one piece
+    const char *p = buf.c_str() ;
+    off_t first = -1, end = -1 ; // of the part written, only known after a short write
+    bool in_one_piece = true ;
+    for (unsigned left = buf.position(); left > 0; )
+    {
+      ssize_t res = ::write(fd, p, left) ;
+      if (res<0 and errno==EINTR)
+        continue ;
+      if (res<=0)
+      {
+        // The strings and sites may be lost: the next message starts a new
+        // session. The part of the record written is taken back, a torn
+        // record would make the rest of the file undecodable; unless
+        // another writer appended after it, its data would be cut instead.
+        struct stat st ;
+        if (first>=0 and in_one_piece and fstat(fd, &st)==0 and st.st_size==end)
+        {
+          if (ftruncate(fd, first) < 0) { /* ignored: closed anyway */ }
+        }
+        ::close(fd) ;
+        fd = -1 ;
+        return ;
+      }
+      if ((unsigned)res < left)
+      {
+        off_t at = lseek(fd, 0, SEEK_CUR) ;
+        if (first<0)
+          first = at - res ;
+        else if (at - res != end)
+          in_one_piece = false ;
+        end = at ;
+      }
+      p += res, left -= res ;
+    }
+  }
+
+  void log_binary_file::submit_message(dispatcher_t *d, int level, const char *message)
+  {
+    // composed by someone else: stored as a text
+    thread_state_t *state = thread_state() ;
+    state->get_timestamp() ;
+    record_t r ;
+    r.level = level, r.line = -1, r.file = r.func = r.fmt = NULL ;
+    r.site = NULL ;
+    r.monotonic_timestamp = state->monotonic_timestamp ;
+    r.timestamp = state->timestamp ;
+    submit_record(d, r, message, strlen(message)) ;
+  }
+
+  // Reads the payload of one record, 'ok' turns false if it's too short
+  struct binary_reader_t
+  {
+    const unsigned char *p, *end ;
+    bool ok ;
+
+    binary_reader_t(const char *data, unsigned size)
+      : p((const unsigned char *)data), end(p+size), ok(true) { }
+
+    unsigned u8()
+    {
+      if (p<end)
+        return *p++ ;
+      ok = false ;
+      return 0 ;
+    }
+
+    uint64_t u64()
+    {
+      uint64_t value = 0 ;
+      for (int i=0; i<8; ++i)
+        value |= (uint64_t) u8() << (8*i) ;
+      return value ;
+    }
+
+    uint64_t varint()
+    {
+      uint64_t value = 0 ;
+      for (int shift=0; ok and shift<64; shift+=7)
+      {
+        unsigned c = u8() ;
+        value |= (uint64_t)(c & 0x7F) << shift ;
+        if ((c & 0x80) == 0)
+          break ;
+      }
+      return value ;
+    }
+
+    int64_t signed_varint()
+    {
+      uint64_t value = varint() ;
+      return (int64_t)(value >> 1) ^ -(int64_t)(value & 1) ;
+    }
+
+    string str()
+    {
+      uint64_t len = varint() ;
+      if (len > (uint64_t)(end-p))
+        ok = false ;
+      if (not ok)
+        return "" ;
+      string s((const char *)p, len) ;
+      p += len ;
+      return s ;
+    }
+  } ;
+
+  // A call site as read from a 'C' record
+  struct site_entry_t
+  {
+    int line ;
+    uint64_t file, func ; // ids of the strings
+  } ;
+
+  bool log_binary_file::decode(FILE *in, FILE *out, int fields)
+  {
+    dispatcher_t d ;
+    log_file text(out, qmlog::Full, &d) ;
+    thread_state_t *state = thread_state() ;
+
+    const char *old_tz = getenv("TZ") ;
+    string saved_tz = old_tz ? old_tz : "" ;
+
+    vector<string> table ; // index is the id
+    map<uint64_t, site_entry_t> site_table ;
+    unsigned current_name = 0 ;
+    string tz_symlink ;
+    bool header = false, ok = true ;
+    vector<char> data ;
+    for (;;)
+    {
+      unsigned char size_bytes[4] ;
+      size_t n = fread(size_bytes, 1, 4, in) ;
+      if (n==0 and feof(in))
+        break ;
+      uint32_t size = size_bytes[0] | size_bytes[1]<<8 | size_bytes[2]<<16 | (uint32_t)size_bytes[3]<<24 ;
+      if (n<4 or size==0)
+      {
+        ok = false ; // cut by a crash or not a binary log
+        break ;
+      }
+      data.resize(size) ;
+      if (fread(&data[0], 1, size, in) < size)
+      {
+        ok = false ;
+        break ;
+      }
+
+      binary_reader_t r(&data[0], size) ;
+      char type = r.u8() ;
+      if (type=='H')
+      {
+        const uint16_t one = 1 ;
+        bool native = size > magic_len and memcmp(r.p, magic, magic_len)==0 ;
+        r.p += native ? magic_len : 0 ;
+        unsigned written_version = r.u8() ;
+        native = native and 1<=written_version and written_version<=(unsigned)version ;
+        native = native and r.u8()==sizeof(void*) ;
+        native = native and r.u8()==sizeof(long double) ;
+        native = native and r.u8()==*(const unsigned char *)&one ;
+        int written_fields = r.varint() ;
+        string tz = r.str() ;
+        tz_symlink = r.str() ;
+        if (not native or not r.ok)
+        {
+          ok = false ;
+          break ;
+        }
+        text.set_fields(fields<0 ? written_fields & All_Fields : fields) ;
+        if (not tz.empty())
+          setenv("TZ", tz.c_str(), 1) ;
+        else if (old_tz)
+          setenv("TZ", saved_tz.c_str(), 1) ;
+        else
+          unsetenv("TZ") ;
+        state->forget_localtime() ;
+        table.assign(1, string()) ;
+        site_table.clear() ;
+        current_name = 0 ;
+        header = true ;
+      }
+      else if (not header) // not a binary log at all
+      {
+        ok = false ;
+        break ;
+      }
+      else if (type=='S')
+      {
+        uint64_t id = r.varint() ;
+        if (not r.ok or id!=table.size())
+        {
+          ok = false ;
+          break ;
+        }
+        table.push_back(string((const char *)r.p, r.end-r.p)) ;
+      }
+      else if (type=='C')
+      {
+        uint64_t id = r.varint() ;
+        r.varint() ; // the level, the messages have their own
+        site_entry_t entry ;
+        entry.line = r.signed_varint() ;
+        entry.file = r.varint() ;
+        entry.func = r.varint() ;
+        if (not r.ok or entry.file>=table.size() or entry.func>=table.size())
+        {
+          ok = false ;
+          break ;
+        }
+        site_table[id] = entry ;
+      }
+      else if (type=='M' or type=='L')
+      {
+        record_t rec ;
+        uint64_t mono = r.u64(), wall = r.u64() ;
+        rec.monotonic_timestamp.tv_sec = mono / 1000000000 ;
+        rec.monotonic_timestamp.tv_nsec = mono % 1000000000 ;
+        rec.timestamp.tv_sec = wall / 1000000000 ;
+        rec.timestamp.tv_usec = wall % 1000000000 / 1000 ;
+        rec.level = r.varint() ;
+        pid_t pid = r.varint() ;
+        uint64_t ids[4] = { 0, 0, 0, 0 } ; // name, file, func, format
+        ids[0] = r.varint() ;
+        if (type=='L')
+        {
+          map<uint64_t, site_entry_t>::const_iterator site = site_table.find(r.varint()) ;
+          r.ok = r.ok and site!=site_table.end() ;
+          if (r.ok)
+          {
+            rec.line = site->second.line ;
+            ids[1] = site->second.file ;
+            ids[2] = site->second.func ;
+          }
+        }
+        else
+        {
+          rec.line = r.signed_varint() ;
+          ids[1] = r.varint() ;
+          ids[2] = r.varint() ;
+        }
+        ids[3] = r.varint() ;
+        for (int i=0; i<4; ++i)
+          r.ok = r.ok and ids[i] < table.size() ;
+        if (not r.ok)
+        {
+          ok = false ;
+          break ;
+        }
+        rec.file = ids[1] ? table[ids[1]].c_str() : NULL ;
+        rec.func = ids[2] ? table[ids[2]].c_str() : NULL ;
+        rec.fmt = ids[3] ? table[ids[3]].c_str() : NULL ;
+        rec.site = NULL ;
+
+        if (ids[0]!=current_name)
+        {
+          d.set_process_name(table[ids[0]]) ;
+          current_name = ids[0] ;
+        }
+        state->foreign_pid = pid ;
+        state->foreign_tz_symlink = tz_symlink.c_str() ;
+        d.replay(rec, (const char *)r.p, r.end-r.p) ;
+      }
+      // unknown record types are skipped: written by a newer version
+    }
+
+    state->foreign_pid = (pid_t) 0 ;
+    state->foreign_tz_symlink = NULL ;
+    if (old_tz)
+      setenv("TZ", saved_tz.c_str(), 1) ;
+    else
+      unsetenv("TZ") ;
+    state->forget_localtime() ;
+    return ok ;
+  }
+}
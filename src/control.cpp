@@ -0,0 +1,385 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <sys/inotify.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <limits.h>
+#include <errno.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+#include <set>
+using namespace std ;
+
+#include "control.h"
+#include "thread.h"
+#include "site.h"
+
+namespace qmlog
+{
+  static pthread_mutex_t control_mutex = PTHREAD_MUTEX_INITIALIZER ; // the watcher of qmlog::object
+
+  bool control_watcher_t::restart_pending = false ;
+
+  void object_t::set_control_file(const char *path)
+  {
+    pthread_mutex_lock(&control_mutex) ;
+    __atomic_store_n(&control_watcher_t::restart_pending, false, __ATOMIC_RELAXED) ;
+    delete control_watcher ;
+    control_watcher = path and *path ? new control_watcher_t(path) : NULL ;
+    pthread_mutex_unlock(&control_mutex) ;
+  }
+
+  void control_watcher_t::before_fork()
+  {
+    pthread_mutex_lock(&control_mutex) ;
+  }
+
+  void control_watcher_t::after_fork_in_parent()
+  {
+    pthread_mutex_unlock(&control_mutex) ;
+  }
+
+  // The thread and the inotify descriptor are the parent's: the copy of
+  // the watcher is left without them until the child logs something
+  void control_watcher_t::after_fork_in_child()
+  {
+    if (control_watcher_t *w = object.control_watcher)
+    {
+      w->started = false ; // nothing to stop or to wait for
+      __atomic_store_n(&restart_pending, true, __ATOMIC_RELAXED) ;
+    }
+    pthread_mutex_unlock(&control_mutex) ;
+  }
+
+  void control_watcher_t::restart()
+  {
+    pthread_mutex_lock(&control_mutex) ;
+    if (__atomic_load_n(&restart_pending, __ATOMIC_RELAXED))
+    {
+      __atomic_store_n(&restart_pending, false, __ATOMIC_RELAXED) ; // apply() may log
+      control_watcher_t *w = object.control_watcher ;
+      string file = w->path ;
+      delete w ;
+      object.control_watcher = new control_watcher_t(file.c_str()) ;
+    }
+    pthread_mutex_unlock(&control_mutex) ;
+  }
+
+  // A "log" or "dispatcher" line of the control file
+  struct setting_t
+  {
+    enum { Dispatcher_Level, Log_Level, Log_Fields } what ;
+    string target ; // "default", "all", "stderr", "syslog" or a path
+    int value ;
+  } ;
+
+  static bool parse_fields(const char *text, int &fields)
+  {
+    static const struct { const char *name ; int value ; } names[] =
+    {
+      { "Multiline", Multiline }, { "Message", Message }, { "Line", Line },
+      { "Function", Function }, { "Pid", Pid }, { "Name", Name },
+      { "Monotonic", Monotonic }, { "Monotonic_Milli", Monotonic_Milli },
+      { "Monotonic_Micro", Monotonic_Micro }, { "Monotonic_Nano", Monotonic_Nano },
+      { "Date", Date }, { "Time", Time }, { "Time_Milli", Time_Milli },
+      { "Time_Micro", Time_Micro }, { "Timezone_Symlink", Timezone_Symlink },
+      { "Timezone_Abbreviation", Timezone_Abbreviation },
+      { "Timezone_Offset", Timezone_Offset }, { "Level", Level },
+      { "Log_Line", Log_Line }, { "Process_Block", Process_Block },
+      { "Location_Block", Location_Block }, { "All_Fields", All_Fields },
+    } ;
+    char *end ;
+    long number = strtol(text, &end, 0) ;
+    if (end!=text and *end=='\0')
+    {
+      fields = number & All_Fields ;
+      return true ;
+    }
+    fields = 0 ;
+    string list = text ;
+    for (string::size_type start = 0, bar; start <= list.size(); start = bar + 1)
+    {
+      bar = list.find('|', start) ;
+      if (bar==string::npos)
+        bar = list.size() ;
+      string name = list.substr(start, bar-start) ;
+      bool known = false ;
+      for (unsigned i=0; i<sizeof(names)/sizeof(*names) and not known; ++i)
+        if (name==names[i].name)
+          fields |= names[i].value, known = true ;
+      if (not known)
+        return false ;
+    }
+    return true ;
+  }
+
+  static bool parse_setting(char *const *words, int n, setting_t &s)
+  {
+    if (n==4 and strcmp(words[0], "dispatcher")==0 and strcmp(words[2], "level")==0)
+    {
+      s.what = setting_t::Dispatcher_Level ;
+      s.target = words[1] ;
+      return (s.target=="default" or s.target=="all") and parse_level(words[3], s.value) ;
+    }
+    if (n==4 and strcmp(words[0], "log")==0)
+    {
+      s.target = words[1] ;
+      if (strcmp(words[2], "level")==0)
+      {
+        s.what = setting_t::Log_Level ;
+        return parse_level(words[3], s.value) ;
+      }
+      if (strcmp(words[2], "fields")==0)
+      {
+        s.what = setting_t::Log_Fields ;
+        return parse_fields(words[3], s.value) ;
+      }
+    }
+    return false ;
+  }
+
+  static bool is_target(abstract_log_t *l, const string &target)
+  {
+    if (target=="all")
+      return true ;
+    if (target=="stderr")
+      return l==object.get_stderr_logger() ;
+    if (target=="syslog")
+      return l==object.get_syslog_logger() ;
+    const char *path = l->get_path() ;
+    return path and target==path ;
+  }
+
+  control_watcher_t::control_watcher_t(const char *file, bool watching) : path(file)
+  {
+    string::size_type slash = path.rfind('/') ;
+    directory = slash==string::npos ? "." : slash==0 ? "/" : path.substr(0, slash) ;
+    name = slash==string::npos ? path : path.substr(slash+1) ;
+    exists = false ;
+    owns_site_rules = false ;
+    changed() ;
+    apply() ;
+
+    wd = -1 ;
+    fd = stop_pipe[0] = stop_pipe[1] = -1 ;
+    started = false ;
+    if (not watching)
+      return ;
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC) ;
+    if (pipe2(stop_pipe, O_CLOEXEC)<0)
+    {
+      stop_pipe[0] = stop_pipe[1] = -1 ;
+      return ; // no live changes, the file was applied once
+    }
+    // signals are for the application threads
+    sigset_t all, old ;
+    sigfillset(&all) ;
+    pthread_sigmask(SIG_SETMASK, &all, &old) ;
+    started = pthread_create(&thread, NULL, thread_main, this)==0 ;
+    pthread_sigmask(SIG_SETMASK, &old, NULL) ;
+  }
+
+  void control_watcher_t::apply_once(const char *file)
+  {
+    control_watcher_t once(file, false) ;
+  }
+
+  control_watcher_t::~control_watcher_t()
+  {
+    if (started)
+    {
+      char stop = 0 ;
+      while (write(stop_pipe[1], &stop, 1)<0 and errno==EINTR)
+        ;
+      pthread_join(thread, NULL) ;
+    }
+    if (stop_pipe[0]>=0)
+      close(stop_pipe[0]), close(stop_pipe[1]) ;
+    if (fd>=0)
+      close(fd) ;
+  }
+
+  void *control_watcher_t::thread_main(void *self)
+  {
+    static_cast<control_watcher_t*>(self)->run() ;
+    return NULL ;
+  }
+
+  static string parent_of(const string &dir)
+  {
+    string::size_type slash = dir.rfind('/') ;
+    return slash==string::npos ? "." : slash==0 ? "/" : dir.substr(0, slash) ;
+  }
+
+  // Watches 'directory' or, while it's missing, the nearest existing one
+  // above it: the directories made on the way down are seen there, each
+  // one is watched in turn. Polling is left for inotify failing otherwise.
+  void control_watcher_t::watch()
+  {
+    if (fd<0 or (wd>=0 and watched==directory))
+      return ;
+    if (wd>=0)
+      inotify_rm_watch(fd, wd), wd = -1 ;
+    int events = IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF ;
+    int creation = IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF ;
+    for (string dir = directory, below; wd<0; )
+    {
+      wd = inotify_add_watch(fd, dir.c_str(), (dir==directory ? events : creation) | IN_ONLYDIR) ;
+      if (wd<0 and (errno!=ENOENT or dir=="/" or dir=="."))
+        break ;
+      if (wd<0)
+        below = dir, dir = parent_of(dir) ;
+      else if (not below.empty() and access(below.c_str(), F_OK)==0) // made before the watch
+        inotify_rm_watch(fd, wd), wd = -1, dir = directory, below.clear() ;
+      else
+        watched = dir ;
+    }
+    if (wd>=0 and changed()) // made before the watch
+      apply() ;
+  }
+
+  void control_watcher_t::run()
+  {
+    for (;;)
+    {
+      watch() ;
+      struct pollfd fds[2] ;
+      fds[0].fd = stop_pipe[0], fds[0].events = POLLIN ;
+      fds[1].fd = fd, fds[1].events = POLLIN ;
+      int n = poll(fds, fd>=0 ? 2 : 1, wd>=0 ? -1 : 1000) ;
+      if (n<0 and errno!=EINTR)
+        return ; // can't wait for anything
+      if (n>0 and fds[0].revents)
+        return ;
+
+      char events[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event)))) ;
+      bool relevant = wd<0 ; // polling
+      for (ssize_t len; fd>=0 and (len = read(fd, events, sizeof(events))) > 0; )
+      {
+        for (char *p = events; p < events + len; )
+        {
+          const struct inotify_event *e = (const struct inotify_event *) p ;
+          if (e->wd==wd and watched!=directory) // something made above: look again
+            inotify_rm_watch(fd, wd), wd = -1 ;
+          else if (e->wd==wd and e->mask & IN_IGNORED) // the directory is gone
+            wd = -1 ;
+          if (e->mask & (IN_Q_OVERFLOW | IN_IGNORED) or e->len==0 or name==e->name)
+            relevant = true ;
+          p += sizeof(struct inotify_event) + e->len ;
+        }
+      }
+      if (relevant and changed())
+        apply() ;
+    }
+  }
+
+  bool control_watcher_t::changed()
+  {
+    struct stat st ;
+    bool now_exists = stat(path.c_str(), &st)==0 ;
+    bool same = now_exists==exists and (not exists or
+      (st.st_dev==last_stat.st_dev and st.st_ino==last_stat.st_ino and st.st_size==last_stat.st_size and
+       st.st_mtim.tv_sec==last_stat.st_mtim.tv_sec and st.st_mtim.tv_nsec==last_stat.st_mtim.tv_nsec and
+       st.st_ctim.tv_sec==last_stat.st_ctim.tv_sec and st.st_ctim.tv_nsec==last_stat.st_ctim.tv_nsec)) ;
+    exists = now_exists ;
+    last_stat = st ;
+    return not same ;
+  }
+
+  void control_watcher_t::apply()
+  {
+    if (not exists)
+    {
+      object.enable(false) ;
+      return ;
+    }
+
+    // everything is read first, the changes are made at once
+    bool enabled = true ;
+    vector<setting_t> settings ;
+    vector<site_rule_t> *rules = new vector<site_rule_t> ;
+    vector<int> bad_lines ;
+    if (FILE *fp = fopen(path.c_str(), "r"))
+    {
+      char line[1024] ;
+      for (int number = 1; fgets(line, sizeof(line), fp); ++number)
+      {
+        char *words[5] ;
+        int n = split_words(line, words, 5) ;
+        setting_t s ;
+        site_rule_t r ;
+        if (n==0)
+          continue ;
+        else if (n==2 and strcmp(words[0], "enabled")==0 and (strcmp(words[1], "yes")==0 or strcmp(words[1], "no")==0))
+          enabled = strcmp(words[1], "yes")==0 ;
+        else if (parse_setting(words, n, s))
+          settings.push_back(s) ;
+        else if (parse_site_rule(words, n, r))
+          rules->push_back(r) ;
+        else
+          bad_lines.push_back(number) ;
+      }
+      fclose(fp) ;
+    }
+
+    {
+      config_lock_t lock ;
+      for (vector<setting_t>::const_iterator s = settings.begin(); s != settings.end(); ++s)
+      {
+        for (set<dispatcher_t*>::const_iterator d = object.dispatchers.begin(); d != object.dispatchers.end(); ++d)
+        {
+          if (s->what==setting_t::Dispatcher_Level)
+          {
+            if (s->target=="all" or *d==object.get_default_dispatcher())
+              (*d)->log_level(s->value) ;
+            continue ;
+          }
+          for (set<abstract_log_t*>::const_iterator l = (*d)->logs.begin(); l != (*d)->logs.end(); ++l)
+          {
+            if (not is_target(*l, s->target))
+              continue ;
+            if (s->what==setting_t::Log_Level)
+              (*l)->log_level(s->value) ;
+            else
+              (*l)->set_fields(((*l)->get_fields() & ~All_Fields) | s->value) ;
+          }
+        }
+      }
+      bool has_rules = not rules->empty() ;
+      if (has_rules or owns_site_rules)
+        replace_site_rules(has_rules ? rules : NULL), rules = NULL ;
+      owns_site_rules = has_rules ;
+      object.enable(enabled) ;
+    }
+    delete rules ;
+
+    for (vector<int>::const_iterator n = bad_lines.begin(); n != bad_lines.end(); ++n)
+      log_warning("%s:%d: not understood, ignored", path.c_str(), *n) ;
+  }
+}
@@ -0,0 +1,86 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+
+// Internal header, not installed: the control file of a running process
+
+#ifndef LIBQMLOG_CONTROL_H
+#define LIBQMLOG_CONTROL_H
+
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include <string>
+
+#include "api2.h"
+
+namespace qmlog
+{
+  // Owned by qmlog::object, see object_t::set_control_file(). A thread of
+  // its own sleeps until inotify reports a change in the directory of the
+  // file; while the directory is missing, the nearest existing one above
+  // it is watched for its creation. The new settings are applied under the
+  // configuration lock, the logging threads keep reading them without any
+  // lock.
+  class control_watcher_t
+  {
+    const std::string path ;
+    std::string directory, name ;
+    std::string watched ; // 'directory' or the one above it watched instead
+    int fd ; // inotify descriptor
+    int wd ; // watch of 'watched', -1 if none
+    int stop_pipe[2] ;
+    pthread_t thread ;
+    bool started ;
+    bool exists ;
+    struct stat last_stat ;
+    bool owns_site_rules ; // the file had some
+
+    bool changed() ;
+    void apply() ;
+    void watch() ;
+    void run() ;
+    static void *thread_main(void *self) ;
+    static bool restart_pending ;
+    friend class object_t ; // set_control_file() drops a pending restart
+    static void restart() ;
+  public:
+    // The file is applied at once, then again with each change if 'watching'
+    control_watcher_t(const char *path, bool watching=true) ;
+   ~control_watcher_t() ;
+    static void apply_once(const char *path) ;
+
+    // The watcher of qmlog::object is not replaced during fork(). Its
+    // thread stays in the parent, the child gets a new watcher of the same
+    // file with its first message: start_in_child() is called by each one.
+    // A child calling exec() soon doesn't start a thread for nothing.
+    static void before_fork() ;
+    static void after_fork_in_parent() ;
+    static void after_fork_in_child() ;
+    static void start_in_child()
+    {
+      if (__builtin_expect(__atomic_load_n(&restart_pending, __ATOMIC_RELAXED), false))
+        restart() ;
+    }
+  } ;
+}
+
+#endif // LIBQMLOG_CONTROL_H
@@ -0,0 +1,353 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include <string>
+#include <algorithm>
+using namespace std ;
+
+#include "api2.h"
+#include "thread.h"
+#include "record.h"
+#include "layout.h"
+
+/*
+ * The records are stored one after another in a ring of 'size' bytes and
+ * may wrap around its end: a flight_entry_t, the format, the file and the
+ * function (each with its '\0', or nothing if NULL), the captured
+ * arguments (or the text, without a format), zeros up to 8 bytes. 'tail'
+ * is moved past the oldest records before they are overwritten, 'head'
+ * after a record is complete: a dump, even by a signal handler
+ * interrupting submit_record(), only sees complete records.
+ */
+
+namespace qmlog
+{
+  struct flight_entry_t
+  {
+    uint32_t length ; // of the whole entry
+    int32_t level, line ;
+    uint32_t fmt, file, func, arguments ; // bytes
+    struct timeval timestamp ;
+  } ;
+
+  static const unsigned max_recorders = 8 ;
+  static log_flight_recorder *recorders[max_recorders] ; // read by fatal_signal()
+
+  static const int fatal_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT } ;
+  static const unsigned fatal_count = sizeof(fatal_signals) / sizeof(*fatal_signals) ;
+  static struct sigaction previous_actions[fatal_count] ;
+  static bool handlers_installed = false ;
+
+  static uint64_t padded(uint64_t length)
+  {
+    return (length + 7) & ~(uint64_t)7 ;
+  }
+
+  // room for 'bytes' more, so that appending doesn't allocate later
+  static void reserve(record_buffer &b, unsigned bytes)
+  {
+    while (b.len - b.pos <= bytes)
+      b.grow() ;
+  }
+
+  static void copy_in(char *data, unsigned size, uint64_t position, const void *from, unsigned length)
+  {
+    unsigned at = position & (size-1), first = min(length, size-at) ;
+    memcpy(data+at, from, first) ;
+    memcpy(data, (const char*)from+first, length-first) ;
+  }
+
+  static void copy_out(const char *data, unsigned size, uint64_t position, void *to, unsigned length)
+  {
+    unsigned at = position & (size-1), first = min(length, size-at) ;
+    memcpy(to, data+at, first) ;
+    memcpy((char*)to+first, data, length-first) ;
+  }
+
+  static void append_digits(record_buffer &out, unsigned long long value, int width)
+  {
+    char digits[24], *p = digits + sizeof(digits) ;
+    do
+      *--p = '0' + value % 10, --width ;
+    while ((value /= 10) or width>0) ;
+    append_capped(out, p, digits + sizeof(digits) - p) ;
+  }
+
+  static void append_text(record_buffer &out, const char *s)
+  {
+    append_capped(out, s, strlen(s)) ;
+  }
+
+  // "yyyy-mm-dd hh:mm:ss.uuuuuu UTC" without gmtime(), which may lock
+  static void append_utc(record_buffer &out, const struct timeval &t)
+  {
+    uint64_t seconds = t.tv_sec<0 ? 0 : t.tv_sec ;
+    uint64_t days = seconds / 86400 + 719468, second = seconds % 86400 ; // days since 0000-03-01
+    uint64_t era = days / 146097, day_of_era = days % 146097 ;
+    uint64_t year_of_era = (day_of_era - day_of_era/1460 + day_of_era/36524 - day_of_era/146096) / 365 ;
+    uint64_t day_of_year = day_of_era - (365*year_of_era + year_of_era/4 - year_of_era/100) ;
+    uint64_t m = (5*day_of_year + 2) / 153 ; // from March
+    uint64_t day = day_of_year - (153*m + 2)/5 + 1, month = m<10 ? m+3 : m-9 ;
+    uint64_t year = era*400 + year_of_era + (month<=2) ;
+    append_digits(out, year, 4) ;
+    append_text(out, "-") ;
+    append_digits(out, month, 2) ;
+    append_text(out, "-") ;
+    append_digits(out, day, 2) ;
+    append_text(out, " ") ;
+    append_digits(out, second/3600, 2) ;
+    append_text(out, ":") ;
+    append_digits(out, second/60%60, 2) ;
+    append_text(out, ":") ;
+    append_digits(out, second%60, 2) ;
+    append_text(out, ".") ;
+    append_digits(out, t.tv_usec, 6) ;
+    append_text(out, " UTC") ;
+  }
+
+  static void write_all(int fd, const char *p, unsigned length)
+  {
+    while (length>0)
+    {
+      ssize_t written = write(fd, p, length) ;
+      if (written<0 and errno==EINTR)
+        continue ;
+      if (written<=0)
+        return ;
+      p += written, length -= written ;
+    }
+  }
+
+  log_flight_recorder::log_flight_recorder(int maximal_log_level, dispatcher_t *d, unsigned bytes, const char *path)
+    : abstract_log_t(maximal_log_level)
+  {
+    for (size = 4096; size < bytes and size < (1u<<31); size <<= 1)
+      ;
+    data = new char[size] ;
+    head = tail = dumped = 0 ;
+    if (path)
+      dump_path = path ;
+    reserve(entry, size/2) ;
+    reserve(text, (64<<10) - 1) ; // a line of 64K with its '\0'
+    takes_records = true ;
+    {
+      config_lock_t lock ;
+      for (unsigned i=0; i<max_recorders; ++i)
+        if (recorders[i]==NULL)
+        {
+          __atomic_store_n(&recorders[i], this, __ATOMIC_RELEASE) ;
+          break ;
+        }
+    }
+    attach_to(d) ;
+  }
+
+  log_flight_recorder::~log_flight_recorder()
+  {
+    detach_all() ;
+    {
+      config_lock_t lock ;
+      for (unsigned i=0; i<max_recorders; ++i)
+        if (recorders[i]==this)
+          __atomic_store_n(&recorders[i], (log_flight_recorder*)NULL, __ATOMIC_RELEASE) ;
+    }
+    delete[] data ;
+  }
+
+  void log_flight_recorder::submit_record(dispatcher_t *, const record_t &r, const char *arguments, unsigned length)
+  {
+    flight_entry_t e ;
+    e.level = r.level ;
+    e.line = r.line ;
+    e.fmt = r.fmt ? strlen(r.fmt)+1 : 0 ;
+    e.file = r.file ? strlen(r.file)+1 : 0 ;
+    e.func = r.func ? strlen(r.func)+1 : 0 ;
+    e.arguments = length ;
+    e.timestamp = r.timestamp ;
+    uint64_t total = padded(sizeof(e) + e.fmt + e.file + e.func + e.arguments) ;
+    if (total > size/2) // not worth the older ones
+      return ;
+    e.length = total ;
+
+    uint64_t t = tail ;
+    while (head + total - t > size)
+    {
+      flight_entry_t old ;
+      copy_out(data, size, t, &old, sizeof(old)) ;
+      t += old.length ;
+    }
+    __atomic_store_n(&tail, t, __ATOMIC_RELEASE) ;
+    uint64_t at = head ;
+    copy_in(data, size, at, &e, sizeof(e)) ;
+    copy_in(data, size, at += sizeof(e), r.fmt, e.fmt) ;
+    copy_in(data, size, at += e.fmt, r.file, e.file) ;
+    copy_in(data, size, at += e.file, r.func, e.func) ;
+    copy_in(data, size, at += e.func, arguments, e.arguments) ;
+    __atomic_store_n(&head, head + total, __ATOMIC_RELEASE) ;
+  }
+
+  void log_flight_recorder::submit_message(dispatcher_t *d, int level, const char *message)
+  {
+    // composed by someone else: stored as a text
+    thread_state_t *state = thread_state() ;
+    state->get_timestamp() ;
+    record_t r ;
+    r.level = level, r.line = -1, r.file = r.func = r.fmt = NULL ;
+    r.site = NULL ;
+    r.monotonic_timestamp = state->monotonic_timestamp ;
+    r.timestamp = state->timestamp ;
+    submit_record(d, r, message, strlen(message)) ;
+  }
+
+  void log_flight_recorder::dump()
+  {
+    record_buffer entry_buffer, text_buffer ; // the dump may need more than a signal handler gets
+    pthread_mutex_lock(&mutex) ;
+    dump_unlocked(entry_buffer, text_buffer, false) ;
+    pthread_mutex_unlock(&mutex) ;
+  }
+
+  // In a signal handler ('in_signal') the other threads may go on writing:
+  // an entry overwritten while it was copied is skipped, one which makes no
+  // sense ends the dump. Nothing grows 'entry' and 'text' there, and only
+  // async-signal-safe calls are made.
+  void log_flight_recorder::dump_unlocked(record_buffer &entry, record_buffer &text, bool in_signal)
+  {
+    uint64_t to = __atomic_load_n(&head, __ATOMIC_ACQUIRE) ;
+    uint64_t from = max(__atomic_load_n(&tail, __ATOMIC_ACQUIRE), dumped) ;
+    if (from>=to)
+      return ;
+    dumped = to ;
+    int fd = dump_path.empty() ? 2 : ::open(dump_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644) ;
+    if (fd<0)
+      return ;
+
+    text.rewind() ;
+    append_text(text, "-- flight recorder of process ") ;
+    append_digits(text, current_pid(), 1) ;
+    append_text(text, ", oldest first --\n") ;
+    write_all(fd, text.c_str(), text.position()) ;
+    for (uint64_t position = from; position < to; )
+    {
+      flight_entry_t e ;
+      copy_out(data, size, position, &e, sizeof(e)) ;
+      bool sane = sizeof(e) <= e.length and e.length <= size/2 and position + e.length <= to ;
+      sane = sane and (uint64_t)e.fmt + e.file + e.func + e.arguments <= e.length - sizeof(e) ;
+      if (sane)
+      {
+        entry.rewind() ;
+        unsigned at = (position + sizeof(e)) & (size-1), rest = e.length - sizeof(e), first = min(rest, size-at) ;
+        entry.append(data+at, first) ; // has room for size/2: never grows
+        entry.append(data, rest-first) ;
+      }
+      __atomic_thread_fence(__ATOMIC_ACQUIRE) ;
+      uint64_t oldest = __atomic_load_n(&tail, __ATOMIC_ACQUIRE) ;
+      if (oldest > position) // overwritten meanwhile
+      {
+        position = oldest ;
+        continue ;
+      }
+      const char *fmt = entry.c_str(), *file = fmt + e.fmt, *func = file + e.file, *arguments = func + e.func ;
+      sane = sane and (e.fmt==0 or fmt[e.fmt-1]==0) and (e.file==0 or file[e.file-1]==0) and (e.func==0 or func[e.func-1]==0) ;
+      if (not sane)
+        break ;
+      position += e.length ;
+
+      text.rewind() ;
+      append_utc(text, e.timestamp) ;
+      append_text(text, " ") ;
+      append_text(text, dispatcher_t::str_level(e.level)) ;
+      if (e.line>0 and e.file)
+      {
+        append_text(text, " at ") ;
+        append_text(text, file) ;
+        append_text(text, ":") ;
+        append_digits(text, e.line, 1) ;
+      }
+      if (e.func)
+      {
+        append_text(text, " in ") ;
+        append_text(text, func) ;
+      }
+      append_text(text, ": ") ;
+      if (not e.fmt)
+        append_capped(text, arguments, e.arguments) ;
+      else if (in_signal)
+        format_arguments_safely(text, fmt, arguments, e.arguments) ;
+      else
+        format_arguments(text, fmt, arguments, e.arguments) ;
+      if (in_signal and text.len - text.pos <= 1) // cut
+        text.rewind(text.pos-1) ;
+      text.append("\n", 1) ;
+      write_all(fd, text.c_str(), text.position()) ;
+    }
+    if (fd!=2)
+      ::close(fd) ;
+  }
+
+  void log_flight_recorder::dump_all()
+  {
+    config_lock_t lock ;
+    for (unsigned i=0; i<max_recorders; ++i)
+      if (recorders[i])
+        recorders[i]->dump() ;
+  }
+
+  // The thread may have been anywhere, even in submit_record() of a
+  // recorder: no locks. Returning makes the signal come again with the
+  // previous action, or raise() does it for the signals sent.
+  void log_flight_recorder::fatal_signal(int signal)
+  {
+    int saved = errno ;
+    for (unsigned i=0; i<max_recorders; ++i)
+      if (log_flight_recorder *r = __atomic_load_n(&recorders[i], __ATOMIC_ACQUIRE))
+        r->dump_unlocked(r->entry, r->text, true) ;
+    for (unsigned i=0; i<fatal_count; ++i)
+      if (fatal_signals[i]==signal)
+        sigaction(signal, &previous_actions[i], NULL) ;
+    errno = saved ;
+    raise(signal) ; // blocked until the handler returns
+  }
+
+  void log_flight_recorder::dump_on_fatal_signals()
+  {
+    config_lock_t lock ;
+    if (handlers_installed)
+      return ;
+    handlers_installed = true ;
+    struct sigaction action ;
+    memset(&action, 0, sizeof(action)) ;
+    action.sa_handler = fatal_signal ;
+    sigemptyset(&action.sa_mask) ;
+    for (unsigned i=0; i<fatal_count; ++i)
+      sigaction(fatal_signals[i], &action, &previous_actions[i]) ;
+  }
+}
@@ -0,0 +1,152 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <pthread.h>
+#include <signal.h>
+
+#include <map>
+using namespace std ;
+
+#include "flush.h"
+
+namespace qmlog
+{
+  static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER ;
+  static pthread_cond_t timer_cond ; // on CLOCK_MONOTONIC, made by init_cond()
+  static pthread_once_t cond_once = PTHREAD_ONCE_INIT ;
+  static map<abstract_log_t*, struct timespec> deadlines ;
+  static abstract_log_t *flushing = NULL ; // by the thread, 'timer_mutex' unlocked
+  static bool started = false ;
+
+  static void init_cond()
+  {
+    pthread_condattr_t attr ;
+    pthread_condattr_init(&attr) ;
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ;
+    pthread_cond_init(&timer_cond, &attr) ;
+    pthread_condattr_destroy(&attr) ;
+  }
+
+  static bool before(const struct timespec &a, const struct timespec &b)
+  {
+    return a.tv_sec < b.tv_sec or (a.tv_sec==b.tv_sec and a.tv_nsec < b.tv_nsec) ;
+  }
+
+  void *flush_timer_t::run(void *)
+  {
+    pthread_mutex_lock(&timer_mutex) ;
+    for (;;)
+    {
+      map<abstract_log_t*, struct timespec>::iterator next = deadlines.begin() ;
+      for (map<abstract_log_t*, struct timespec>::iterator it = deadlines.begin(); it != deadlines.end(); ++it)
+        if (before(it->second, next->second))
+          next = it ;
+      if (next==deadlines.end())
+      {
+        pthread_cond_wait(&timer_cond, &timer_mutex) ;
+        continue ;
+      }
+      struct timespec now ;
+      clock_gettime(CLOCK_MONOTONIC, &now) ;
+      if (before(now, next->second))
+      {
+        pthread_cond_timedwait(&timer_cond, &timer_mutex, &next->second) ;
+        continue ;
+      }
+      // the log may arm the timer again while it's flushed
+      flushing = next->first ;
+      deadlines.erase(next) ;
+      pthread_mutex_unlock(&timer_mutex) ;
+      flushing->flush_locked() ;
+      pthread_mutex_lock(&timer_mutex) ;
+      flushing = NULL ;
+      pthread_cond_broadcast(&timer_cond) ; // for cancel()
+    }
+    return NULL ;
+  }
+
+  struct timespec flush_timer_t::deadline(const struct timespec &since, unsigned milliseconds)
+  {
+    struct timespec due = since ;
+    long long ns = due.tv_nsec + milliseconds % 1000 * 1000000LL ;
+    due.tv_sec += milliseconds / 1000 + ns / 1000000000 ;
+    due.tv_nsec = ns % 1000000000 ;
+    return due ;
+  }
+
+  void flush_timer_t::arm(abstract_log_t *log, const struct timespec &due)
+  {
+    pthread_once(&cond_once, init_cond) ;
+    pthread_mutex_lock(&timer_mutex) ;
+    map<abstract_log_t*, struct timespec>::iterator it = deadlines.find(log) ;
+    if (it==deadlines.end())
+      deadlines[log] = due ;
+    else if (before(due, it->second))
+      it->second = due ;
+    if (not started)
+    {
+      // signals are for the application threads
+      sigset_t all, old ;
+      sigfillset(&all) ;
+      pthread_sigmask(SIG_SETMASK, &all, &old) ;
+      pthread_t thread ;
+      pthread_attr_t attr ;
+      pthread_attr_init(&attr) ;
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) ;
+      started = pthread_create(&thread, &attr, run, NULL)==0 ;
+      pthread_attr_destroy(&attr) ;
+      pthread_sigmask(SIG_SETMASK, &old, NULL) ;
+    }
+    pthread_cond_signal(&timer_cond) ;
+    pthread_mutex_unlock(&timer_mutex) ;
+  }
+
+  void flush_timer_t::cancel(abstract_log_t *log)
+  {
+    pthread_mutex_lock(&timer_mutex) ;
+    deadlines.erase(log) ;
+    while (flushing==log)
+      pthread_cond_wait(&timer_cond, &timer_mutex) ;
+    pthread_mutex_unlock(&timer_mutex) ;
+  }
+
+  void flush_timer_t::before_fork()
+  {
+    pthread_mutex_lock(&timer_mutex) ;
+  }
+
+  void flush_timer_t::after_fork_in_parent()
+  {
+    pthread_mutex_unlock(&timer_mutex) ;
+  }
+
+  // The logs of the child dropped what they kept back, the thread stayed
+  // in the parent. Made again: the condition may still count the waiting
+  // thread of the parent, a signal to it would block.
+  void flush_timer_t::after_fork_in_child()
+  {
+    deadlines.clear() ;
+    flushing = NULL ;
+    started = false ;
+    init_cond() ;
+    pthread_mutex_init(&timer_mutex, NULL) ;
+  }
+}
@@ -0,0 +1,57 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+
+// Internal header, not installed: the deadlines of the flush policies
+
+#ifndef LIBQMLOG_FLUSH_H
+#define LIBQMLOG_FLUSH_H
+
+#include <time.h>
+
+#include "api2.h"
+
+namespace qmlog
+{
+  // The messages kept back by the flush policy of a log are written once
+  // the oldest is due, even if no other message comes: a thread of the
+  // library sleeps until the earliest deadline of all the logs, then calls
+  // flush_buffer() of that log with its mutex locked. The thread is
+  // started with the first deadline, a child of fork() starts its own.
+  class flush_timer_t
+  {
+    static void *run(void *) ;
+  public:
+    // Called with the mutex of 'log' locked; an earlier deadline stays
+    static void arm(abstract_log_t *log, const struct timespec &due) ;
+    // Once it returns, the timer doesn't flush 'log' any more
+    static void cancel(abstract_log_t *log) ;
+    // 'due' = monotonic 'since' + 'milliseconds'
+    static struct timespec deadline(const struct timespec &since, unsigned milliseconds) ;
+
+    // Locked after the mutexes of the logs, arm() is called with one held
+    static void before_fork() ;
+    static void after_fork_in_parent() ;
+    static void after_fork_in_child() ;
+  } ;
+}
+
+#endif // LIBQMLOG_FLUSH_H
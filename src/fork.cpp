@@ -0,0 +1,97 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <set>
+using namespace std ;
+
+#include "api2.h"
+#include "async.h"
+#include "thread.h"
+#include "timezone.h"
+#include "site.h"
+#include "control.h"
+#include "flush.h"
+#include "layout.h"
+
+namespace qmlog
+{
+  // Each log once, even if it's attached to several dispatchers
+  set<abstract_log_t*> object_t::attached_logs()
+  {
+    set<abstract_log_t*> logs ;
+    for (set<dispatcher_t*>::const_iterator d = object.dispatchers.begin(); d != object.dispatchers.end(); ++d)
+      logs.insert((*d)->logs.begin(), (*d)->logs.end()) ;
+    return logs ;
+  }
+
+  // The order is the one of the library: the control file watcher applies
+  // the file under the configuration lock, a log may register a site or
+  // check the timezone while writing, and the registry is taken by
+  // synchronize_readers() with the configuration lock held. A layout is
+  // looked up while composing, with no other lock held: taken last.
+  void object_t::before_fork()
+  {
+    control_watcher_t::before_fork() ;
+    config_before_fork() ;
+    set<abstract_log_t*> logs = attached_logs() ;
+    for (set<abstract_log_t*>::const_iterator it = logs.begin(); it != logs.end(); ++it)
+      (*it)->before_fork() ;
+    flush_timer_t::before_fork() ;
+    sites_before_fork() ;
+    if (object.timezone_watcher)
+      object.timezone_watcher->before_fork() ;
+    registry_before_fork() ;
+    layouts_before_fork() ;
+  }
+
+  void object_t::after_fork_in_parent()
+  {
+    layouts_after_fork_in_parent() ;
+    if (object.timezone_watcher)
+      object.timezone_watcher->after_fork_in_parent() ;
+    sites_after_fork() ;
+    flush_timer_t::after_fork_in_parent() ;
+    set<abstract_log_t*> logs = attached_logs() ;
+    for (set<abstract_log_t*>::const_iterator it = logs.begin(); it != logs.end(); ++it)
+      (*it)->after_fork_in_parent() ;
+    locks_after_fork_in_parent() ;
+    control_watcher_t::after_fork_in_parent() ;
+  }
+
+  // Only this thread exists now. The new threads are started last: all
+  // the locks they may take are free again by then.
+  void object_t::after_fork_in_child()
+  {
+    layouts_after_fork_in_child() ;
+    locks_after_fork_in_child() ;
+    if (object.timezone_watcher)
+      object.timezone_watcher->after_fork_in_child() ;
+    sites_after_fork() ;
+    flush_timer_t::after_fork_in_child() ;
+    set<abstract_log_t*> logs = attached_logs() ;
+    for (set<abstract_log_t*>::const_iterator it = logs.begin(); it != logs.end(); ++it)
+      (*it)->after_fork_in_child() ;
+    for (set<dispatcher_t*>::const_iterator d = object.dispatchers.begin(); d != object.dispatchers.end(); ++d)
+      if ((*d)->queue)
+        (*d)->queue->after_fork_in_child() ;
+    control_watcher_t::after_fork_in_child() ; // applies the file, may log
+  }
+}
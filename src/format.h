@@ -0,0 +1,241 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+
+/*
+ * Optional C++11 front end: log_debug_fmt("x={} y={}", x, y) and the same
+ * for the other levels. The number of "{}" is checked against the
+ * arguments at compile time, each argument is appended according to its
+ * type, without a printf format to be parsed and without a way to crash
+ * on a mismatch. "{{" and "}}" stand for the braces themselves.
+ *
+ * QMLOG_LEVEL, QMLOG_LOCATION_MASK and QMLOG_DISPATCHER apply as for the
+ * printf-like macros, which keep working alongside.
+ */
+
+#ifndef LIBQMLOG_FORMAT_H
+#define LIBQMLOG_FORMAT_H
+
+#if __cplusplus < 201103L
+#error libqmlog/format.h needs C++11
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+#include <libqmlog/api2.h>
+
+namespace qmlog
+{
+  namespace format
+  {
+    typedef smart_buffer<1024> buffer ;
+
+    // The number of "{}" in the format, -1 if a brace is not paired.
+    // Recursive, as C++11 wants it: the format is limited by the constexpr
+    // depth of the compiler (512 characters for gcc).
+    constexpr int placeholders(const char *f, int n=0)
+    {
+      return f[0]=='\0' ? n :
+        (f[0]=='{' and f[1]=='}') ? placeholders(f+2, n+1) :
+        (f[0]=='{' and f[1]=='{') or (f[0]=='}' and f[1]=='}') ? placeholders(f+2, n) :
+        (f[0]=='{' or f[0]=='}') ? -1 :
+        placeholders(f+1, n) ;
+    }
+
+    template<typename T> struct supported
+    {
+      typedef typename std::decay<T>::type D ;
+      static const bool value = std::is_arithmetic<D>::value or std::is_enum<D>::value
+        or std::is_pointer<D>::value or std::is_same<D, std::string>::value ;
+    } ;
+
+    inline void append(buffer &b, const char *s)
+    {
+      if (s==NULL)
+        s = "(null)" ;
+      b.append(s, strlen(s)) ;
+    }
+
+    inline void append(buffer &b, const std::string &s)
+    {
+      b.append(s.data(), s.size()) ;
+    }
+
+    inline void append(buffer &b, bool value)
+    {
+      append(b, value ? "true" : "false") ;
+    }
+
+    inline void append(buffer &b, char c)
+    {
+      b.append(&c, 1) ;
+    }
+
+    inline void append(buffer &b, const void *p)
+    {
+      char text[24] ;
+      snprintf(text, sizeof(text), "%p", p) ;
+      append(b, text) ;
+    }
+
+    template<typename T>
+    typename std::enable_if<std::is_integral<T>::value or std::is_enum<T>::value>::type append(buffer &b, T value)
+    {
+      typedef typename std::conditional<std::is_signed<T>::value, long long, unsigned long long>::type wide ;
+      wide v = (wide) value ;
+      unsigned long long u = v<0 ? -(unsigned long long)v : v ;
+      char digits[24], *p = digits + sizeof(digits) ;
+      do
+        *--p = '0' + u % 10 ;
+      while (u /= 10) ;
+      if (v<0)
+        *--p = '-' ;
+      b.append(p, digits + sizeof(digits) - p) ;
+    }
+
+    template<typename T>
+    typename std::enable_if<std::is_floating_point<T>::value>::type append(buffer &b, T value)
+    {
+      char text[64] ;
+      snprintf(text, sizeof(text), "%Lg", (long double) value) ;
+      append(b, text) ;
+    }
+
+    // Appends the text up to the next "{}", returns the position after it
+    inline const char *literal(buffer &b, const char *f)
+    {
+      for (const char *brace; (brace = strpbrk(f, "{}")) != NULL; f = brace + 2)
+      {
+        b.append(f, brace - f) ;
+        if (brace[1]=='}' and brace[0]=='{')
+          return brace + 2 ;
+        b.append(brace, 1) ; // "{{" or "}}"
+      }
+      append(b, f) ;
+      return f + strlen(f) ;
+    }
+
+    inline void compose(buffer &b, const char *f)
+    {
+      literal(b, f) ;
+    }
+
+    template<typename T, typename... Rest>
+    void compose(buffer &b, const char *f, const T &first, const Rest &... rest)
+    {
+      static_assert(supported<T>::value, "qmlog: arguments are numbers, enums, pointers, strings or std::string") ;
+      f = literal(b, f) ;
+      append(b, first) ;
+      compose(b, f, rest...) ;
+    }
+  }
+
+  // Made by the macros: 'count' is format::placeholders(fmt)
+  template<int count, typename... Args>
+  void log(dispatcher_t *d, site_t *site, const char *fmt, const Args &... args)
+  {
+    static_assert(count >= 0, "qmlog: a single '{' or '}' in the format, write '{{' or '}}'") ;
+    static_assert(count == sizeof...(Args), "qmlog: the number of {} in the format differs from the number of arguments") ;
+    if (site->level > d->log_level())
+      return ;
+    format::buffer text ;
+    format::compose(text, fmt, args...) ;
+    d->message(site, "%s", text.c_str()) ;
+  }
+}
+
+#define QMLOG_FMT_LOCATION(level, fmt, ...) QMLOG_IF QMLOG_SITE(level) ; if (qmlog::site_on(&qmlog_site)) qmlog::log<qmlog::format::placeholders(fmt)>(QMLOG_DISPATCHER, &qmlog_site, fmt, ##__VA_ARGS__) ; QMLOG_ENDIF
+#define QMLOG_FMT(level, fmt, ...) QMLOG_IF QMLOG_SITE_WITHOUT_LOCATION(level) ; if (qmlog::site_on(&qmlog_site)) qmlog::log<qmlog::format::placeholders(fmt)>(QMLOG_DISPATCHER, &qmlog_site, fmt, ##__VA_ARGS__) ; QMLOG_ENDIF
+
+#if QMLOG_LEVEL >= QMLOG_INTERNAL
+# if (QMLOG_LOCATION_MASK) & (1<<QMLOG_INTERNAL)
+#  define log_internal_fmt(...) QMLOG_FMT_LOCATION(QMLOG_INTERNAL, __VA_ARGS__)
+# else
+#  define log_internal_fmt(...) QMLOG_FMT(QMLOG_INTERNAL, __VA_ARGS__)
+# endif
+#else
+# define log_internal_fmt(...) (void)(0)
+#endif
+
+#if QMLOG_LEVEL >= QMLOG_CRITICAL
+# if (QMLOG_LOCATION_MASK) & (1<<QMLOG_CRITICAL)
+#  define log_critical_fmt(...) QMLOG_FMT_LOCATION(QMLOG_CRITICAL, __VA_ARGS__)
+# else
+#  define log_critical_fmt(...) QMLOG_FMT(QMLOG_CRITICAL, __VA_ARGS__)
+# endif
+#else
+# define log_critical_fmt(...) (void)(0)
+#endif
+
+#if QMLOG_LEVEL >= QMLOG_ERROR
+# if (QMLOG_LOCATION_MASK) & (1<<QMLOG_ERROR)
+#  define log_error_fmt(...) QMLOG_FMT_LOCATION(QMLOG_ERROR, __VA_ARGS__)
+# else
+#  define log_error_fmt(...) QMLOG_FMT(QMLOG_ERROR, __VA_ARGS__)
+# endif
+#else
+# define log_error_fmt(...) (void)(0)
+#endif
+
+#if QMLOG_LEVEL >= QMLOG_WARNING
+# if (QMLOG_LOCATION_MASK) & (1<<QMLOG_WARNING)
+#  define log_warning_fmt(...) QMLOG_FMT_LOCATION(QMLOG_WARNING, __VA_ARGS__)
+# else
+#  define log_warning_fmt(...) QMLOG_FMT(QMLOG_WARNING, __VA_ARGS__)
+# endif
+#else
+# define log_warning_fmt(...) (void)(0)
+#endif
+
+#if QMLOG_LEVEL >= QMLOG_NOTICE
+# if (QMLOG_LOCATION_MASK) & (1<<QMLOG_NOTICE)
+#  define log_notice_fmt(...) QMLOG_FMT_LOCATION(QMLOG_NOTICE, __VA_ARGS__)
+# else
+#  define log_notice_fmt(...) QMLOG_FMT(QMLOG_NOTICE, __VA_ARGS__)
+# endif
+#else
+# define log_notice_fmt(...) (void)(0)
+#endif
+
+#if QMLOG_LEVEL >= QMLOG_INFO
+# if (QMLOG_LOCATION_MASK) & (1<<QMLOG_INFO)
+#  define log_info_fmt(...) QMLOG_FMT_LOCATION(QMLOG_INFO, __VA_ARGS__)
+# else
+#  define log_info_fmt(...) QMLOG_FMT(QMLOG_INFO, __VA_ARGS__)
+# endif
+#else
+# define log_info_fmt(...) (void)(0)
+#endif
+
+#if QMLOG_LEVEL >= QMLOG_DEBUG
+# if (QMLOG_LOCATION_MASK) & (1<<QMLOG_DEBUG)
+#  define log_debug_fmt(...) QMLOG_FMT_LOCATION(QMLOG_DEBUG, __VA_ARGS__)
+# else
+#  define log_debug_fmt(...) QMLOG_FMT(QMLOG_DEBUG, __VA_ARGS__)
+# endif
+#else
+# define log_debug_fmt(...) (void)(0)
+#endif
+
+#endif // LIBQMLOG_FORMAT_H
@@ -0,0 +1,235 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include <string>
+#include <algorithm>
+
+#include "api2.h"
+#include "thread.h"
+#include "record.h"
+#include "layout.h"
+
+namespace qmlog
+{
+  // NAME=value, or with a newline in the value: NAME, '\n', the length
+  // as 64 bit little endian, the value
+  static void append_field(record_buffer &out, const char *name, const char *value, unsigned length)
+  {
+    append(out, name) ;
+    if (memchr(value, '\n', length)==NULL)
+      append(out, "=") ;
+    else
+    {
+      unsigned char size[9] = { '\n' } ;
+      uint64_t n = length ;
+      for (int i=1; i<9; ++i, n >>= 8)
+        size[i] = n & 0xff ;
+      out.append(size, sizeof(size)) ;
+    }
+    out.append(value, length) ;
+    append(out, "\n") ;
+  }
+
+  static void append_field(record_buffer &out, const char *name, const char *value)
+  {
+    append_field(out, name, value ? value : "(null)", value ? strlen(value) : 6) ;
+  }
+
+  static void append_field(record_buffer &out, const char *name, long value)
+  {
+    append(out, name) ;
+    append(out, "=") ;
+    append_number(out, value) ;
+    append(out, "\n") ;
+  }
+
+  log_journal::log_journal(int maximal_log_level, dispatcher_t *d, const char *path)
+    : abstract_log_t(maximal_log_level), socket_path(path)
+  {
+    fd = -1 ;
+    failed = false ;
+    takes_records = true ;
+    attach_to(d) ;
+  }
+
+  log_journal::~log_journal()
+  {
+    detach_all() ;
+    if (fd>=0)
+      ::close(fd) ;
+  }
+
+  // Not connected: the datagrams are addressed, so a restarted journal
+  // gets them without opening the socket again
+  bool log_journal::open()
+  {
+    if (fd>=0)
+      return true ;
+    if (failed and not (fields & Retry_If_Failed))
+      return false ;
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0) ;
+    failed = fd<0 ;
+    return not failed ;
+  }
+
+  void log_journal::submit_record(dispatcher_t *d, const record_t &r, const char *arguments, unsigned size)
+  {
+    static const int priorities[] =
+    {
+      LOG_ALERT, LOG_CRIT, LOG_ERR, LOG_WARNING, LOG_NOTICE, LOG_INFO, LOG_DEBUG
+    } ;
+    if (not open())
+      return ;
+
+    const char *message = arguments ;
+    unsigned length = size ;
+    if (r.fmt)
+    {
+      text.rewind() ;
+      format_arguments(text, r.fmt, arguments, size) ;
+      message = text.c_str(), length = text.position() ;
+    }
+
+    buf.rewind() ;
+    bool known = qmlog::Internal<=r.level and r.level<=qmlog::Debug ;
+    append_field(buf, "PRIORITY", known ? priorities[r.level-qmlog::Internal] : LOG_DEBUG) ;
+    append_field(buf, "SYSLOG_IDENTIFIER", d->str_name()) ;
+    append_field(buf, "SYSLOG_PID", current_pid()) ;
+    if (r.line>0 and (fields & Line))
+    {
+      append_field(buf, "CODE_FILE", r.file) ;
+      append_field(buf, "CODE_LINE", r.line) ;
+    }
+    if (r.func and (fields & Function))
+      append_field(buf, "CODE_FUNC", r.func) ;
+    append_field(buf, "MESSAGE", message, length) ;
+    send() ;
+  }
+
+  void log_journal::submit_message(dispatcher_t *d, int level, const char *message)
+  {
+    // composed by someone else: the text is the message
+    thread_state_t *state = thread_state() ;
+    state->get_timestamp() ;
+    record_t r ;
+    r.level = level, r.line = -1, r.file = r.func = r.fmt = NULL ;
+    r.site = NULL ;
+    r.monotonic_timestamp = state->monotonic_timestamp ;
+    r.timestamp = state->timestamp ;
+    submit_record(d, r, message, strlen(message)) ;
+  }
+
+  static socklen_t journal_address(struct sockaddr_un &address, const std::string &path)
+  {
+    memset(&address, 0, sizeof(address)) ;
+    address.sun_family = AF_UNIX ;
+    size_t length = std::min(path.size(), sizeof(address.sun_path)-1) ;
+    memcpy(address.sun_path, path.data(), length) ;
+    return offsetof(struct sockaddr_un, sun_path) + length ;
+  }
+
+  void log_journal::send()
+  {
+    struct sockaddr_un address ;
+    struct iovec iov ;
+    iov.iov_base = (void*) buf.c_str() ;
+    iov.iov_len = buf.position() ;
+    struct msghdr m ;
+    memset(&m, 0, sizeof(m)) ;
+    m.msg_name = &address ;
+    m.msg_namelen = journal_address(address, socket_path) ;
+    m.msg_iov = &iov ;
+    m.msg_iovlen = 1 ;
+    ssize_t res ;
+    do
+      res = sendmsg(fd, &m, MSG_NOSIGNAL) ;
+    while (res<0 and errno==EINTR) ;
+    if (res<0 and (errno==EMSGSIZE or errno==ENOBUFS))
+      send_memfd() ;
+    // else lost: there is no one to tell
+  }
+
+  // The way the journal takes the long messages: the datagram has no data,
+  // only the descriptor of a sealed memfd with the fields
+  void log_journal::send_memfd()
+  {
+#ifdef MFD_ALLOW_SEALING
+    int mfd = memfd_create("qmlog-journal", MFD_CLOEXEC | MFD_ALLOW_SEALING) ;
+    if (mfd<0)
+      return ;
+    const char *p = buf.c_str() ;
+    for (unsigned left = buf.position(); left>0; )
+    {
+      ssize_t written = write(mfd, p, left) ;
+      if (written<0 and errno==EINTR)
+        continue ;
+      if (written<0)
+      {
+        ::close(mfd) ;
+        return ;
+      }
+      p += written, left -= written ;
+    }
+    if (fcntl(mfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+    {
+      ::close(mfd) ;
+      return ;
+    }
+
+    struct sockaddr_un address ;
+    union
+    {
+      struct cmsghdr header ;
+      char space[CMSG_SPACE(sizeof(int))] ;
+    } control ;
+    memset(&control, 0, sizeof(control)) ;
+    struct msghdr m ;
+    memset(&m, 0, sizeof(m)) ;
+    m.msg_name = &address ;
+    m.msg_namelen = journal_address(address, socket_path) ;
+    m.msg_control = &control ;
+    m.msg_controllen = sizeof(control) ;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&m) ;
+    c->cmsg_level = SOL_SOCKET ;
+    c->cmsg_type = SCM_RIGHTS ;
+    c->cmsg_len = CMSG_LEN(sizeof(int)) ;
+    memcpy(CMSG_DATA(c), &mfd, sizeof(int)) ;
+    while (sendmsg(fd, &m, MSG_NOSIGNAL)<0 and errno==EINTR)
+      ;
+    ::close(mfd) ;
+#endif
+  }
+}
@@ -0,0 +1,211 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <pthread.h>
+
+#include <map>
+using namespace std ;
+
+#include "layout.h"
+
+namespace qmlog
+{
+  static pthread_mutex_t layouts_mutex = PTHREAD_MUTEX_INITIALIZER ;
+  static map<int, layout_t*> layouts ;
+
+  const layout_t *layout_t::get(int fields)
+  {
+    fields &= All_Fields ;
+    pthread_mutex_lock(&layouts_mutex) ;
+    layout_t *&l = layouts[fields] ;
+    if (l==NULL)
+      l = new layout_t(fields) ;
+    pthread_mutex_unlock(&layouts_mutex) ;
+    return l ;
+  }
+
+  void layouts_before_fork()
+  {
+    pthread_mutex_lock(&layouts_mutex) ;
+  }
+
+  void layouts_after_fork_in_parent()
+  {
+    pthread_mutex_unlock(&layouts_mutex) ;
+  }
+
+  void layouts_after_fork_in_child()
+  {
+    pthread_mutex_init(&layouts_mutex, NULL) ;
+  }
+
+  void layout_t::add(piece_t piece)
+  {
+    step_t s = { piece, 0, 0 } ;
+    steps.push_back(s) ;
+  }
+
+  void layout_t::add(const char *literal)
+  {
+    unsigned length = strlen(literal) ;
+    if (length==0)
+      return ;
+    if (steps.empty() or steps.back().piece!=Literal)
+    {
+      step_t s = { Literal, (unsigned)literals.size(), 0 } ;
+      steps.push_back(s) ;
+    }
+    literals += literal ;
+    steps.back().length += length ;
+  }
+
+  // The same text as abstract_log_t::compose_message() used to print
+  layout_t::layout_t(int f) : fields(f)
+  {
+    separator = "" ;
+    if (fields & Time_Info_Block)
+    {
+      const char *ti_separator = "" ;
+      add("[") ;
+      if (int mono = fields & Monotonic_Mask)
+      {
+        add(Monotonic_Seconds) ;
+        if (mono == Monotonic_Nano)
+          add("."), add(Monotonic_Nano_Part) ;
+        else if (mono == Monotonic_Micro)
+          add("."), add(Monotonic_Micro_Part) ;
+        else if (mono == Monotonic_Milli)
+          add("."), add(Monotonic_Milli_Part) ;
+        ti_separator = " " ;
+      }
+      if (int tz = fields & Timezone_Tm_Block)
+      {
+        add(ti_separator), add("(") ;
+        const char *tz_separator = "" ;
+        if (tz & Timezone_Abbreviation)
+        {
+          add(Timezone_Abbreviation_Part) ;
+          tz_separator = "," ;
+        }
+        if (tz & Timezone_Offset)
+          add(tz_separator), add("GMT"), add(Timezone_Offset_Part) ;
+        add(")") ;
+        ti_separator = " " ;
+      }
+      if (fields & Date)
+      {
+        add(ti_separator), add(Date_Part) ;
+        ti_separator = " " ;
+      }
+      if (int time = fields & Time_Mask)
+      {
+        add(ti_separator), add(Time_Part) ;
+        if (time == Time_Micro)
+          add("."), add(Time_Micro_Part) ;
+        else if (time == Time_Milli)
+          add("."), add(Time_Milli_Part) ;
+        ti_separator = " " ;
+      }
+      if (fields & Timezone_Symlink)
+        add(ti_separator), add("'"), add(Timezone_Symlink_Part), add("'") ;
+      add("]") ;
+      separator = " " ;
+    }
+    if (fields & Process_Block) // [program:123] | [program] | [123]
+    {
+      const char *p_separator = "" ;
+      add(separator), add("[") ;
+      if (fields & Name)
+      {
+        add(Name_Part) ;
+        p_separator = "," ;
+      }
+      if (fields & Pid)
+        add(p_separator), add(Pid_Part) ;
+      add("]") ;
+      separator = " " ;
+    }
+  }
+
+  void layout_t::append_prefix(record_buffer &out, dispatcher_t *d, thread_state_t *state) const
+  {
+    for (vector<step_t>::const_iterator s = steps.begin(); s != steps.end(); ++s)
+    {
+      switch (s->piece)
+      {
+        case Literal:
+          out.append(literals.data() + s->offset, s->length) ;
+          break ;
+        case Monotonic_Seconds:
+          append(out, state->str_monotonic()) ;
+          break ;
+        case Monotonic_Nano_Part:
+          append(out, state->str_monotonic_nano()) ;
+          break ;
+        case Monotonic_Micro_Part:
+          append(out, state->str_monotonic_micro()) ;
+          break ;
+        case Monotonic_Milli_Part:
+          append(out, state->str_monotonic_milli()) ;
+          break ;
+        case Timezone_Abbreviation_Part:
+          append(out, state->str_tz_abbreviation()) ;
+          break ;
+        case Timezone_Offset_Part:
+          append(out, state->str_gmt_offset()) ;
+          break ;
+        case Date_Part:
+          append(out, state->str_date()) ;
+          break ;
+        case Time_Part:
+          append(out, state->str_time()) ;
+          break ;
+        case Time_Micro_Part:
+          append(out, state->str_time_micro()) ;
+          break ;
+        case Time_Milli_Part:
+          append(out, state->str_time_milli()) ;
+          break ;
+        case Timezone_Symlink_Part:
+          append(out, state->str_tz_symlink()) ;
+          break ;
+        case Name_Part:
+          append(out, d->str_name()) ;
+          break ;
+        case Pid_Part:
+          append(out, state->str_pid()) ;
+          break ;
+      }
+    }
+  }
+
+  void append_number(record_buffer &out, long value)
+  {
+    char digits[24], *p = digits + sizeof(digits) ;
+    unsigned long u = value<0 ? -(unsigned long)value : value ;
+    do
+      *--p = '0' + u % 10 ;
+    while (u /= 10) ;
+    if (value<0)
+      *--p = '-' ;
+    out.append(p, digits + sizeof(digits) - p) ;
+  }
+}
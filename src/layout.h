@@ -0,0 +1,86 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+
+// Internal header, not installed: the fields of a log, compiled
+
+#ifndef LIBQMLOG_LAYOUT_H
+#define LIBQMLOG_LAYOUT_H
+
+#include <string>
+#include <vector>
+
+#include "api2.h"
+#include "record.h"
+#include "thread.h"
+
+namespace qmlog
+{
+  // The prefix of a message ("[time info] [process]") as a list of
+  // literal strings and pieces of the timestamp, built once for each
+  // distinct set of fields and never freed: the logs with the same fields
+  // share the same layout.
+  class layout_t
+  {
+    enum piece_t
+    {
+      Literal,
+      Monotonic_Seconds, Monotonic_Nano_Part, Monotonic_Micro_Part, Monotonic_Milli_Part,
+      Timezone_Abbreviation_Part, Timezone_Offset_Part, Date_Part,
+      Time_Part, Time_Micro_Part, Time_Milli_Part, Timezone_Symlink_Part,
+      Name_Part, Pid_Part
+    } ;
+    struct step_t
+    {
+      piece_t piece ;
+      unsigned offset, length ; // of the literal in 'literals'
+    } ;
+    std::vector<step_t> steps ;
+    std::string literals ;
+
+    layout_t(int fields) ;
+    void add(piece_t piece) ;
+    void add(const char *literal) ;
+  public:
+    const int fields ; // only the bits of All_Fields
+    const char *separator ; // between the prefix and the rest: "" or " "
+
+    static const layout_t *get(int fields) ;
+    void append_prefix(record_buffer &out, dispatcher_t *d, thread_state_t *state) const ;
+  } ;
+
+  // like printf("%s"), but without parsing a format
+  inline void append(record_buffer &out, const char *s)
+  {
+    if (s==NULL)
+      s = "(null)" ;
+    out.append(s, strlen(s)) ;
+  }
+
+  void append_number(record_buffer &out, long value) ;
+
+  // the lock of the layouts around fork(), taken last
+  void layouts_before_fork() ;
+  void layouts_after_fork_in_parent() ;
+  void layouts_after_fork_in_child() ;
+}
+
+#endif // LIBQMLOG_LAYOUT_H
@@ -0,0 +1,202 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include <string>
+using namespace std ;
+
+#include "api2.h"
+
+/*
+ * The header line is "# qmlog XXXXXXXX bytes in use\n". The eight hex
+ * digits are aligned to 8 bytes and replaced by a single store after the
+ * message and its newline are in place: whatever happens to the process,
+ * the header never counts a partly written message.
+ */
+
+namespace qmlog
+{
+  static const char header[] = "# qmlog 00000000 bytes in use\n" ;
+  static const unsigned header_length = sizeof(header) - 1 ;
+  static const unsigned digits_offset = 8 ;
+
+  static uint64_t hex_digits(unsigned value)
+  {
+    char c[8] ;
+    for (int i=7; i>=0; --i, value >>= 4)
+      c[i] = "0123456789abcdef"[value & 0xF] ;
+    uint64_t v ;
+    memcpy(&v, c, 8) ;
+    return v ;
+  }
+
+  // the length in the header of an existing file, 0 if it has none
+  static unsigned used_length(int fd, off_t size)
+  {
+    char h[header_length] ;
+    if (size < (off_t)header_length or pread(fd, h, header_length, 0) != (ssize_t)header_length)
+      return 0 ;
+    if (memcmp(h, header, digits_offset) != 0 or memcmp(h+digits_offset+8, header+digits_offset+8, header_length-digits_offset-8) != 0)
+      return 0 ;
+    unsigned used = 0 ;
+    for (unsigned i=digits_offset; i<digits_offset+8; ++i)
+    {
+      const char *digit = strchr("0123456789abcdef", h[i]) ;
+      if (digit==NULL or *digit=='\0')
+        return 0 ;
+      used = used << 4 | (digit - "0123456789abcdef") ;
+    }
+    return used >= header_length and used <= size ? used : 0 ;
+  }
+
+  log_mmap_file::log_mmap_file(const char *path, int maximal_log_level, dispatcher_t *d, unsigned size)
+    : abstract_log_t(maximal_log_level), file_path(path)
+  {
+    segment_size = size > 2*header_length ? size : 2*header_length ;
+    fd = -1 ;
+    failed = false ;
+    map = NULL ;
+    used = 0 ;
+    attach_to(d) ;
+  }
+
+  log_mmap_file::~log_mmap_file()
+  {
+    detach_all() ;
+    close() ;
+  }
+
+  // Continues a file written before (and maybe not closed), other files
+  // are moved away
+  bool log_mmap_file::open()
+  {
+    if (map!=NULL)
+      return true ;
+    if (failed)
+      return false ;
+    fd = ::open(file_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666) ;
+    struct stat st ;
+    if (fd>=0 and fstat(fd, &st)==0)
+    {
+      used = used_length(fd, st.st_size) ;
+      if (used==0 and st.st_size>0)
+      {
+        ::close(fd) ;
+        rename(file_path.c_str(), (file_path + ".1").c_str()) ;
+        fd = ::open(file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666) ;
+      }
+    }
+    if (fd>=0 and used + header_length >= segment_size) // no room left
+    {
+      ::close(fd) ;
+      rename(file_path.c_str(), (file_path + ".1").c_str()) ;
+      fd = ::open(file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666) ;
+      used = 0 ;
+    }
+    if (fd>=0)
+    {
+      // the zeros after the used part are dropped and allocated anew
+      if (used>0 and ftruncate(fd, used) < 0)
+        used = 0 ;
+      if (fallocate(fd, 0, 0, segment_size) < 0 and ftruncate(fd, segment_size) < 0)
+        failed = true ;
+    }
+    if (fd>=0 and not failed)
+    {
+      void *p = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) ;
+      map = p==MAP_FAILED ? NULL : (char*)p ;
+    }
+    if (map==NULL)
+    {
+      if (fd>=0)
+        ::close(fd) ;
+      fd = -1 ;
+      failed = true ;
+      return false ;
+    }
+    if (used==0)
+    {
+      memcpy(map, header, header_length) ;
+      commit(header_length) ;
+    }
+    return true ;
+  }
+
+  void log_mmap_file::close()
+  {
+    if (map==NULL)
+      return ;
+    munmap(map, segment_size) ;
+    map = NULL ;
+    if (ftruncate(fd, used) < 0)
+      used = 0 ; // the header still tells the length
+    ::close(fd) ;
+    fd = -1 ;
+  }
+
+  // The parent goes on writing the segment: no ftruncate() here
+  void log_mmap_file::after_fork_in_child()
+  {
+    if (map!=NULL)
+    {
+      munmap(map, segment_size) ;
+      ::close(fd) ;
+      map = NULL ;
+      fd = -1 ;
+    }
+    failed = true ;
+    abstract_log_t::after_fork_in_child() ;
+  }
+
+  void log_mmap_file::commit(unsigned length)
+  {
+    used = length ;
+    __atomic_signal_fence(__ATOMIC_RELEASE) ; // the message is stored before
+    __atomic_store_n((uint64_t*)(map + digits_offset), hex_digits(used), __ATOMIC_RELAXED) ;
+  }
+
+  void log_mmap_file::submit_message(dispatcher_t *, int /* level */, const char *message)
+  {
+    if (not open())
+      return ;
+    unsigned length = strlen(message) ;
+    if (used + length + 1 > segment_size and used > header_length) // nothing to keep in an empty one
+    {
+      close() ;
+      rename(file_path.c_str(), (file_path + ".1").c_str()) ;
+      if (not open())
+        return ;
+    }
+    if (used + length + 1 > segment_size) // cut it to fit a segment
+      length = segment_size - used - 1 ;
+    memcpy(map + used, message, length) ;
+    map[used + length] = '\n' ;
+    commit(used + length + 1) ;
+  }
+}
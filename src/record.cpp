@@ -0,0 +1,476 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <stdint.h>
+#include <stddef.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "record.h"
+
+namespace qmlog
+{
+  // How an argument is stored: the type after default argument promotion
+  enum argument_class
+  {
+    No_Argument,     // "%%", "%m"
+    Int_Argument,    // int, char, short, wint_t: 4 bytes
+    Long_Argument,   // long, long long, size_t...: 8 bytes
+    Double_Argument,
+    Long_Double_Argument,
+    Pointer_Argument,
+    String_Argument, // 4 bytes length (~0 for NULL) followed by the characters
+    Bad_Argument
+  } ;
+
+  static const uint32_t null_string = ~(uint32_t)0 ;
+
+  // One conversion specification like "%-*.*lld"
+  struct conversion_t
+  {
+    const char *begin, *end ;
+    bool star_width, star_precision ;
+    bool has_precision ;
+    bool long_long ; // "ll", "q", "L", "j": the others are as long as 'long'
+    int precision ; // if has_precision and not star_precision
+    char type ;
+    argument_class cls ;
+  } ;
+
+  // 'p' points to '%', returns the position after the conversion
+  static const char *parse_conversion(const char *p, conversion_t &c)
+  {
+    c.begin = p++ ;
+    c.star_width = c.star_precision = c.has_precision = c.long_long = false ;
+    c.precision = 0 ;
+
+    if (*p=='%')
+    {
+      c.type = '%', c.cls = No_Argument ;
+      return c.end = p+1 ;
+    }
+
+    while (*p and strchr("-+ #0'I", *p))
+      ++p ;
+    if (*p=='*')
+      c.star_width = true, ++p ;
+    else
+      while ('0'<=*p and *p<='9')
+        ++p ;
+    if (*p=='.')
+    {
+      c.has_precision = true, ++p ;
+      if (*p=='*')
+        c.star_precision = true, ++p ;
+      else
+        for (; '0'<=*p and *p<='9'; ++p)
+          c.precision = c.precision*10 + (*p-'0') ;
+    }
+    if (*p=='$') // positional arguments: "%1$s", "%*2$d"
+    {
+      c.type = '$', c.cls = Bad_Argument ;
+      return c.end = p ;
+    }
+
+    int longs = 0 ;
+    bool long_double = false, wide_size = false ;
+    for (;; ++p)
+    {
+      if (*p=='l')
+        ++longs ;
+      else if (*p=='L' or *p=='q')
+        long_double = true, longs = 2 ;
+      else if (*p=='j')
+        wide_size = true, c.long_long = true ;
+      else if (*p=='z' or *p=='Z' or *p=='t')
+        wide_size = true ;
+      else if (*p!='h')
+        break ;
+    }
+
+    c.long_long = c.long_long or longs>1 ;
+    c.type = *p ;
+    c.end = *p ? p+1 : p ;
+    switch (*p)
+    {
+      case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+        c.cls = longs or wide_size ? Long_Argument : Int_Argument ;
+        break ;
+      case 'c': case 'C':
+        c.cls = Int_Argument ;
+        break ;
+      case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        c.cls = long_double ? Long_Double_Argument : Double_Argument ;
+        break ;
+      case 'p':
+        c.cls = Pointer_Argument ;
+        break ;
+      case 's':
+        c.cls = longs ? Bad_Argument : String_Argument ;
+        break ;
+      case 'm':
+        c.cls = No_Argument ;
+        break ;
+      default: // "%n", "%S", garbage
+        c.cls = Bad_Argument ;
+    }
+    return c.end ;
+  }
+
+  static void append_string(record_buffer &out, const char *s, const conversion_t &c, int precision)
+  {
+    if (s==NULL)
+    {
+      out.append(&null_string, sizeof(null_string)) ;
+      return ;
+    }
+    // with a precision the string doesn't have to be terminated
+    uint32_t len = c.has_precision and precision>=0 ? strnlen(s, precision) : strlen(s) ;
+    out.append(&len, sizeof(len)) ;
+    out.append(s, len) ;
+  }
+
+  bool capture_arguments(record_buffer &out, const char *fmt, va_list args)
+  {
+    int saved_errno = errno ;
+    unsigned start = out.position() ;
+    va_list ap ;
+    va_copy(ap, args) ;
+    bool ok = true ;
+    for (const char *p = strchr(fmt, '%'); ok and p; p = strchr(p, '%'))
+    {
+      conversion_t c ;
+      p = parse_conversion(p, c) ;
+      int precision = c.precision ;
+      if (c.star_width)
+      {
+        int32_t width = va_arg(ap, int) ;
+        out.append(&width, sizeof(width)) ;
+      }
+      if (c.star_precision)
+      {
+        int32_t value = va_arg(ap, int) ;
+        out.append(&value, sizeof(value)) ;
+        precision = value ;
+      }
+      switch (c.cls)
+      {
+        case No_Argument:
+          if (c.type=='m')
+            append_string(out, strerror(saved_errno), c, precision) ;
+          break ;
+        case Int_Argument:
+        {
+          int32_t value = va_arg(ap, int) ;
+          out.append(&value, sizeof(value)) ;
+          break ;
+        }
+        case Long_Argument:
+        {
+          int64_t value = c.long_long ? va_arg(ap, long long) : va_arg(ap, long) ;
+          out.append(&value, sizeof(value)) ;
+          break ;
+        }
+        case Double_Argument:
+        {
+          double value = va_arg(ap, double) ;
+          out.append(&value, sizeof(value)) ;
+          break ;
+        }
+        case Long_Double_Argument:
+        {
+          long double value = va_arg(ap, long double) ;
+          out.append(&value, sizeof(value)) ;
+          break ;
+        }
+        case Pointer_Argument:
+        {
+          void *value = va_arg(ap, void *) ;
+          out.append(&value, sizeof(value)) ;
+          break ;
+        }
+        case String_Argument:
+          append_string(out, va_arg(ap, const char *), c, precision) ;
+          break ;
+        case Bad_Argument:
+          ok = false ;
+          break ;
+      }
+    }
+    va_end(ap) ;
+    if (not ok)
+      out.rewind(start) ;
+    return ok ;
+  }
+
+  template<typename T>
+  static T take(const char *&data)
+  {
+    T value ;
+    memcpy(&value, data, sizeof(T)) ;
+    data += sizeof(T) ;
+    return value ;
+  }
+
+  // the data is read from a file by the decoder: it may be corrupted
+  static bool fits(const char *data, const char *data_end, uint64_t bytes)
+  {
+    return (uint64_t)(data_end - data) >= bytes ;
+  }
+
+  void format_arguments(record_buffer &out, const char *fmt, const char *data, unsigned size)
+  {
+    const char *data_end = data + size ;
+    for (const char *p = fmt; *p; )
+    {
+      const char *q = strchr(p, '%') ;
+      if (q==NULL)
+      {
+        out.append(p, strlen(p)) ;
+        break ;
+      }
+      out.append(p, q-p) ;
+      conversion_t c ;
+      p = parse_conversion(q, c) ;
+      if (c.cls==Bad_Argument) // can't happen: such a format is never captured
+        break ;
+
+      // the specification with '*' replaced by the captured values
+      smart_buffer<32> spec ;
+      for (const char *s = c.begin; s < c.end; ++s)
+      {
+        if (*s=='*')
+        {
+          if (not fits(data, data_end, sizeof(int32_t)))
+            return ; // corrupted record
+          int32_t value = take<int32_t>(data) ;
+          if (value<0 and s[-1]=='.') // negative precision means no precision
+            spec.rewind(spec.position()-1) ;
+          else
+            spec.printf("%d", value) ;
+        }
+        else if (*s=='m' and s+1==c.end)
+          spec.append("s", 1) ;
+        else
+          spec.append(s, 1) ;
+      }
+
+      if (c.type=='%')
+      {
+        out.append("%", 1) ;
+        continue ;
+      }
+      if (data>=data_end)
+        break ; // corrupted record
+      const char *f = spec.c_str() ;
+      static const unsigned sizes[] = // by argument_class
+        { sizeof(uint32_t), sizeof(int32_t), sizeof(int64_t), sizeof(double), sizeof(long double), sizeof(void *), sizeof(uint32_t), 0 } ;
+      if (not fits(data, data_end, sizes[c.cls]))
+        break ;
+      switch (c.cls)
+      {
+        case Int_Argument:
+          out.printf(f, take<int32_t>(data)) ;
+          break ;
+        case Long_Argument:
+          if (c.long_long)
+            out.printf(f, (long long) take<int64_t>(data)) ;
+          else
+            out.printf(f, (long) take<int64_t>(data)) ;
+          break ;
+        case Double_Argument:
+          out.printf(f, take<double>(data)) ;
+          break ;
+        case Long_Double_Argument:
+          out.printf(f, take<long double>(data)) ;
+          break ;
+        case Pointer_Argument:
+          out.printf(f, take<void *>(data)) ;
+          break ;
+        case No_Argument: // "%m"
+        case String_Argument:
+        {
+          uint32_t len = take<uint32_t>(data) ;
+          if (len==null_string)
+            out.printf(f, (const char *) NULL) ;
+          else if (not fits(data, data_end, len))
+            return ;
+          else
+          {
+            smart_buffer<256> value ; // the captured string isn't terminated
+            value.append(data, len) ;
+            out.printf(f, value.c_str()) ;
+            data += len ;
+          }
+          break ;
+        }
+        case Bad_Argument:
+          break ;
+      }
+    }
+  }
+
+  static void append_unsigned(record_buffer &out, uint64_t value, unsigned base, bool upper)
+  {
+    const char *digit = upper ? "0123456789ABCDEF" : "0123456789abcdef" ;
+    char digits[24], *p = digits + sizeof(digits) ;
+    do
+      *--p = digit[value % base] ;
+    while (value /= base) ;
+    append_capped(out, p, digits + sizeof(digits) - p) ;
+  }
+
+  static void append_integer(record_buffer &out, int64_t value, char type)
+  {
+    if (type=='x' or type=='X')
+      append_unsigned(out, value, 16, type=='X') ;
+    else if (type=='o')
+      append_unsigned(out, value, 8, false) ;
+    else if (type=='u')
+      append_unsigned(out, value, 10, false) ;
+    else if (type=='c')
+    {
+      char c = value ;
+      append_capped(out, &c, 1) ;
+    }
+    else
+    {
+      if (value<0)
+        append_capped(out, "-", 1) ;
+      append_unsigned(out, value<0 ? -(uint64_t)value : value, 10, false) ;
+    }
+  }
+
+  // "%f" without rounding, "inf", "nan" and numbers over 2^64 as such
+  static void append_double(record_buffer &out, double value, int precision)
+  {
+    if (value!=value)
+      return append_capped(out, "nan", 3) ;
+    if (value<0)
+      append_capped(out, "-", 1), value = -value ;
+    if (value>=18446744073709551616.0)
+      return append_capped(out, "inf", 3) ; // or just huge: that's enough in a crash
+    uint64_t integer = value ;
+    append_unsigned(out, integer, 10, false) ;
+    if (precision<=0)
+      return ;
+    append_capped(out, ".", 1) ;
+    value -= integer ;
+    for (int i=0; i<precision and i<18; ++i)
+    {
+      value *= 10 ;
+      char digit = '0' + (int)value ;
+      append_capped(out, &digit, 1) ;
+      value -= (int)value ;
+    }
+  }
+
+  void format_arguments_safely(record_buffer &out, const char *fmt, const char *data, unsigned size)
+  {
+    const char *data_end = data + size ;
+    for (const char *p = fmt; *p; )
+    {
+      const char *q = strchr(p, '%') ;
+      if (q==NULL)
+      {
+        append_capped(out, p, strlen(p)) ;
+        break ;
+      }
+      append_capped(out, p, q-p) ;
+      conversion_t c ;
+      p = parse_conversion(q, c) ;
+      if (c.cls==Bad_Argument)
+        break ;
+      int precision = c.has_precision ? c.precision : 6 ;
+      if (c.star_width)
+      {
+        if (not fits(data, data_end, sizeof(int32_t)))
+          break ;
+        take<int32_t>(data) ;
+      }
+      if (c.star_precision)
+      {
+        if (not fits(data, data_end, sizeof(int32_t)))
+          break ;
+        precision = take<int32_t>(data) ;
+        if (precision<0)
+          precision = 6 ;
+      }
+      if (c.type=='%')
+      {
+        append_capped(out, "%", 1) ;
+        continue ;
+      }
+      switch (c.cls)
+      {
+        case Int_Argument:
+          if (not fits(data, data_end, sizeof(int32_t)))
+            return ;
+          if (c.type=='d' or c.type=='i' or c.type=='c')
+            append_integer(out, take<int32_t>(data), c.type) ;
+          else
+            append_integer(out, take<uint32_t>(data), c.type) ;
+          break ;
+        case Long_Argument:
+          if (not fits(data, data_end, sizeof(int64_t)))
+            return ;
+          append_integer(out, take<int64_t>(data), c.type) ;
+          break ;
+        case Double_Argument:
+          if (not fits(data, data_end, sizeof(double)))
+            return ;
+          append_double(out, take<double>(data), precision) ;
+          break ;
+        case Long_Double_Argument:
+          if (not fits(data, data_end, sizeof(long double)))
+            return ;
+          append_double(out, take<long double>(data), precision) ;
+          break ;
+        case Pointer_Argument:
+          if (not fits(data, data_end, sizeof(void *)))
+            return ;
+          append_capped(out, "0x", 2) ;
+          append_unsigned(out, (uintptr_t) take<void *>(data), 16, false) ;
+          break ;
+        case No_Argument: // "%m"
+        case String_Argument:
+        {
+          if (not fits(data, data_end, sizeof(uint32_t)))
+            return ;
+          uint32_t len = take<uint32_t>(data) ;
+          if (len==null_string)
+            append_capped(out, "(null)", 6) ;
+          else if (not fits(data, data_end, len))
+            return ;
+          else
+          {
+            append_capped(out, data, len) ;
+            data += len ;
+          }
+          break ;
+        }
+        case Bad_Argument:
+          break ;
+      }
+    }
+  }
+}
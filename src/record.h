@@ -0,0 +1,72 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+
+// Internal header, not installed: messages captured without formatting
+
+#ifndef LIBQMLOG_RECORD_H
+#define LIBQMLOG_RECORD_H
+
+#include "api2.h"
+
+namespace qmlog
+{
+  typedef smart_buffer<1024> record_buffer ;
+
+  // Everything known about a message before it is formatted,
+  // the captured arguments are kept separately.
+  // 'fmt' is NULL, if the arguments couldn't be captured:
+  // the message is formatted already then (non-empty).
+  struct record_t
+  {
+    int level, line ;
+    const char *file, *func, *fmt ;
+    const site_t *site ; // registered, NULL if the message has none
+    struct timespec monotonic_timestamp ;
+    struct timeval timestamp ;
+  } ;
+
+  // Appends the values of the arguments used by 'fmt' to 'out': integers and
+  // floating point values as they are, strings by value ("%m" as well).
+  // Returns false, if some conversion can't be captured (positional
+  // arguments, wide strings, "%n"); 'out' is left unchanged then.
+  bool capture_arguments(record_buffer &out, const char *fmt, va_list args) ;
+
+  // Appends the same text to 'out', which vsnprintf() would have produced
+  // for the original arguments.
+  void format_arguments(record_buffer &out, const char *fmt, const char *data, unsigned size) ;
+
+  // Appends as much of 's' as 'out' has room for without growing: a signal
+  // handler mustn't allocate.
+  inline void append_capped(record_buffer &out, const char *s, unsigned size)
+  {
+    unsigned room = out.len - out.pos - 1 ;
+    out.append(s, size < room ? size : room) ;
+  }
+
+  // What a signal handler can do instead of format_arguments(): no
+  // vsnprintf(), no allocation, the text is cut where 'out' is full. The
+  // values replace the conversions; flags and widths are ignored, the
+  // precision is kept for strings and floating point values.
+  void format_arguments_safely(record_buffer &out, const char *fmt, const char *data, unsigned size) ;
+}
+
+#endif // LIBQMLOG_RECORD_H
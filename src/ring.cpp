@@ -0,0 +1,277 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+using namespace std ;
+
+#include "api2.h"
+#include "thread.h"
+
+/*
+ * The shared memory is a header and 'size' bytes of messages. Positions
+ * count the bytes written since the ring was made, a message is stored at
+ * its position modulo 'size' and may wrap around the end: a ring_message_t,
+ * the text, zeros up to a multiple of 8 bytes. The writer
+ *   - moves 'tail' past the messages it is going to overwrite,
+ *   - stores the end of the new message to 'reserved',
+ *   - copies the message,
+ *   - stores the same end to 'head'.
+ * A reader copies a message before 'head', then loads 'reserved': if the
+ * message starts less than 'size' bytes before, it was not overwritten
+ * while being copied; else the reader goes on at 'tail'.
+ */
+
+namespace qmlog
+{
+  struct ring_header_t
+  {
+    char magic[8] ; // stored last
+    uint32_t version, size ;
+    uint64_t tail, reserved, head ;
+    uint64_t next_sequence ;
+    uint64_t unused[2] ; // the messages start at 64 bytes
+  } ;
+
+  struct ring_message_t
+  {
+    uint32_t length, level ;
+    uint64_t sequence ;
+    uint64_t time ; // nanoseconds since the epoch
+  } ;
+
+  static const char ring_magic[8] = { 'q', 'm', 'l', 'o', 'g', 'r', 'n', 'g' } ;
+  static const uint32_t ring_version = 1 ;
+
+  static uint64_t padded(uint64_t length)
+  {
+    return (length + 7) & ~(uint64_t)7 ;
+  }
+
+  static void copy_in(ring_header_t *r, uint32_t size, uint64_t position, const void *from, unsigned length)
+  {
+    char *data = (char*)(r+1) ;
+    unsigned at = position & (size-1), first = min(length, size-at) ;
+    memcpy(data+at, from, first) ;
+    memcpy(data, (const char*)from+first, length-first) ;
+  }
+
+  static void copy_out(const ring_header_t *r, uint32_t size, uint64_t position, void *to, unsigned length)
+  {
+    const char *data = (const char*)(r+1) ;
+    unsigned at = position & (size-1), first = min(length, size-at) ;
+    memcpy(to, data+at, first) ;
+    memcpy((char*)to+first, data, length-first) ;
+  }
+
+  log_shm_ring::log_shm_ring(const char *name, int maximal_log_level, dispatcher_t *d, unsigned bytes)
+    : abstract_log_t(maximal_log_level), named(name!=NULL)
+  {
+    if (named)
+      ring_name = name ;
+    for (size = 4096; size < bytes and size < (1u<<31); size <<= 1)
+      ;
+    failed = false ;
+    ring = NULL ;
+    open() ; // a reader may attach before the first message
+    attach_to(d) ;
+  }
+
+  log_shm_ring::~log_shm_ring()
+  {
+    detach_all() ;
+    if (ring)
+    {
+      close() ;
+      shm_unlink(ring_name.c_str()) ;
+    }
+  }
+
+  bool log_shm_ring::open()
+  {
+    if (ring!=NULL)
+      return true ;
+    if (failed)
+      return false ;
+    if (not named)
+    {
+      char name[32] ;
+      snprintf(name, sizeof(name), "/qmlog-%d", (int)current_pid()) ;
+      ring_name = name ;
+    }
+    // Made by this process only: an object with the name, left by a dead
+    // process or put there by someone else to read the messages, is
+    // unlinked first (it can't be, if it belongs to another user).
+    int fd = shm_open(ring_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600) ;
+    if (fd<0 and errno==EEXIST)
+    {
+      shm_unlink(ring_name.c_str()) ;
+      fd = shm_open(ring_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600) ;
+    }
+    struct stat st ;
+    bool private_ring = fd>=0 and fstat(fd, &st)==0 and st.st_uid==geteuid() and (st.st_mode & 077)==0 ;
+    void *p = MAP_FAILED ;
+    if (private_ring and ftruncate(fd, sizeof(ring_header_t) + size)==0)
+      p = mmap(NULL, sizeof(ring_header_t) + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) ;
+    if (fd>=0)
+      ::close(fd) ;
+    if (p==MAP_FAILED)
+    {
+      if (fd>=0)
+        shm_unlink(ring_name.c_str()) ;
+      failed = true ;
+      return false ;
+    }
+    ring = (ring_header_t*)p ; // zeros: no messages yet
+    ring->version = ring_version ;
+    ring->size = size ;
+    __atomic_thread_fence(__ATOMIC_RELEASE) ;
+    memcpy(ring->magic, ring_magic, sizeof(ring_magic)) ;
+    return true ;
+  }
+
+  void log_shm_ring::close()
+  {
+    munmap(ring, sizeof(ring_header_t) + size) ;
+    ring = NULL ;
+  }
+
+  // The parent goes on writing its ring
+  void log_shm_ring::after_fork_in_child()
+  {
+    if (ring)
+      close() ;
+    failed = named ;
+    abstract_log_t::after_fork_in_child() ;
+  }
+
+  void log_shm_ring::submit_message(dispatcher_t *, int level, const char *message)
+  {
+    if (not open())
+      return ;
+    unsigned length = strlen(message), room = size/2 - sizeof(ring_message_t) ;
+    if (length > room) // a message takes half of the ring at most
+      length = room ;
+    thread_state_t *state = thread_state() ;
+    state->get_timestamp() ;
+    ring_message_t m ;
+    m.length = length ;
+    m.level = level ;
+    m.sequence = ring->next_sequence ;
+    m.time = state->timestamp.tv_sec * (uint64_t)1000000000 + state->timestamp.tv_usec * (uint64_t)1000 ;
+
+    uint64_t head = ring->head, end = head + padded(sizeof(m) + length), tail = ring->tail ;
+    while (end - tail > size)
+    {
+      ring_message_t old ;
+      copy_out(ring, size, tail, &old, sizeof(old)) ;
+      tail += padded(sizeof(old) + old.length) ;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELAXED) ;
+    __atomic_store_n(&ring->reserved, end, __ATOMIC_RELAXED) ;
+    __atomic_thread_fence(__ATOMIC_RELEASE) ; // a reader seeing the new bytes sees 'reserved'
+    copy_in(ring, size, head, &m, sizeof(m)) ;
+    copy_in(ring, size, head + sizeof(m), message, length) ;
+    ring->next_sequence = m.sequence + 1 ;
+    __atomic_store_n(&ring->head, end, __ATOMIC_RELEASE) ;
+  }
+
+  bool log_shm_ring::tail(const char *name, FILE *out, bool follow)
+  {
+    string path = name ;
+    char *end ;
+    long pid = strtol(name, &end, 10) ;
+    if (*name and *end=='\0')
+    {
+      char by_pid[32] ;
+      snprintf(by_pid, sizeof(by_pid), "/qmlog-%ld", pid) ;
+      path = by_pid ;
+    }
+    int fd = shm_open(path.c_str(), O_RDONLY, 0) ;
+    if (fd<0)
+      return false ;
+    struct stat st ;
+    void *p = MAP_FAILED ;
+    if (fstat(fd, &st)==0 and st.st_size >= (off_t)sizeof(ring_header_t))
+      p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) ;
+    ::close(fd) ;
+    if (p==MAP_FAILED)
+      return false ;
+    const ring_header_t *r = (const ring_header_t*)p ;
+    uint32_t size = r->size ;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE) ;
+    bool valid = memcmp(r->magic, ring_magic, sizeof(ring_magic))==0 and r->version==ring_version ;
+    valid = valid and size>0 and (size & (size-1))==0 and sizeof(ring_header_t) + size <= (uint64_t)st.st_size ;
+    if (not valid)
+    {
+      munmap(p, st.st_size) ;
+      return false ;
+    }
+
+    vector<char> text(size/2) ;
+    uint64_t position = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE), expected = 0 ;
+    bool first = true ;
+    for (;;)
+    {
+      uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) ;
+      while ((int64_t)(head - position) > 0)
+      {
+        ring_message_t m ;
+        copy_out(r, size, position, &m, sizeof(m)) ;
+        bool sane = m.length <= size/2 - sizeof(m) ;
+        if (sane)
+          copy_out(r, size, position + sizeof(m), &text[0], m.length) ;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE) ;
+        if (not sane or __atomic_load_n(&r->reserved, __ATOMIC_RELAXED) - position > size)
+        {
+          position = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) ; // overwritten meanwhile
+          continue ;
+        }
+        if (not first and m.sequence!=expected)
+          fprintf(out, "-- %llu messages lost --\n", (unsigned long long)(m.sequence - expected)) ;
+        first = false ;
+        expected = m.sequence + 1 ;
+        fwrite(&text[0], 1, m.length, out) ;
+        fputc('\n', out) ;
+        position += padded(sizeof(m) + m.length) ;
+      }
+      if (not follow)
+        break ;
+      fflush(out) ;
+      usleep(100000) ;
+    }
+    munmap(p, st.st_size) ;
+    return true ;
+  }
+}
@@ -0,0 +1,176 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <cstdio>
+
+#include <string>
+using namespace std ;
+
+#include "rotation.h"
+
+namespace qmlog
+{
+  rotation_t::rotation_t(const string &p, unsigned long bytes, unsigned seconds, unsigned n, bool gz)
+    : path(p), generations(n), compress(gz and n>0), max_bytes(bytes), max_seconds(seconds)
+  {
+    pthread_mutex_init(&mutex, NULL) ;
+    rotations = 0 ;
+    started = running = false ;
+  }
+
+  rotation_t::~rotation_t()
+  {
+    if (started)
+      pthread_join(compressor, NULL) ;
+    pthread_mutex_destroy(&mutex) ;
+  }
+
+  string rotation_t::name(unsigned generation, bool compressed) const
+  {
+    char suffix[16] ;
+    sprintf(suffix, ".%u", generation) ;
+    return path + suffix + (compressed ? ".gz" : "") ;
+  }
+
+  // .N is dropped, .1 to .N-1 become .2 to .N
+  void rotation_t::shift()
+  {
+    for (unsigned i=generations; i>=1; --i)
+    {
+      for (int gz=0; gz<2; ++gz)
+      {
+        if (i==generations)
+          unlink(name(i, gz).c_str()) ;
+        else
+          rename(name(i, gz).c_str(), name(i+1, gz).c_str()) ;
+      }
+    }
+  }
+
+  int rotation_t::rotate()
+  {
+    pthread_mutex_lock(&mutex) ;
+    shift() ;
+    ++rotations ;
+
+    // The new file replaces the old one by rename(), so 'path' is never
+    // missing; the old one gets its second name before.
+    string fresh = path + ".new" ;
+    int fd = ::open(fresh.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0666) ;
+    if (generations==0 and fd<0)
+      unlink(path.c_str()) ;
+    if (generations>0 and (fd<0 or link(path.c_str(), name(1, false).c_str())<0))
+      rename(path.c_str(), name(1, false).c_str()) ;
+    if (fd>=0 and rename(fresh.c_str(), path.c_str())<0)
+    {
+      close(fd) ;
+      unlink(fresh.c_str()) ;
+      fd = -1 ;
+    }
+
+    if (compress)
+    {
+      to_compress.push_back(rotations) ;
+      if (not running)
+      {
+        if (started) // finished, but not joined yet
+          pthread_join(compressor, NULL) ;
+        started = running = pthread_create(&compressor, NULL, compressor_thread, this)==0 ;
+      }
+    }
+    pthread_mutex_unlock(&mutex) ;
+    return fd ;
+  }
+
+  void rotation_t::before_fork()
+  {
+    pthread_mutex_lock(&mutex) ;
+  }
+
+  void rotation_t::after_fork_in_parent()
+  {
+    pthread_mutex_unlock(&mutex) ;
+  }
+
+  void rotation_t::after_fork_in_child()
+  {
+    to_compress.clear() ;
+    started = running = false ;
+    pthread_mutex_unlock(&mutex) ;
+  }
+
+  void *rotation_t::compressor_thread(void *self)
+  {
+    ((rotation_t *) self)->compress_all() ;
+    return NULL ;
+  }
+
+  void rotation_t::compress_all()
+  {
+    string temporary = path + ".gz.new" ;
+    pthread_mutex_lock(&mutex) ;
+    while (not to_compress.empty())
+    {
+      unsigned long generation = rotations - to_compress.front() + 1 ;
+      int in = generation<=generations ? ::open(name(generation, false).c_str(), O_RDONLY) : -1 ;
+      unsigned long job = to_compress.front() ;
+      to_compress.pop_front() ;
+      if (in<0)
+        continue ;
+      pthread_mutex_unlock(&mutex) ;
+
+      int out = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666) ;
+      bool done = out>=0 and compress_file(in, out) ;
+      close(in) ;
+
+      pthread_mutex_lock(&mutex) ;
+      generation = rotations - job + 1 ; // it may have moved meanwhile
+      if (done and generation<=generations and rename(temporary.c_str(), name(generation, true).c_str())==0)
+        unlink(name(generation, false).c_str()) ;
+      else
+        unlink(temporary.c_str()) ;
+    }
+    running = false ;
+    pthread_mutex_unlock(&mutex) ;
+  }
+
+  // closes 'out'
+  bool rotation_t::compress_file(int in, int out)
+  {
+    gzFile gz = gzdopen(out, "wb") ;
+    if (gz==NULL)
+    {
+      close(out) ;
+      return false ;
+    }
+    bool ok = true ;
+    char buf[64*1024] ;
+    for (ssize_t n; ok and (n = read(in, buf, sizeof(buf))) != 0; )
+      ok = n>0 and gzwrite(gz, buf, n)==n ;
+    return gzclose(gz)==Z_OK and ok ;
+  }
+}
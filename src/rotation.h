@@ -0,0 +1,83 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+
+// Internal header, not installed: renaming and compressing old log files
+
+#ifndef LIBQMLOG_ROTATION_H
+#define LIBQMLOG_ROTATION_H
+
+#include <time.h>
+#include <pthread.h>
+
+#include <string>
+#include <deque>
+
+#include "api2.h"
+
+namespace qmlog
+{
+  // Owned by a log_file, see log_file::set_rotation(). The old files are
+  // 'path'.1 (the newest) to 'path'.N, or 'path'.1.gz... once compressed.
+  // The compression is done by a thread of its own, the names are only
+  // changed with 'mutex' locked, so the thread finds the file it's working
+  // on even if it's been renamed meanwhile.
+  class rotation_t
+  {
+    const std::string path ;
+    const unsigned generations ;
+    const bool compress ;
+    pthread_mutex_t mutex ;
+    unsigned long rotations ;
+    std::deque<unsigned long> to_compress ; // the values of 'rotations' making them
+    pthread_t compressor ;
+    bool started, running ;
+
+    std::string name(unsigned generation, bool compressed) const ;
+    void shift() ;
+    static void *compressor_thread(void *self) ;
+    void compress_all() ;
+    bool compress_file(int in, int out) ;
+  public:
+    const unsigned long max_bytes ;
+    const unsigned max_seconds ;
+
+    rotation_t(const std::string &path, unsigned long max_bytes, unsigned max_seconds, unsigned generations, bool compress) ;
+   ~rotation_t() ; // waits for the compression to be finished
+
+    bool due(unsigned long written, time_t started_at) const
+    {
+      return (max_bytes and written >= max_bytes) or (max_seconds and time(NULL) - started_at >= (time_t)max_seconds) ;
+    }
+    // The file at 'path' becomes the first old one, a new empty file takes
+    // its place at once. Returns the descriptor of the new file, or -1 if
+    // it couldn't be made (then 'path' is free to be opened again).
+    int rotate() ;
+
+    // The files queued before fork() are compressed by the parent, the
+    // child starts a compressor of its own when it rotates.
+    void before_fork() ;
+    void after_fork_in_parent() ;
+    void after_fork_in_child() ;
+  } ;
+}
+
+#endif // LIBQMLOG_ROTATION_H
@@ -0,0 +1,194 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <pthread.h>
+#include <fnmatch.h>
+#include <strings.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include <string>
+#include <vector>
+using namespace std ;
+
+#include "site.h"
+#include "layout.h"
+
+namespace qmlog
+{
+  // All of them are guarded by 'sites_mutex'. Allocated when needed:
+  // a site may be logging before the constructors of this file are run.
+  static pthread_mutex_t sites_mutex = PTHREAD_MUTEX_INITIALIZER ;
+  static unsigned last_site_id = 0 ;
+  static vector<site_t*> *sites = NULL ; // registered ones
+  static vector<site_rule_t> *rules = NULL ;
+
+  static bool matches(const site_rule_t &r, const site_t *site)
+  {
+    if (site->level < r.level)
+      return false ;
+    if (fnmatch(r.file.c_str(), site->file ? site->file : "", 0) != 0)
+      return false ;
+    return r.any_func or fnmatch(r.func.c_str(), site->func ? site->func : "", 0) == 0 ;
+  }
+
+  static void apply_rules(site_t *site)
+  {
+    bool on = true ;
+    if (rules)
+      for (vector<site_rule_t>::const_iterator r = rules->begin(); r != rules->end(); ++r)
+        if (matches(*r, site))
+          on = r->on ;
+    __atomic_store_n(&site->off, not on, __ATOMIC_RELAXED) ;
+  }
+
+  static void apply_rules()
+  {
+    if (sites)
+      for (vector<site_t*>::const_iterator it = sites->begin(); it != sites->end(); ++it)
+        apply_rules(*it) ;
+  }
+
+  void register_site(site_t *site)
+  {
+    pthread_mutex_lock(&sites_mutex) ;
+    if (site->id==0)
+    {
+      if (site->line>0)
+      {
+        // never freed: the site may log again until the process exits
+        record_buffer text ;
+        append(text, "at ") ;
+        append(text, site->file) ;
+        append(text, ":") ;
+        append_number(text, site->line) ;
+        site->location = strcpy(new char[text.position()+1], text.c_str()) ;
+      }
+      if (sites==NULL)
+        sites = new vector<site_t*> ;
+      sites->push_back(site) ;
+      apply_rules(site) ;
+      __atomic_store_n(&site->id, ++last_site_id, __ATOMIC_RELEASE) ;
+    }
+    pthread_mutex_unlock(&sites_mutex) ;
+  }
+
+  void sites_before_fork()
+  {
+    pthread_mutex_lock(&sites_mutex) ;
+  }
+
+  void sites_after_fork()
+  {
+    pthread_mutex_unlock(&sites_mutex) ;
+  }
+
+  void object_t::switch_sites(bool on, const char *file, const char *func, int level)
+  {
+    site_rule_t r ;
+    r.on = on ;
+    r.file = file ? file : "*" ;
+    r.any_func = func==NULL ;
+    r.func = func ? func : "" ;
+    r.level = level ;
+    pthread_mutex_lock(&sites_mutex) ;
+    if (rules==NULL)
+      rules = new vector<site_rule_t> ;
+    rules->push_back(r) ;
+    apply_rules() ;
+    pthread_mutex_unlock(&sites_mutex) ;
+  }
+
+  void object_t::reset_sites()
+  {
+    replace_site_rules(NULL) ;
+  }
+
+  bool parse_level(const char *name, int &level)
+  {
+    static const char *names[] = { "internal", "critical", "error", "warning", "notice", "info", "debug" } ;
+    for (int i=0; i<(int)(sizeof(names)/sizeof(*names)); ++i)
+      if (strcasecmp(name, names[i])==0)
+      {
+        level = qmlog::Internal + i ;
+        return true ;
+      }
+    return false ;
+  }
+
+  int split_words(char *line, char **words, int max)
+  {
+    int n = 0 ;
+    char *rest ; // strtok() would share its state with the application
+    for (char *w = strtok_r(line, " \t\r\n", &rest); w and n<max; w = strtok_r(NULL, " \t\r\n", &rest))
+      words[n++] = w ;
+    return n>0 and words[0][0]=='#' ? 0 : n ;
+  }
+
+  bool parse_site_rule(char *const *words, int n, site_rule_t &r)
+  {
+    r.level = qmlog::Internal ;
+    bool good = 2<=n and n<=4 and (strcmp(words[0], "on")==0 or strcmp(words[0], "off")==0) ;
+    good = good and (n<4 or parse_level(words[3], r.level)) ;
+    if (not good)
+      return false ;
+    r.on = strcmp(words[0], "on")==0 ;
+    r.file = words[1] ;
+    r.any_func = n<3 ;
+    r.func = n<3 ? "" : words[2] ;
+    return true ;
+  }
+
+  void replace_site_rules(vector<site_rule_t> *new_rules)
+  {
+    pthread_mutex_lock(&sites_mutex) ;
+    delete rules ;
+    rules = new_rules ;
+    apply_rules() ;
+    pthread_mutex_unlock(&sites_mutex) ;
+  }
+
+  bool object_t::read_site_rules(const char *path)
+  {
+    FILE *fp = fopen(path, "r") ;
+    if (fp==NULL)
+      return false ;
+    vector<site_rule_t> *new_rules = new vector<site_rule_t> ;
+    bool ok = true ;
+    char line[1024] ;
+    while (fgets(line, sizeof(line), fp))
+    {
+      char *words[5] ;
+      site_rule_t r ;
+      if (int n = split_words(line, words, 5))
+      {
+        if (parse_site_rule(words, n, r))
+          new_rules->push_back(r) ;
+        else
+          ok = false ;
+      }
+    }
+    fclose(fp) ;
+    replace_site_rules(new_rules) ;
+    return ok ;
+  }
+}
@@ -0,0 +1,70 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+
+// Internal header, not installed: registration of the call sites
+
+#ifndef LIBQMLOG_SITE_H
+#define LIBQMLOG_SITE_H
+
+#include <string>
+#include <vector>
+
+#include "api2.h"
+
+namespace qmlog
+{
+  // One line of the rules, see object_t::switch_sites()
+  struct site_rule_t
+  {
+    bool on ;
+    std::string file, func ;
+    bool any_func ;
+    int level ;
+  } ;
+
+  // Gives 'site' its id and location text and switches it on or off by the
+  // current rules, if it has no id yet; called by the first message logged
+  // at a site, maybe by several threads at once.
+  void register_site(site_t *site) ;
+
+  // The rules are replaced as a whole and applied to all the registered
+  // sites; 'new_rules' is taken over, NULL means no rules.
+  void replace_site_rules(std::vector<site_rule_t> *new_rules) ;
+
+  // For the files with the rules: the words of 'line' (changed by it), at
+  // most 'max' of them, none for a comment. A rule is made of the words
+  // "on|off <file pattern> [<function pattern> [<level name>]]".
+  int split_words(char *line, char **words, int max) ;
+  bool parse_site_rule(char *const *words, int n, site_rule_t &r) ;
+  bool parse_level(const char *name, int &level) ; // "debug", "info"...
+
+  // Held across fork(), so the child gets the list and the rules whole
+  void sites_before_fork() ;
+  void sites_after_fork() ;
+
+  inline bool registered(const site_t *site)
+  {
+    return __atomic_load_n(&site->id, __ATOMIC_ACQUIRE) != 0 ;
+  }
+}
+
+#endif // LIBQMLOG_SITE_H
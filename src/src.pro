@@ -5,7 +5,8 @@ QT -= gui
 TARGET = qmlog
 INSTALLS += target usr_include usr_include_libqmlog prf old_header
 
-SOURCES += api2.cpp
+SOURCES += api2.cpp async.cpp thread.cpp record.cpp binary.cpp timezone.cpp layout.cpp mmap.cpp rotation.cpp site.cpp control.cpp fork.cpp structured.cpp journal.cpp syslog_socket.cpp ring.cpp flight.cpp flush.cpp
+LIBS += -lpthread -lz -lrt
 
 target.path = $$(DESTDIR)/usr/lib
 
@@ -13,7 +14,7 @@ usr_include.path = $$(DESTDIR)/usr/include
 usr_include.files = qmlog
 
 usr_include_libqmlog.path = $$(DESTDIR)/usr/include/libqmlog
-usr_include_libqmlog.files = api2.h
+usr_include_libqmlog.files = api2.h format.h
 
 old_header.path = $$(DESTDIR)/usr/include/qm
 old_header.files = log
@@ -0,0 +1,355 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include "api2.h"
+#include "record.h"
+#include "thread.h"
+#include "layout.h"
+#include "structured.h"
+
+namespace qmlog
+{
+  static const char *level_name(int level)
+  {
+    static const char *names[] =
+    {
+      "internal", "critical", "error", "warning", "notice", "info", "debug"
+    } ;
+    if (qmlog::Internal <= level && (unsigned)level <= qmlog::Debug)
+      return names [level-qmlog::Internal] ;
+    return "unknown" ;
+  }
+
+  static void append_unsigned(record_buffer &out, unsigned long long value)
+  {
+    char digits[24], *p = digits + sizeof(digits) ;
+    do
+      *--p = '0' + value % 10 ;
+    while (value /= 10) ;
+    out.append(p, digits + sizeof(digits) - p) ;
+  }
+
+  static void append_signed(record_buffer &out, long long value)
+  {
+    if (value<0)
+    {
+      append(out, "-") ;
+      append_unsigned(out, -(unsigned long long)value) ;
+    }
+    else
+      append_unsigned(out, value) ;
+  }
+
+  // the shortest of %.15g and %.17g giving the same value back
+  static void append_double(record_buffer &out, double value)
+  {
+    char digits[32] ;
+    snprintf(digits, sizeof(digits), "%.15g", value) ;
+    if (strtod(digits, NULL)!=value)
+      snprintf(digits, sizeof(digits), "%.17g", value) ;
+    append(out, digits) ;
+  }
+
+  // '"' and '\' escaped, control characters as \n, \t... or \u00XX; the
+  // bytes from 0x80 on are copied: UTF-8 stays UTF-8
+  static void append_quoted(record_buffer &out, const char *s)
+  {
+    static const char hex[] = "0123456789abcdef" ;
+    if (s==NULL)
+      s = "(null)" ;
+    append(out, "\"") ;
+    const char *run = s ; // copied at once up to the next character to escape
+    for (; *s; ++s)
+    {
+      unsigned char c = *s ;
+      if (c>=0x20 and c!='"' and c!='\\')
+        continue ;
+      out.append(run, s-run) ;
+      run = s+1 ;
+      switch (c)
+      {
+        case '"': append(out, "\\\"") ; break ;
+        case '\\': append(out, "\\\\") ; break ;
+        case '\n': append(out, "\\n") ; break ;
+        case '\r': append(out, "\\r") ; break ;
+        case '\t': append(out, "\\t") ; break ;
+        default:
+        {
+          char u[6] = { '\\', 'u', '0', '0', hex[c>>4], hex[c&15] } ;
+          out.append(u, sizeof(u)) ;
+        }
+      }
+    }
+    out.append(run, s-run) ;
+    append(out, "\"") ;
+  }
+
+  static void append_logfmt_string(record_buffer &out, const char *s)
+  {
+    bool plain = s!=NULL and *s!='\0' ;
+    for (const char *p = s; plain and *p; ++p)
+      plain = (unsigned char)*p>0x20 and *p!='"' and *p!='=' and *p!='\\' and *p!=0x7f ;
+    if (plain)
+      append(out, s) ;
+    else
+      append_quoted(out, s) ;
+  }
+
+  // writes the pairs of a message, with JSON or logfmt syntax
+  class pairs_t
+  {
+    record_buffer &out ;
+    bool json, first ;
+  public:
+    pairs_t(record_buffer &o, bool j) : out(o), json(j), first(true)
+    {
+      if (json)
+        append(out, "{") ;
+    }
+    void finish()
+    {
+      if (json)
+        append(out, "}") ;
+    }
+    void key(const char *k)
+    {
+      if (not first)
+        append(out, json ? "," : " ") ;
+      first = false ;
+      if (json)
+      {
+        append_quoted(out, k) ;
+        append(out, ":") ;
+      }
+      else
+      {
+        append_logfmt_string(out, k) ; // quoted as well if it would break the pair
+        append(out, "=") ;
+      }
+    }
+    void string(const char *k, const char *value)
+    {
+      key(k) ;
+      if (json)
+        append_quoted(out, value) ;
+      else
+        append_logfmt_string(out, value) ;
+    }
+    void raw(const char *k, const char *value) // a number or a timestamp
+    {
+      key(k) ;
+      append(out, value) ;
+    }
+    void number(const char *k, long value)
+    {
+      key(k) ;
+      append_number(out, value) ;
+    }
+    void value(const kv_t &e)
+    {
+      key(e.key) ;
+      switch (e.type)
+      {
+        case kv_t::String:
+          if (json)
+            append_quoted(out, e.value.s) ;
+          else
+            append_logfmt_string(out, e.value.s) ;
+          break ;
+        case kv_t::Signed:
+          append_signed(out, e.value.i) ;
+          break ;
+        case kv_t::Unsigned:
+          append_unsigned(out, e.value.u) ;
+          break ;
+        case kv_t::Double:
+          if (json and not std::isfinite(e.value.d))
+            append(out, "null") ;
+          else
+            append_double(out, e.value.d) ;
+          break ;
+        case kv_t::Boolean:
+          append(out, e.value.b ? "true" : "false") ;
+          break ;
+      }
+    }
+  } ;
+
+  void append_logfmt_pairs(record_buffer &out, const kv_list_t &kv)
+  {
+    pairs_t pairs(out, false) ;
+    for (unsigned i=0; i<kv.size(); ++i)
+      pairs.value(kv[i]) ;
+  }
+
+  // RFC 3339: 2010-06-01T13:14:15.123456+03:00
+  static void append_timestamp(record_buffer &out, thread_state_t *state, int mask)
+  {
+    append(out, state->str_date()) ;
+    append(out, "T") ;
+    append(out, state->str_time()) ;
+    int precision = mask & qmlog::Time_Mask ;
+    if (precision==qmlog::Time_Micro)
+      append(out, "."), append(out, state->str_time_micro()) ;
+    else if (precision==qmlog::Time_Milli)
+      append(out, "."), append(out, state->str_time_milli()) ;
+    long offset = state->localtime_valid ? state->localtime.tm_gmtoff : 0 ;
+    char zone[8] = { offset<0 ? '-' : '+' } ;
+    if (offset<0)
+      offset = -offset ;
+    offset /= 60 ;
+    snprintf(zone+1, sizeof(zone)-1, "%02ld:%02ld", offset/60 % 100, offset%60) ;
+    append(out, zone) ;
+  }
+
+  static void append_monotonic(record_buffer &out, thread_state_t *state, int mask)
+  {
+    append(out, state->str_monotonic()) ;
+    int precision = mask & qmlog::Monotonic_Mask ;
+    if (precision==qmlog::Monotonic_Nano)
+      append(out, "."), append(out, state->str_monotonic_nano()) ;
+    else if (precision==qmlog::Monotonic_Micro)
+      append(out, "."), append(out, state->str_monotonic_micro()) ;
+    else if (precision==qmlog::Monotonic_Milli)
+      append(out, "."), append(out, state->str_monotonic_milli()) ;
+  }
+
+  static void append_structured(record_buffer &buf, bool json, int mask, dispatcher_t *d, thread_state_t *state, const site_t *site, const char *fmt, va_list args)
+  {
+    pairs_t pairs(buf, json) ;
+    if (mask & (qmlog::Date|qmlog::Time_Mask))
+    {
+      pairs.key("time") ;
+      if (json)
+        append(buf, "\"") ;
+      append_timestamp(buf, state, mask) ;
+      if (json)
+        append(buf, "\"") ;
+    }
+    if (mask & qmlog::Monotonic_Mask)
+    {
+      pairs.key("mono") ;
+      append_monotonic(buf, state, mask) ;
+    }
+    if (mask & qmlog::Level)
+      pairs.string("level", level_name(site->level)) ;
+    if (mask & qmlog::Name)
+      pairs.string("name", d->str_name()) ;
+    if (mask & qmlog::Pid)
+      pairs.raw("pid", state->str_pid()) ;
+    if (site->line>0 and (mask & qmlog::Line))
+    {
+      pairs.string("file", site->file) ;
+      pairs.number("line", site->line) ;
+    }
+    if (site->func!=NULL and (mask & qmlog::Function))
+      pairs.string("func", site->func) ;
+    if (*fmt!='\0' and (mask & qmlog::Message))
+    {
+      if (fmt[0]=='%' and fmt[1]=='s' and fmt[2]=='\0') // replayed: no need to copy the text
+      {
+        va_list copy ;
+        va_copy(copy, args) ;
+        pairs.string("msg", va_arg(copy, const char *)) ;
+        va_end(copy) ;
+      }
+      else
+      {
+        smart_buffer<1024> text ;
+        text.vprintf(fmt, args) ;
+        pairs.string("msg", text.c_str()) ;
+      }
+    }
+    if (const kv_list_t *kv = state->kv)
+      for (unsigned i=0; i<kv->size(); ++i)
+        pairs.value((*kv)[i]) ;
+    pairs.finish() ;
+  }
+
+  void log_file::compose_structured(bool json, dispatcher_t *d, const site_t *site, const char *fmt, va_list args)
+  {
+    thread_state_t *state = thread_state() ;
+    smart_buffer<1024> nested ; // only used if a log is logging from submit_message()
+    bool was_composing = state->composing ;
+    record_buffer &buf = was_composing ? nested : state->line ;
+    state->composing = true ;
+    buf.rewind() ;
+    append_structured(buf, json, fields & All_Fields, d, state, site, fmt, args) ;
+    deliver(d, site->level, buf.c_str()) ;
+    state->composing = was_composing ;
+  }
+
+  static const int structured_fields = Date | Time_Micro | Level | Name | Pid | Line | Function | Message ;
+
+  log_json::log_json(const char *path, int maximal_log_level, dispatcher_t *d)
+    : log_file(maximal_log_level, path)
+  {
+    set_fields(structured_fields) ;
+    attach_to(d) ;
+  }
+
+  log_json::log_json(FILE *fp, int maximal_log_level, dispatcher_t *d)
+    : log_file(maximal_log_level, fp)
+  {
+    set_fields(structured_fields) ;
+    attach_to(d) ;
+  }
+
+  log_json::~log_json()
+  {
+    detach_all() ;
+  }
+
+  void log_json::compose_message(dispatcher_t *d, const site_t *site, const char *fmt, va_list args)
+  {
+    compose_structured(true, d, site, fmt, args) ;
+  }
+
+  log_logfmt::log_logfmt(const char *path, int maximal_log_level, dispatcher_t *d)
+    : log_file(maximal_log_level, path)
+  {
+    set_fields(structured_fields) ;
+    attach_to(d) ;
+  }
+
+  log_logfmt::log_logfmt(FILE *fp, int maximal_log_level, dispatcher_t *d)
+    : log_file(maximal_log_level, fp)
+  {
+    set_fields(structured_fields) ;
+    attach_to(d) ;
+  }
+
+  log_logfmt::~log_logfmt()
+  {
+    detach_all() ;
+  }
+
+  void log_logfmt::compose_message(dispatcher_t *d, const site_t *site, const char *fmt, va_list args)
+  {
+    compose_structured(false, d, site, fmt, args) ;
+  }
+}
@@ -0,0 +1,38 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+
+// Internal header, not installed: the key/value pairs as text
+
+#ifndef LIBQMLOG_STRUCTURED_H
+#define LIBQMLOG_STRUCTURED_H
+
+#include "api2.h"
+#include "record.h"
+
+namespace qmlog
+{
+  // key=value separated by spaces, the values quoted when they contain
+  // spaces, quotes, '=' or control characters (escaped as in JSON)
+  void append_logfmt_pairs(record_buffer &out, const kv_list_t &kv) ;
+}
+
+#endif // LIBQMLOG_STRUCTURED_H
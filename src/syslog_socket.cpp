@@ -0,0 +1,370 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "api2.h"
+#include "thread.h"
+#include "record.h"
+#include "layout.h"
+#include "flush.h"
+
+namespace qmlog
+{
+  log_syslog_socket::log_syslog_socket(const char *path, int maximal_log_level, dispatcher_t *d, int header_format)
+    : abstract_log_t(maximal_log_level), socket_path(path), format(header_format)
+  {
+    disable_fields(Timestamp_Mask) ;
+    disable_fields(Process_Block) ;
+    disable_fields(Multiline) ;
+    disable_fields(Timezone_Symlink) ;
+    fd = -1 ;
+    stream = false ;
+    next_connect = 0 ;
+    char host[HOST_NAME_MAX+1] ;
+    if (gethostname(host, sizeof(host))==0)
+      host[sizeof(host)-1] = '\0', hostname = host ;
+    if (hostname.empty())
+      hostname = "-" ;
+    header_second = 0 ;
+    header_pid = 0 ;
+    first_sent = 0 ;
+    max_pending = 64*1024 ;
+    flush_bytes = flush_milliseconds = 0 ;
+    flush_level = Error ;
+    lost = 0 ;
+    attach_to(d) ;
+  }
+
+  log_syslog_socket::~log_syslog_socket()
+  {
+    detach_all() ;
+    send_pending() ; // the last chance, without waiting
+    lost += lengths.size() ;
+    if (fd>=0)
+      ::close(fd) ;
+  }
+
+  static time_t monotonic_seconds()
+  {
+    struct timespec now ;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now) ;
+    return now.tv_sec ;
+  }
+
+  // a datagram socket like the one of syslogd or journald, or a stream
+  // one, if connecting to the datagram one fails with EPROTOTYPE
+  bool log_syslog_socket::connect_socket()
+  {
+    if (fd>=0)
+      return true ;
+    time_t now = monotonic_seconds() ;
+    if (now < next_connect)
+      return false ;
+    next_connect = now + 1 ;
+    struct sockaddr_un address ;
+    memset(&address, 0, sizeof(address)) ;
+    address.sun_family = AF_UNIX ;
+    if (socket_path.size() >= sizeof(address.sun_path))
+      return false ;
+    memcpy(address.sun_path, socket_path.data(), socket_path.size()) ;
+    static const int types[] = { SOCK_DGRAM, SOCK_STREAM } ;
+    for (int i=0; i<2; ++i)
+    {
+      fd = socket(AF_UNIX, types[i] | SOCK_NONBLOCK | SOCK_CLOEXEC, 0) ;
+      if (fd<0)
+        return false ;
+      if (connect(fd, (struct sockaddr *)&address, sizeof(address))==0)
+      {
+        stream = types[i]==SOCK_STREAM ;
+        return true ;
+      }
+      bool wrong_type = errno==EPROTOTYPE ;
+      ::close(fd) ;
+      fd = -1 ;
+      if (not wrong_type)
+        break ;
+    }
+    return false ;
+  }
+
+  // A message partly written to a stream can't be continued on the next one
+  void log_syslog_socket::disconnect()
+  {
+    if (stream and first_sent>0)
+      drop_first() ;
+    ::close(fd) ;
+    fd = -1 ;
+    next_connect = monotonic_seconds() + 1 ;
+  }
+
+  void log_syslog_socket::drop_first()
+  {
+    pending.erase(0, lengths.front()) ;
+    lengths.erase(lengths.begin()) ;
+    first_sent = 0 ;
+    ++lost ;
+  }
+
+  // the header of the messages of this second, except the priority
+  void log_syslog_socket::make_header(dispatcher_t *d)
+  {
+    struct timespec now ;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now) ;
+    pid_t pid = current_pid() ;
+    const char *name = d->str_name() ;
+    if (now.tv_sec==header_second and pid==header_pid and header_name==name)
+      return ;
+    header_second = now.tv_sec ;
+    header_pid = pid ;
+    header_name = name ;
+
+    struct tm t ;
+    localtime_r(&header_second, &t) ;
+    header.rewind() ;
+    if (format==Rfc5424)
+    {
+      long offset = t.tm_gmtoff / 60 ;
+      char sign = offset<0 ? '-' : '+' ;
+      if (offset<0)
+        offset = -offset ;
+      header.printf("1 %04d-%02d-%02dT%02d:%02d:%02d%c%02ld:%02ld %s %s %d - - ",
+                    t.tm_year+1900, t.tm_mon+1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec,
+                    sign, offset/60, offset%60, hostname.c_str(), *name ? name : "-", (int)pid) ;
+    }
+    else
+    {
+      static const char *months[] =
+      {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+      } ;
+      header.printf("%s %2d %02d:%02d:%02d %s[%d]: ", months[t.tm_mon], t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec, name, (int)pid) ;
+    }
+  }
+
+  void log_syslog_socket::submit_message(dispatcher_t *d, int level, const char *message)
+  {
+    static int syslog_names[] =
+    {
+      LOG_ALERT, LOG_CRIT, LOG_ERR, LOG_WARNING, LOG_NOTICE, LOG_INFO, LOG_DEBUG
+    } ;
+    bool known = qmlog::Internal<=level and level<=qmlog::Debug ;
+    make_header(d) ;
+    buf.rewind() ;
+    append(buf, "<") ;
+    append_number(buf, LOG_DAEMON | (known ? syslog_names[level-qmlog::Internal] : LOG_DEBUG)) ;
+    append(buf, ">") ;
+    buf.append(header.c_str(), header.position()) ;
+    append(buf, message) ;
+    unsigned length = buf.position() ;
+
+    if (not pending.empty() and pending.size() + length > max_pending)
+      send_pending() ; // may make room
+    if (not pending.empty() and pending.size() + length > max_pending)
+    {
+      ++lost ;
+      return ;
+    }
+
+    bool full = pending.size() + length >= flush_bytes or level <= flush_level ;
+    if (flush_milliseconds)
+    {
+      struct timespec now ;
+      clock_gettime(CLOCK_MONOTONIC_COARSE, &now) ;
+      if (pending.empty())
+        pending_since = now ;
+      long long age = (now.tv_sec - pending_since.tv_sec) * 1000LL + (now.tv_nsec - pending_since.tv_nsec) / 1000000 ;
+      full = full or age >= flush_milliseconds ;
+    }
+    if (pending.empty() and flush_milliseconds and not full)
+      flush_timer_t::arm(this, flush_timer_t::deadline(pending_since, flush_milliseconds)) ;
+    pending.append(buf.c_str(), length) ;
+    lengths.push_back(length) ;
+    if (full)
+      send_pending() ;
+  }
+
+  // As many of the pending messages as the socket takes now, up to 64 in a
+  // system call; the rest waits for the next message or flush_buffer()
+  void log_syslog_socket::send_pending()
+  {
+    enum { batch = 64 } ;
+    while (not lengths.empty() and connect_socket())
+    {
+      unsigned count = std::min<size_t>(lengths.size(), batch), sent = 0 ;
+      struct iovec iov[2*batch] ; // a stream has a prefix or a terminator as well
+      char prefixes[batch][16] ;
+      const char *p = pending.data() ;
+      if (not stream)
+      {
+        struct mmsghdr messages[batch] ;
+        memset(messages, 0, sizeof(messages)) ;
+        for (unsigned i=0; i<count; p += lengths[i++])
+        {
+          iov[i].iov_base = const_cast<char*>(p) ;
+          iov[i].iov_len = lengths[i] ;
+          messages[i].msg_hdr.msg_iov = &iov[i] ;
+          messages[i].msg_hdr.msg_iovlen = 1 ;
+        }
+        int res = sendmmsg(fd, messages, count, MSG_NOSIGNAL | MSG_DONTWAIT) ;
+        if (res<0 and errno==EINTR)
+          continue ;
+        if (res<0 and errno==EMSGSIZE)
+        {
+          drop_first() ;
+          continue ;
+        }
+        if (res<0 and errno!=EAGAIN and errno!=EWOULDBLOCK and errno!=ENOBUFS)
+          disconnect() ; // the daemon is gone
+        if (res<=0)
+          return ;
+        sent = res ;
+      }
+      else
+      {
+        // RFC 6587: octet counting for RFC 5424, '\0' after the message for RFC 3164
+        int n = 0 ;
+        for (unsigned i=0; i<count; p += lengths[i++])
+        {
+          if (format==Rfc5424)
+          {
+            iov[n].iov_base = prefixes[i] ;
+            iov[n++].iov_len = snprintf(prefixes[i], sizeof(prefixes[i]), "%u ", lengths[i]) ;
+          }
+          iov[n].iov_base = const_cast<char*>(p) ;
+          iov[n++].iov_len = lengths[i] ;
+          if (format!=Rfc5424)
+          {
+            iov[n].iov_base = const_cast<char*>("") ;
+            iov[n++].iov_len = 1 ;
+          }
+        }
+        // skip what was written already of the first one
+        struct iovec *first = iov ;
+        for (unsigned skip = first_sent; skip>0; )
+        {
+          unsigned part = std::min<size_t>(skip, first->iov_len) ;
+          first->iov_base = (char*)first->iov_base + part ;
+          first->iov_len -= part ;
+          skip -= part ;
+          if (first->iov_len==0)
+            ++first, --n ;
+        }
+        struct msghdr m ;
+        memset(&m, 0, sizeof(m)) ;
+        m.msg_iov = first ;
+        m.msg_iovlen = n ;
+        ssize_t res = sendmsg(fd, &m, MSG_NOSIGNAL | MSG_DONTWAIT) ;
+        if (res<0 and errno==EINTR)
+          continue ;
+        if (res<0 and errno!=EAGAIN and errno!=EWOULDBLOCK)
+          disconnect() ;
+        if (res<=0)
+          return ;
+        // whole messages written, the rest of the first one not written
+        size_t written = res + first_sent ;
+        for (; sent<count; ++sent)
+        {
+          size_t framed = lengths[sent] + (format==Rfc5424 ? strlen(prefixes[sent]) : 1) ;
+          if (written<framed)
+            break ;
+          written -= framed ;
+        }
+        first_sent = written ;
+      }
+      size_t bytes = 0 ;
+      for (unsigned i=0; i<sent; ++i)
+        bytes += lengths[i] ;
+      pending.erase(0, bytes) ;
+      lengths.erase(lengths.begin(), lengths.begin()+sent) ;
+      if (sent<count)
+        return ; // the socket is full
+    }
+  }
+
+  void log_syslog_socket::set_flush_policy(unsigned bytes, unsigned milliseconds, int level)
+  {
+    pthread_mutex_lock(&mutex) ;
+    flush_bytes = bytes ;
+    flush_milliseconds = milliseconds ;
+    flush_level = level ;
+    send_pending() ;
+    pthread_mutex_unlock(&mutex) ;
+  }
+
+  void log_syslog_socket::set_max_pending(unsigned bytes)
+  {
+    pthread_mutex_lock(&mutex) ;
+    max_pending = bytes ;
+    pthread_mutex_unlock(&mutex) ;
+  }
+
+  void log_syslog_socket::flush_buffer()
+  {
+    send_pending() ;
+    if (not pending.empty() and flush_milliseconds) // the socket is full: try again later
+    {
+      struct timespec now ;
+      clock_gettime(CLOCK_MONOTONIC, &now) ;
+      flush_timer_t::arm(this, flush_timer_t::deadline(now, flush_milliseconds)) ;
+    }
+  }
+
+  unsigned long log_syslog_socket::dropped()
+  {
+    pthread_mutex_lock(&mutex) ;
+    unsigned long count = lost ;
+    pthread_mutex_unlock(&mutex) ;
+    return count ;
+  }
+
+  // The parent sends what it kept back; a stream shared with it would mix
+  // the messages of both
+  void log_syslog_socket::after_fork_in_child()
+  {
+    pending.clear() ;
+    lengths.clear() ;
+    first_sent = 0 ;
+    if (stream and fd>=0)
+    {
+      ::close(fd) ;
+      fd = -1 ;
+      next_connect = 0 ;
+    }
+    abstract_log_t::after_fork_in_child() ;
+  }
+}
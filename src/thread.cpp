@@ -0,0 +1,454 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <sched.h>
+
+#include <cstring>
+
+#include "thread.h"
+#include "timezone.h"
+
+namespace qmlog
+{
+  static pthread_once_t key_once = PTHREAD_ONCE_INIT ;
+  static pthread_key_t key ;
+  static __thread thread_state_t *current_state = NULL ;
+
+  static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER ;
+  static thread_state_t *registry = NULL ;
+  static unsigned long global_epoch = 1 ;
+
+  static pthread_mutex_t config_mutex ;
+
+  static pid_t cached_pid = 0 ;
+
+  static void thread_exit(void *p)
+  {
+    thread_state_t *state = static_cast<thread_state_t*>(p) ;
+    pthread_mutex_lock(&registry_mutex) ;
+    for (thread_state_t **q = &registry; *q; q = &(*q)->next)
+      if (*q==state)
+      {
+        *q = state->next ;
+        break ;
+      }
+    pthread_mutex_unlock(&registry_mutex) ;
+    current_state = NULL ;
+    delete state ;
+  }
+
+  static void init_config_mutex()
+  {
+    pthread_mutexattr_t attr ;
+    pthread_mutexattr_init(&attr) ;
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE) ;
+    pthread_mutex_init(&config_mutex, &attr) ;
+    pthread_mutexattr_destroy(&attr) ;
+  }
+
+  static void init_once()
+  {
+    pthread_key_create(&key, thread_exit) ;
+    init_config_mutex() ;
+  }
+
+  thread_state_t *thread_state()
+  {
+    if (current_state==NULL)
+    {
+      pthread_once(&key_once, init_once) ;
+      thread_state_t *state = new thread_state_t ;
+      pthread_mutex_lock(&registry_mutex) ;
+      state->next = registry ;
+      registry = state ;
+      pthread_mutex_unlock(&registry_mutex) ;
+      pthread_setspecific(key, state) ;
+      current_state = state ;
+    }
+    return current_state ;
+  }
+
+  thread_state_t::thread_state_t()
+  {
+    epoch = 0 ;
+    nesting = 0 ;
+    next = NULL ;
+    last_pid = (pid_t) 0 ;
+    foreign_pid = (pid_t) 0 ;
+    foreign_tz_symlink = NULL ;
+    composing = false ;
+    kv = NULL ;
+    dispatch_serial = last_serial = 0 ;
+    for (int i=0; i<composed_slots; ++i)
+      composed[i].serial = 0 ;
+    localtime_valid = timezone_checked = false ;
+    has_date = has_time = has_gmt_offset = has_tz_symlink = false ;
+    new_message() ;
+  }
+
+  read_section_t::read_section_t()
+  {
+    state = thread_state() ;
+    if (state->nesting++ == 0)
+    {
+      __atomic_store_n(&state->epoch, __atomic_load_n(&global_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED) ;
+      // pairs with the increment of global_epoch in synchronize_readers():
+      // either the writer sees us reading, or we see the new pointers
+      __atomic_thread_fence(__ATOMIC_SEQ_CST) ;
+    }
+  }
+
+  read_section_t::~read_section_t()
+  {
+    if (--state->nesting == 0)
+      __atomic_store_n(&state->epoch, 0, __ATOMIC_RELEASE) ;
+  }
+
+  void synchronize_readers()
+  {
+    thread_state_t *self = thread_state() ;
+    pthread_mutex_lock(&registry_mutex) ;
+    unsigned long epoch = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST) ;
+    for (thread_state_t *state = registry; state; state = state->next)
+    {
+      if (state==self) // our own section is not using the old data any more
+        continue ;
+      for(;;)
+      {
+        unsigned long e = __atomic_load_n(&state->epoch, __ATOMIC_ACQUIRE) ;
+        if (e==0 or e>=epoch)
+          break ;
+        sched_yield() ;
+      }
+    }
+    pthread_mutex_unlock(&registry_mutex) ;
+  }
+
+  config_lock_t::config_lock_t()
+  {
+    pthread_once(&key_once, init_once) ;
+    pthread_mutex_lock(&config_mutex) ;
+  }
+
+  config_lock_t::~config_lock_t()
+  {
+    pthread_mutex_unlock(&config_mutex) ;
+  }
+
+  pid_t current_pid()
+  {
+    pid_t pid = __atomic_load_n(&cached_pid, __ATOMIC_RELAXED) ;
+    if (pid==0)
+      __atomic_store_n(&cached_pid, pid = getpid(), __ATOMIC_RELAXED) ;
+    return pid ;
+  }
+
+  void config_before_fork()
+  {
+    pthread_once(&key_once, init_once) ;
+    pthread_mutex_lock(&config_mutex) ;
+  }
+
+  void registry_before_fork()
+  {
+    pthread_mutex_lock(&registry_mutex) ;
+  }
+
+  void locks_after_fork_in_parent()
+  {
+    pthread_mutex_unlock(&registry_mutex) ;
+    pthread_mutex_unlock(&config_mutex) ;
+  }
+
+  // The threads of the parent may have been in a read section: they would
+  // be waited for forever. The recursive lock knows its owner by the
+  // thread id, which is not the same in the child: it is made again.
+  void locks_after_fork_in_child()
+  {
+    cached_pid = 0 ;
+    thread_state_t *others = registry ;
+    registry = NULL ;
+    while (thread_state_t *state = others)
+    {
+      others = state->next ;
+      if (state==current_state)
+      {
+        state->next = NULL ;
+        registry = state ;
+      }
+      else
+        delete state ;
+    }
+    pthread_mutex_init(&registry_mutex, NULL) ;
+    init_config_mutex() ;
+  }
+
+  // 'width' digits, zero padded: the sub-second parts of the timestamps
+  static void format_fraction(char *out, unsigned long value, int width)
+  {
+    out[width] = '\0' ;
+    for (int i=width-1; i>=0; --i, value /= 10)
+      out[i] = '0' + value % 10 ;
+  }
+
+  static void format_unsigned(char *out, unsigned long long value)
+  {
+    char digits[24] ;
+    int n = 0 ;
+    do
+      digits[n++] = '0' + value % 10 ;
+    while (value /= 10) ;
+    while (n>0)
+      *out++ = digits[--n] ;
+    *out = '\0' ;
+  }
+
+  void thread_state_t::new_message()
+  {
+    // has_date, has_time and has_gmt_offset are valid as long as the second is the same,
+    // has_tz_symlink as long as the timezone is
+    got_timestamp = got_localtime =
+      has_monotonic = has_monotonic_nano = has_monotonic_micro = has_monotonic_milli =
+      has_time_micro = has_time_milli = false ;
+  }
+
+  void thread_state_t::get_timestamp()
+  {
+    if (not got_timestamp)
+    {
+      // Not checking, if call is successful: nothing can be done even if not
+      clock_gettime(CLOCK_MONOTONIC, &monotonic_timestamp) ;
+      gettimeofday(&timestamp, NULL) ;
+      got_timestamp = true ;
+    }
+  }
+
+  void thread_state_t::set_timestamp(const struct timespec &monotonic, const struct timeval &real)
+  {
+    monotonic_timestamp = monotonic ;
+    timestamp = real ;
+    got_timestamp = true ;
+  }
+
+  void thread_state_t::get_localtime()
+  {
+    if (not got_localtime)
+    {
+      check_timezone() ;
+      if (not localtime_valid or localtime_second != timestamp.tv_sec)
+      {
+        if (not localtime_r(&timestamp.tv_sec, &localtime))
+        {
+          // theoretically localtime_r() may fail on a 64 bit architecture
+          // due to year value overflow, let's fill the structure with zeroes
+          // then...
+          memset(&localtime, 0, sizeof(struct tm)) ;
+        }
+        localtime_second = timestamp.tv_sec ;
+        localtime_valid = true ;
+        has_date = has_time = has_gmt_offset = false ;
+      }
+      got_localtime = true ;
+    }
+  }
+
+  unsigned long thread_state_t::begin_dispatch()
+  {
+    unsigned long previous = dispatch_serial ;
+    dispatch_serial = ++last_serial ;
+    return previous ;
+  }
+
+  void thread_state_t::forget_localtime()
+  {
+    timezone_checked = localtime_valid = got_localtime = false ;
+  }
+
+  void thread_state_t::check_timezone()
+  {
+    get_timestamp() ;
+    if (timezone_checked and timezone_second == timestamp.tv_sec)
+      return ;
+    unsigned long generation = timezone_watcher_t::generation(timestamp.tv_sec) ;
+    if (not timezone_checked or generation != timezone_generation)
+    {
+      tzset() ;
+      timezone_generation = generation ;
+      localtime_valid = got_localtime = has_tz_symlink = false ;
+    }
+    timezone_second = timestamp.tv_sec ;
+    timezone_checked = true ;
+  }
+
+  const char *thread_state_t::str_monotonic()
+  {
+    if (not has_monotonic)
+    {
+      get_timestamp() ;
+      format_unsigned(s_mono, monotonic_timestamp.tv_sec) ;
+      has_monotonic = true ;
+    }
+    return s_mono ;
+  }
+
+  const char *thread_state_t::str_monotonic_nano()
+  {
+    if (not has_monotonic_nano)
+    {
+      get_timestamp() ;
+      format_fraction(s_mono_nano, monotonic_timestamp.tv_nsec, 9) ;
+      has_monotonic_nano = true ;
+    }
+    return s_mono_nano ;
+  }
+
+  const char *thread_state_t::str_monotonic_micro()
+  {
+    if (not has_monotonic_micro)
+    {
+      get_timestamp() ;
+      format_fraction(s_mono_micro, monotonic_timestamp.tv_nsec / 1000, 6) ;
+      has_monotonic_micro = true ;
+    }
+    return s_mono_micro ;
+  }
+
+  const char *thread_state_t::str_monotonic_milli()
+  {
+    if (not has_monotonic_milli)
+    {
+      get_timestamp() ;
+      format_fraction(s_mono_milli, monotonic_timestamp.tv_nsec / (1000*1000), 3) ;
+      has_monotonic_milli = true ;
+    }
+    return s_mono_milli ;
+  }
+
+  const char *thread_state_t::str_time()
+  {
+    get_localtime() ; // may forget the strings of the previous second
+    if (not has_time)
+    {
+      s_time.rewind() ;
+      s_time.printf("%02d:%02d:%02d", localtime.tm_hour, localtime.tm_min, localtime.tm_sec) ;
+      has_time = true ;
+    }
+    return s_time.c_str() ;
+  }
+
+  const char *thread_state_t::str_time_micro()
+  {
+    if (not has_time_micro)
+    {
+      get_timestamp() ;
+      format_fraction(s_time_micro, timestamp.tv_usec, 6) ;
+      has_time_micro = true ;
+    }
+    return s_time_micro ;
+  }
+
+  const char *thread_state_t::str_time_milli()
+  {
+    if (not has_time_milli)
+    {
+      get_timestamp() ;
+      format_fraction(s_time_milli, timestamp.tv_usec / 1000, 3) ;
+      has_time_milli = true ;
+    }
+    return s_time_milli ;
+  }
+
+  const char *thread_state_t::str_gmt_offset()
+  {
+    get_localtime() ; // may forget the strings of the previous second
+    if (not has_gmt_offset)
+    {
+      s_gmt_offset.rewind() ;
+      int sec = localtime.tm_gmtoff ;
+      char sign = sec<0 ? (sec = -sec, '-') : '+' ;
+      int min = sec/60, hour = min/60 ;
+      sec %= 60, min %=60 ;
+      // s_gmt_offset.printf("GMT") ;
+      if (sec)
+        s_gmt_offset.printf("%c" "%d:%02d:%02d", sign, hour, min, sec) ;
+      else if(min)
+        s_gmt_offset.printf("%c" "%d:%02d", sign, hour, min) ;
+      else
+        s_gmt_offset.printf("%c" "%d", sign, hour) ;
+      has_gmt_offset = true ;
+    }
+    return s_gmt_offset.c_str() ;
+  }
+
+  const char *thread_state_t::str_tz_symlink()
+  {
+    if (foreign_tz_symlink)
+      return foreign_tz_symlink ;
+    check_timezone() ;
+    if (not has_tz_symlink)
+    {
+      s_tz_symlink.rewind() ;
+      if (s_tz_symlink.readlink("/etc/localtime")<0)
+      {
+        s_tz_symlink.printf("%m") ;
+        tz_symlink_offset = 0 ;
+      }
+      else
+      {
+        static const char base[] = "/usr/share/zoneinfo/" ;
+        static const int base_len = sizeof(base) - 1 ;
+        tz_symlink_offset = strncmp(s_tz_symlink.c_str(), base, base_len) ? 0 : base_len ;
+      }
+      has_tz_symlink = true ;
+    }
+    return s_tz_symlink.c_str() + tz_symlink_offset ;
+  }
+
+  const char *thread_state_t::str_date()
+  {
+    get_localtime() ; // may forget the strings of the previous second
+    if (not has_date)
+    {
+      s_date.rewind() ;
+      s_date.printf("%d-%02d-%02d", localtime.tm_year+1900, localtime.tm_mon+1, localtime.tm_mday) ;
+      has_date = true ;
+    }
+    return s_date.c_str() ;
+  }
+
+  const char *thread_state_t::str_tz_abbreviation()
+  {
+    get_localtime() ;
+    return localtime.tm_zone ;
+  }
+
+  const char *thread_state_t::str_pid()
+  {
+    pid_t pid = foreign_pid ? foreign_pid : current_pid() ;
+    if (last_pid != pid)
+    {
+      s_pid.rewind() ;
+      s_pid.printf("%d", pid) ;
+      last_pid = pid ;
+    }
+    return s_pid.c_str() ;
+  }
+}
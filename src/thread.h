@@ -0,0 +1,181 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+
+// Internal header, not installed: per-thread state of the library
+
+#ifndef LIBQMLOG_THREAD_H
+#define LIBQMLOG_THREAD_H
+
+#include <pthread.h>
+
+#include "api2.h"
+#include "record.h"
+
+namespace qmlog
+{
+  // Everything a thread needs to compose a message: the timestamp of the
+  // message being logged and its string representations, computed lazily.
+  // Plus the thread's entry in the reader registry (see read_section_t).
+  struct thread_state_t
+  {
+    unsigned long epoch ; // 0: not reading
+    unsigned nesting ;
+    thread_state_t *next ;
+
+    void new_message() ;
+    record_buffer capture, text ; // arguments and message text of a record
+    record_buffer line ; // composed by abstract_log_t::compose_message()
+    bool composing ; // 'line' or a 'composed' buffer is in use
+    const kv_list_t *kv ; // the key/value pairs of the message dispatched, if any
+
+    // While a dispatcher passes a message to its logs, the text composed
+    // for one log is kept for the other logs with the same layout.
+    unsigned long dispatch_serial ; // 0: not dispatching
+    unsigned long last_serial ;
+    enum { composed_slots = 4 } ;
+    struct composed_t
+    {
+      unsigned long serial ;
+      const layout_t *layout ;
+      bool wrapped ; // "Multiline": two lines, separated by '\0'
+      unsigned first_length ;
+      record_buffer text ;
+    } composed[composed_slots] ;
+    unsigned long begin_dispatch() ; // returns the previous serial
+
+    void get_timestamp() ;
+    void set_timestamp(const struct timespec &monotonic, const struct timeval &real) ;
+    bool got_timestamp ;
+    struct timespec monotonic_timestamp ;
+    struct timeval timestamp ;
+
+    // The timezone data (tzset(), the symlink) is only refreshed, when the
+    // timezone watcher reports a change; the watcher is asked once a second.
+    void check_timezone() ;
+    bool timezone_checked ;
+    time_t timezone_second ;
+    unsigned long timezone_generation ;
+
+    // The local time and the strings made of it (date, time, offset) are
+    // only computed again, when the second or the timezone changes.
+    void get_localtime() ;
+    void forget_localtime() ; // the timezone was changed
+    bool got_localtime ;
+    bool localtime_valid ;
+    time_t localtime_second ;
+    struct tm localtime ;
+
+    bool has_monotonic ;
+    bool has_monotonic_nano ;
+    bool has_monotonic_micro ;
+    bool has_monotonic_milli ;
+    char s_mono[24], s_mono_nano[10], s_mono_micro[7], s_mono_milli[4] ;
+
+    bool has_gmt_offset ;
+    smart_buffer<32> s_gmt_offset ;
+
+    bool has_tz_symlink ;
+    int tz_symlink_offset ;
+    dynamic_buffer s_tz_symlink ;
+
+    bool has_date ;
+    smart_buffer<32> s_date ;
+
+    bool has_time ;
+    bool has_time_micro ;
+    bool has_time_milli ;
+    smart_buffer<32> s_time ;
+    char s_time_micro[7], s_time_milli[4] ;
+
+    pid_t last_pid ;
+    dynamic_buffer s_pid ;
+
+    // set while decoding messages logged by another process
+    pid_t foreign_pid ;
+    const char *foreign_tz_symlink ;
+
+    const char *str_monotonic() ;
+    const char *str_monotonic_nano() ;
+    const char *str_monotonic_micro() ;
+    const char *str_monotonic_milli() ;
+    const char *str_gmt_offset() ;
+    const char *str_tz_abbreviation() ;
+    const char *str_date() ;
+    const char *str_time() ;
+    const char *str_time_micro() ;
+    const char *str_time_milli() ;
+    const char *str_tz_symlink() ;
+    const char *str_pid() ;
+
+    thread_state_t() ;
+  } ;
+
+  thread_state_t *thread_state() ;
+
+  // getpid() of the first call, refreshed in the child of a fork()
+  pid_t current_pid() ;
+
+  // Marks the messages passed to the logs by a dispatcher: the composed
+  // text can be reused only for the logs of the same dispatch.
+  class dispatch_t
+  {
+    thread_state_t *state ;
+    unsigned long previous ;
+    const kv_list_t *previous_kv ;
+  public:
+    dispatch_t(thread_state_t *s, const kv_list_t *kv=NULL) : state(s), previous(s->begin_dispatch()), previous_kv(s->kv) { s->kv = kv ; }
+   ~dispatch_t() { state->dispatch_serial = previous ; state->kv = previous_kv ; }
+  } ;
+
+  // Read side of the lock-free publishing of dispatcher data (log lists,
+  // proxies, names): the data seen inside of a section stays valid until
+  // the section is left. Sections may be nested.
+  class read_section_t
+  {
+    thread_state_t *state ;
+  public:
+    read_section_t() ;
+   ~read_section_t() ;
+  } ;
+
+  // Write side: a replaced pointer may be freed as soon as this returns,
+  // all the sections which could see the old value are left.
+  void synchronize_readers() ;
+
+  // Serializes all the configuration changes: attaching, detaching, proxies...
+  class config_lock_t
+  {
+  public:
+    config_lock_t() ;
+   ~config_lock_t() ;
+  } ;
+
+  // Parts of the pthread_atfork() handlers of qmlog::object: the lock and
+  // the reader registry are held across fork(). Only the calling thread
+  // exists in the child, the entries of the others are dropped.
+  void config_before_fork() ;
+  void registry_before_fork() ;
+  void locks_after_fork_in_parent() ;
+  void locks_after_fork_in_child() ;
+}
+
+#endif // LIBQMLOG_THREAD_H
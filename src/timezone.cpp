@@ -0,0 +1,163 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <sys/inotify.h>
+#include <limits.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "timezone.h"
+#include "thread.h"
+
+namespace qmlog
+{
+  static const char localtime_path[] = "/etc/localtime" ;
+
+  // for the messages logged without qmlog::object: every check is a change
+  static unsigned long unwatched_generation = 0 ;
+
+  timezone_watcher_t::timezone_watcher_t()
+  {
+    interval = 1 ;
+    next_check = 0 ;
+    current_generation = 1 ;
+    pthread_mutex_init(&mutex, NULL) ;
+
+    const char *value = getenv("TZ") ;
+    tz_set = value != NULL ;
+    tz = value ? value : "" ;
+    watch() ;
+  }
+
+  void timezone_watcher_t::watch()
+  {
+    // the symlink is replaced, not written: watch the directory
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC) ;
+    int events = IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_CLOSE_WRITE | IN_ATTRIB ;
+    if (fd>=0 and inotify_add_watch(fd, "/etc", events | IN_ONLYDIR) < 0)
+    {
+      close(fd) ;
+      fd = -1 ;
+    }
+    if (fd<0)
+      localtime_exists = lstat(localtime_path, &localtime_stat)==0 ;
+  }
+
+  timezone_watcher_t::~timezone_watcher_t()
+  {
+    if (fd>=0)
+      close(fd) ;
+    pthread_mutex_destroy(&mutex) ;
+  }
+
+  void timezone_watcher_t::before_fork()
+  {
+    pthread_mutex_lock(&mutex) ;
+  }
+
+  void timezone_watcher_t::after_fork_in_parent()
+  {
+    pthread_mutex_unlock(&mutex) ;
+  }
+
+  void timezone_watcher_t::after_fork_in_child()
+  {
+    if (fd>=0)
+      close(fd) ;
+    watch() ;
+    next_check = 0 ;
+    __atomic_add_fetch(&current_generation, 1, __ATOMIC_RELEASE) ;
+    pthread_mutex_unlock(&mutex) ;
+  }
+
+  void timezone_watcher_t::set_interval(int seconds)
+  {
+    __atomic_store_n(&interval, seconds>0 ? seconds : 1, __ATOMIC_RELAXED) ;
+    __atomic_store_n(&next_check, (time_t)0, __ATOMIC_RELAXED) ;
+  }
+
+  bool timezone_watcher_t::tz_changed()
+  {
+    const char *value = getenv("TZ") ;
+    if ((value!=NULL) == tz_set and (value==NULL or tz==value))
+      return false ;
+    tz_set = value != NULL ;
+    tz = value ? value : "" ;
+    return true ;
+  }
+
+  bool timezone_watcher_t::localtime_changed()
+  {
+    if (fd<0)
+    {
+      struct stat st ;
+      bool exists = lstat(localtime_path, &st)==0 ;
+      bool same = exists==localtime_exists and (not exists or
+        (st.st_dev==localtime_stat.st_dev and st.st_ino==localtime_stat.st_ino and
+         st.st_mtime==localtime_stat.st_mtime and st.st_size==localtime_stat.st_size)) ;
+      localtime_exists = exists ;
+      localtime_stat = st ;
+      return not same ;
+    }
+
+    bool changed = false ;
+    char events[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event)))) ;
+    for (ssize_t len; (len = read(fd, events, sizeof(events))) > 0; )
+    {
+      for (char *p = events; p < events + len; )
+      {
+        const struct inotify_event *e = (const struct inotify_event *) p ;
+        if (e->mask & IN_Q_OVERFLOW or (e->len and strcmp(e->name, "localtime")==0))
+          changed = true ;
+        p += sizeof(struct inotify_event) + e->len ;
+      }
+    }
+    return changed ;
+  }
+
+  unsigned long timezone_watcher_t::check(time_t now)
+  {
+    if (now < __atomic_load_n(&next_check, __ATOMIC_RELAXED))
+      return __atomic_load_n(&current_generation, __ATOMIC_ACQUIRE) ;
+    if (pthread_mutex_trylock(&mutex)==0) // otherwise another thread is checking right now
+    {
+      if (now >= next_check)
+      {
+        bool changed = tz_changed() ;
+        changed = localtime_changed() or changed ;
+        if (changed)
+          __atomic_add_fetch(&current_generation, 1, __ATOMIC_RELEASE) ;
+        __atomic_store_n(&next_check, now + __atomic_load_n(&interval, __ATOMIC_RELAXED), __ATOMIC_RELAXED) ;
+      }
+      pthread_mutex_unlock(&mutex) ;
+    }
+    return __atomic_load_n(&current_generation, __ATOMIC_ACQUIRE) ;
+  }
+
+  unsigned long timezone_watcher_t::generation(time_t now)
+  {
+    read_section_t section ; // qmlog::object may be destroyed meanwhile
+    if (timezone_watcher_t *w = __atomic_load_n(&object.timezone_watcher, __ATOMIC_ACQUIRE))
+      return w->check(now) ;
+    return __atomic_add_fetch(&unwatched_generation, 1, __ATOMIC_RELAXED) ;
+  }
+}
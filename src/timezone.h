@@ -0,0 +1,76 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+
+// Internal header, not installed: noticing timezone changes
+
+#ifndef LIBQMLOG_TIMEZONE_H
+#define LIBQMLOG_TIMEZONE_H
+
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include <string>
+
+#include "api2.h"
+
+namespace qmlog
+{
+  // Owned by qmlog::object. Watches /etc/localtime with inotify, or looks
+  // at it with lstat() if inotify is not available, and compares TZ with
+  // its last value. Nothing is done more often than once in 'interval'
+  // seconds, and only by one of the logging threads: there is no thread
+  // of its own.
+  class timezone_watcher_t
+  {
+    int fd ; // inotify descriptor, -1 if polling
+    int interval ;
+    time_t next_check ;
+    unsigned long current_generation ;
+    pthread_mutex_t mutex ; // the thread doing the check
+    bool tz_set ;
+    std::string tz ;
+    bool localtime_exists ;
+    struct stat localtime_stat ;
+
+    void watch() ;
+    bool tz_changed() ;
+    bool localtime_changed() ;
+    unsigned long check(time_t now) ;
+  public:
+    timezone_watcher_t() ;
+   ~timezone_watcher_t() ;
+    void set_interval(int seconds) ;
+
+    // The inotify descriptor is shared with the parent after fork(), the
+    // events read by one process are lost for the other: the child makes
+    // its own and looks at the timezone again.
+    void before_fork() ;
+    void after_fork_in_parent() ;
+    void after_fork_in_child() ;
+
+    // Changes after /etc/localtime or TZ changed: tzset() and the cached
+    // timezone data are needed again then. 'now' is the current second.
+    static unsigned long generation(time_t now) ;
+  } ;
+}
+
+#endif // LIBQMLOG_TIMEZONE_H
@@ -0,0 +1,126 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+using namespace std ;
+
+#include <qmlog>
+
+/* Turns the files written by qmlog::log_binary_file into text */
+
+static struct { const char *name ; int mask ; } field_names[] =
+{
+  { "Multiline", qmlog::Multiline },
+  { "Message", qmlog::Message },
+  { "Line", qmlog::Line },
+  { "Function", qmlog::Function },
+  { "Pid", qmlog::Pid },
+  { "Name", qmlog::Name },
+  { "Monotonic", qmlog::Monotonic },
+  { "Monotonic_Milli", qmlog::Monotonic_Milli },
+  { "Monotonic_Micro", qmlog::Monotonic_Micro },
+  { "Monotonic_Nano", qmlog::Monotonic_Nano },
+  { "Date", qmlog::Date },
+  { "Time", qmlog::Time },
+  { "Time_Milli", qmlog::Time_Milli },
+  { "Time_Micro", qmlog::Time_Micro },
+  { "Timezone_Symlink", qmlog::Timezone_Symlink },
+  { "Timezone_Abbreviation", qmlog::Timezone_Abbreviation },
+  { "Timezone_Offset", qmlog::Timezone_Offset },
+  { "Level", qmlog::Level },
+  { "All_Fields", qmlog::All_Fields },
+  { NULL, 0 }
+} ;
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "usage: %s [-f fields] [binary log file...]\n", program) ;
+  fprintf(stderr, "  -f fields  a number or a comma separated list of:\n") ;
+  for (int i=0; field_names[i].name; ++i)
+    fprintf(stderr, "             %s\n", field_names[i].name) ;
+  fprintf(stderr, "  without -f the fields of the log which wrote the file are used\n") ;
+}
+
+// returns -1 if the list is not valid
+static int parse_fields(const char *list)
+{
+  char *end ;
+  long number = strtol(list, &end, 0) ;
+  if (*list and *end=='\0')
+    return number & qmlog::All_Fields ;
+
+  int mask = 0 ;
+  string s = list ;
+  for (size_t pos=0; pos<=s.size(); )
+  {
+    size_t comma = s.find(',', pos) ;
+    if (comma==string::npos)
+      comma = s.size() ;
+    string name = s.substr(pos, comma-pos) ;
+    int i = 0 ;
+    while (field_names[i].name and name!=field_names[i].name)
+      ++i ;
+    if (field_names[i].name==NULL)
+      return -1 ;
+    mask |= field_names[i].mask ;
+    pos = comma + 1 ;
+  }
+  return mask ;
+}
+
+int main(int argc, char *argv[])
+{
+  int fields = -1 ;
+  for (int opt; (opt = getopt(argc, argv, "f:h")) != -1; )
+  {
+    if (opt=='f' and (fields = parse_fields(optarg)) >= 0)
+      continue ;
+    usage(argv[0]) ;
+    return opt=='h' ? 0 : 1 ;
+  }
+
+  int result = 0 ;
+  if (optind==argc)
+    result = qmlog::log_binary_file::decode(stdin, stdout, fields) ? 0 : 2 ;
+  for (int i=optind; i<argc; ++i)
+  {
+    FILE *in = fopen(argv[i], "r") ;
+    if (in==NULL)
+    {
+      fprintf(stderr, "%s: can't open '%s': %m\n", argv[0], argv[i]) ;
+      result = 1 ;
+      continue ;
+    }
+    if (not qmlog::log_binary_file::decode(in, stdout, fields))
+    {
+      fprintf(stderr, "%s: '%s' is not a binary log or is truncated\n", argv[0], argv[i]) ;
+      result = 2 ;
+    }
+    fclose(in) ;
+  }
+  return result ;
+}
@@ -0,0 +1,68 @@
+/*=======================================================================\
+#                                                                        $
+#   Copyright (C) 2010 Nokia Corporation.                                $
+#                                                                        $
+#   Author: Ilya Dogolazky <ilya.dogolazky@nokia.com>                    $
+#   Author: Victor Portnov <ext-victor.portnov@nokia.com>                $
+#                                                                        $
+#     This file is part of qmlog                                         $
+#                                                                        $
+#     qmlog is free software; you can redistribute it and/or modify      $
+#     it under the terms of the GNU Lesser General Public License        $
+#     version 2.1 as published by the Free Software Foundation.          $
+#                                                                        $
+#     qmlog is distributed in the hope that it will be useful, but       $
+#     WITHOUT ANY WARRANTY;  without even the implied warranty  of       $
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               $
+#     See the GNU Lesser General Public License  for more details.       $
+#                                                                        $
+#   You should have received a copy of the GNU  Lesser General Public    $
+#   License along with qmlog. If not, see http://www.gnu.org/licenses/   $
+\_______________________________________________________________________*/
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <qmlog>
+
+/* Reads the rings written by qmlog::log_shm_ring, of running processes
+ * or of crashed ones: the ring stays in /dev/shm until it's removed */
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "usage: %s [-f] pid|ring name...\n", program) ;
+  fprintf(stderr, "  a pid stands for the ring /qmlog-<pid>\n") ;
+  fprintf(stderr, "  -f  keep printing the new messages of the (last) ring\n") ;
+}
+
+int main(int argc, char *argv[])
+{
+  bool follow = false ;
+  for (int opt; (opt = getopt(argc, argv, "fh")) != -1; )
+  {
+    if (opt=='f')
+    {
+      follow = true ;
+      continue ;
+    }
+    usage(argv[0]) ;
+    return opt=='h' ? 0 : 1 ;
+  }
+  if (optind==argc)
+  {
+    usage(argv[0]) ;
+    return 1 ;
+  }
+
+  int result = 0 ;
+  for (int i=optind; i<argc; ++i)
+  {
+    if (not qmlog::log_shm_ring::tail(argv[i], stdout, follow and i+1==argc))
+    {
+      fprintf(stderr, "%s: no ring '%s'\n", argv[0], argv[i]) ;
+      result = 2 ;
+    }
+  }
+  return result ;
+}
@@ -0,0 +1,14 @@
+TEMPLATE = app
+TARGET = qmlog-tail
+
+SOURCES += qmlog-tail.cpp
+INCLUDEPATH += ../../src/ ../../
+
+QMAKE_LIBDIR_FLAGS += -L../../src
+LIBS += -lqmlog -lpthread
+
+target.path = $$(DESTDIR)/usr/bin
+
+QMAKE_CXXFLAGS = -Wall -Werror -Wno-psabi
+
+INSTALLS += target